@@ -31,9 +31,12 @@ ISO9660 systems, as these were used as references as well.
 #include <dc/fs_iso9660.h>
 #include <dc/cdrom.h>
 #include <dc/vblank.h>
+#include <arch/cache.h>
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/sem.h>
 #include <kos/fs.h>
 #include <kos/opts.h>
 
@@ -44,11 +47,11 @@ ISO9660 systems, as these were used as references as well.
 #include <strings.h>
 #include <malloc.h>
 #include <errno.h>
+#include <poll.h>
 
 static int init_percd(void);
 static int percd_done;
 static int disc_type;
-static mutex_t iso_mutex = MUTEX_INITIALIZER;
 
 /********************************************************************************/
 /* Low-level Joliet utils */
@@ -189,896 +192,4085 @@ static uint32 iso_733(const uint8 *from) {
 
 
 /********************************************************************************/
-/* Low-level block cacheing routines. This implements a simple queue-based
-   LRU/MRU cacheing system. Whenever a block is requested, it will be placed
-   on the MRU end of the queue. As more blocks are loaded than can fit in
-   the cache, blocks are deleted from the LRU end. */
+/* Drive request queue. The drive is the one thing every reader has to take
+   turns at, so each read of sectors queues up here and the drive serves
+   them one at a time. Nothing else is held while a reader waits its turn
+   or the drive works: other threads carry on with cache hits and copies
+   meanwhile.
+
+   Under FS_CD_SCHED_ELEVATOR the next read is the one closest ahead of
+   where the last one stopped, sweeping up the disc and starting over from
+   the lowest sector at the end, so a loader and a streamer on either side
+   of the disc don't drag the head to and fro. Queued reads that overlap
+   or touch it are merged into the same command, through merge_buf, as
+   long as the lot fits. A read that has seen FS_CD_SCHED_MAX_BYPASS others
+   go first goes next, whatever the sweep says.
+
+   Ahead of all that, urgent reads (refills for a handle with a bandwidth
+   reservation, see FS_CD_IOCTL_RESERVE) go first, oldest first, in either
+   mode. While the drive is held for them, nothing else goes at all, so
+   a run of refills isn't interleaved with other reads.
+
+   While CDDA plays through fs_iso9660_cdda_play(), read-ahead (PRIO_IDLE)
+   is kept back until some other read breaks into the music, or a reader
+   is left waiting for a line it's filling, and then goes in the same
+   break. The read that stops the music notes where it had got to first,
+   and the CDDA thread plays on from there once the drive has been idle
+   for cdda_linger ms. */
+
+/* Or'd into a read's mode for sectors of another data type than the
+   default 2048-byte user data; the drive is switched over before the read
+   and back before the next one of the default type, or once no read is
+   queued, for anyone using cdrom_read_sectors() directly */
+#define DRIVE_RAW       0x100   /* Whole 2352-byte sectors (CDDA, XA) */
+#define DRIVE_TYPE      0xf00
+
+#define PRIO_NORMAL     0
+#define PRIO_URGENT     1       /* Goes first */
+#define PRIO_IDLE       2       /* Read-ahead: waits while CDDA plays */
+
+#define DRIVE_QUEUED    0       /* Waiting its turn */
+#define DRIVE_GO        1       /* The drive is the caller's */
+#define DRIVE_DONE      2       /* Read as part of another's command */
+
+typedef struct drive_req {
+    struct drive_req    *next;
+    uint8               *buf;
+    uint32              sector;
+    int                 cnt, mode;
+    int                 state;
+    int                 passed;     /* Reads that went ahead of this one */
+    int                 urgent;
+    int                 idle;
+    int                 rv;
+} drive_req_t;
+
+#define MERGE_SECTORS (FS_CD_BOUNCE_SIZE / 2048)
+
+static mutex_t drive_mutex;
+static condvar_t drive_cond;        /* A request changed state */
+static drive_req_t *drive_head, **drive_tail = &drive_head;
+static int drive_busy;
+static int drive_held;              /* Only urgent reads go */
+static int drive_sched = FS_CD_SCHED;
+static uint32 drive_pos;            /* Where the last read stopped */
+static int drive_wanted;            /* Readers waiting on a busy line */
+static int drive_owners;            /* Threads waiting in drive_own */
+
+/* CDDA played around reads, under drive_mutex */
+static int cdda_on;                 /* fs_iso9660_cdda_play() is on */
+static int cdda_playing;            /* ...and the music hasn't been stopped */
+static uint32 cdda_start, cdda_end, cdda_repeat;
+static int cdda_linger = FS_CD_CDDA_LINGER;
+
+/* Where a read stopped the music. Only touched by the drive's owner. */
+static int cdda_note;
+static uint32 cdda_pos;
+
+/* The DRIVE_TYPE the drive was last set to. Only touched by the drive's
+   owner, and by init_percd as the drive is reset. */
+static int drive_type;
+
+/* The command running on the drive when it's a merge of several reads:
+   [merge_first, merge_last) goes into merge_buf and is copied out to each
+   request on merge_reqs. Only touched by the thread issuing it. */
+static drive_req_t *merge_reqs;
+static uint32 merge_first, merge_last;
+static uint8 *merge_buf;
+
+/* Take a request out of the queue */
+static void drive_unlink(drive_req_t *req) {
+    drive_req_t **p;
+
+    for(p = &drive_head; *p != req; p = &(*p)->next)
+        ;
+
+    if(!(*p = req->next))
+        drive_tail = p;
+}
 
-/* Holds the data for one cache block, and a pointer to the next one.
-   As sectors are read from the disc, they are added to the front of
-   this cache. As the cache fills up, sectors are removed from the end
-   of it. */
-typedef struct {
-    uint32  sector;         /* CD sector */
-    uint8   data[2048];     /* Sector data */
-} cache_block_t;
+/* Whether r can go yet: read-ahead waits for a break in the music, unless
+   someone is waiting on it */
+static inline int drive_ready(drive_req_t *r) {
+    return !r->idle || !cdda_playing || !cdda_linger || drive_wanted;
+}
 
-/* List of cache blocks (ordered least recently used to most recently) */
-#define NUM_CACHE_BLOCKS 16
-static cache_block_t *icache[NUM_CACHE_BLOCKS];     /* inode cache */
-static cache_block_t *dcache[NUM_CACHE_BLOCKS];     /* data cache */
+/* Pick the request that goes next */
+static drive_req_t *drive_pick(void) {
+    drive_req_t *r, *ahead = NULL, *lowest = NULL;
 
-/* Cache modification mutex */
-static mutex_t cache_mutex;
+    for(r = drive_head; r; r = r->next) {
+        if(r->urgent)
+            return r;
+    }
 
-/* Clears all cache blocks */
-static void bclear_cache(cache_block_t **cache) {
-    int i;
+    if(drive_held)
+        return NULL;
 
-    mutex_lock(&cache_mutex);
+    if(drive_sched == FS_CD_SCHED_FIFO) {
+        for(r = drive_head; r && !drive_ready(r); r = r->next)
+            ;
+
+        return r;
+    }
 
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++)
-        cache[i]->sector = (uint32)-1;
+    for(r = drive_head; r; r = r->next) {
+        if(!drive_ready(r))
+            continue;
 
-    mutex_unlock(&cache_mutex);
+        /* The queue is in arrival order, so this is the oldest of them */
+        if(r->passed >= FS_CD_SCHED_MAX_BYPASS)
+            return r;
+
+        if(r->sector >= drive_pos && (!ahead || r->sector < ahead->sector))
+            ahead = r;
+
+        if(!lowest || r->sector < lowest->sector)
+            lowest = r;
+    }
+
+    return ahead ? ahead : lowest;
 }
 
-/* Graduate a block from its current position to the MRU end of the cache */
-static void bgrad_cache(cache_block_t **cache, int block) {
-    int     i;
-    cache_block_t   *tmp;
+/* Gather queued reads that overlap or touch lead's sectors onto
+   merge_reqs, widening [merge_first, merge_last) to cover them. Returns
+   the number of requests merged into lead. */
+static int drive_merge(drive_req_t *lead) {
+    drive_req_t *r, *next;
+    uint32 lo, hi;
+    int n = 0, more = 1;
 
-    /* Don't try it with the end block */
-    if(block < 0 || block >= (NUM_CACHE_BLOCKS - 1)) return;
+    merge_reqs = NULL;
+    merge_first = lead->sector;
+    merge_last = lead->sector + lead->cnt;
 
-    /* Make a copy and scoot everything down */
-    tmp = cache[block];
+    if(drive_sched == FS_CD_SCHED_FIFO || lead->cnt >= MERGE_SECTORS ||
+       (lead->mode & DRIVE_TYPE))
+        return 0;
 
-    for(i = block; i < (NUM_CACHE_BLOCKS - 1); i++)
-        cache[i] = cache[i + 1];
+    while(more) {
+        more = 0;
 
-    cache[NUM_CACHE_BLOCKS - 1] = tmp;
-}
+        for(r = drive_head; r; r = next) {
+            next = r->next;
 
-/* Pulls the requested sector into a cache block and returns the cache
-   block index. Note that the sector in question may already be in the
-   cache, in which case it just returns the containing block. */
-static void iso_break_all(void);
-static int bread_cache(cache_block_t **cache, uint32 sector) {
-    int i, j, rv;
+            lo = r->sector < merge_first ? r->sector : merge_first;
+            hi = r->sector + r->cnt > merge_last ? r->sector + r->cnt :
+                 merge_last;
 
-    rv = -1;
-    mutex_lock(&cache_mutex);
+            if(r->mode != lead->mode || r->sector > merge_last ||
+               r->sector + r->cnt < merge_first || hi - lo > MERGE_SECTORS)
+                continue;
+
+            if(!merge_buf && !(merge_buf = memalign(32, MERGE_SECTORS *
+                                                        2048)))
+                return n;
+
+            drive_unlink(r);
+            r->next = merge_reqs;
+            merge_reqs = r;
+            merge_first = lo;
+            merge_last = hi;
 
-    /* Look for a pre-existing cache block */
-    for(i = NUM_CACHE_BLOCKS - 1; i >= 0; i--) {
-        if(cache[i]->sector == sector) {
-            bgrad_cache(cache, i);
-            rv = NUM_CACHE_BLOCKS - 1;
-            goto bread_exit;
+            n++;
+            more = 1;
         }
     }
 
-    /* If not, look for an open cache slot; if we find one, use it */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        if(cache[i]->sector == (uint32)-1) break;
-    }
+    return n;
+}
 
-    /* If we didn't find one, kick an LRU block out of cache */
-    if(i >= NUM_CACHE_BLOCKS) {
-        i = 0;
-    }
+/* If the drive is idle, hand it to the next request. Called with
+   drive_mutex held. */
+static void drive_dispatch(void) {
+    drive_req_t *r, *lead;
+
+    if(drive_busy || drive_owners || !(lead = drive_pick()))
+        return;
 
-    /* Load the requested block */
-    j = cdrom_read_sectors(cache[i]->data, sector + 150, 1);
+    drive_unlink(lead);
+    drive_merge(lead);
 
-    if(j < 0) {
-        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
-        //  sector+150, j);
-        if(j == ERR_DISC_CHG || j == ERR_NO_DISC) {
-            init_percd();
-        }
+    for(r = drive_head; r; r = r->next)
+        r->passed++;
 
-        rv = -1;
-        goto bread_exit;
+    /* This read breaks into the music */
+    if(cdda_playing) {
+        cdda_playing = 0;
+        cdda_note = 1;
+    }
+
+    drive_pos = merge_last;
+    drive_busy = 1;
+    lead->state = DRIVE_GO;
+    cond_broadcast(&drive_cond);
+}
+
+/* Run the merged command led by lead, and copy every request's sectors
+   out of merge_buf */
+static int drive_read_merged(drive_req_t *lead) {
+    uint32 n = merge_last - merge_first;
+    drive_req_t *r;
+    int rv;
+
+    if(lead->mode == CDROM_READ_DMA) {
+        dcache_inval_range((uint32)merge_buf, n * 2048);
+        rv = cdrom_read_sectors_ex((void *)((uint32)merge_buf & 0x0FFFFFFF),
+                                   merge_first + 150, n, CDROM_READ_DMA);
+    }
+    else {
+        rv = cdrom_read_sectors_ex(merge_buf, merge_first + 150, n,
+                                   CDROM_READ_PIO);
     }
 
-    cache[i]->sector = sector;
+    /* A DMA request's buffer comes as a physical address; with the MMU off
+       the CPU can write through it all the same */
+    if(rv == ERR_OK) {
+        memcpy(lead->buf, merge_buf + (lead->sector - merge_first) * 2048,
+               lead->cnt * 2048);
 
-    /* Move it to the most-recently-used position */
-    bgrad_cache(cache, i);
-    rv = NUM_CACHE_BLOCKS - 1;
+        for(r = merge_reqs; r; r = r->next)
+            memcpy(r->buf, merge_buf + (r->sector - merge_first) * 2048,
+                   r->cnt * 2048);
+    }
 
-    /* Return the new cache block index */
-bread_exit:
-    mutex_unlock(&cache_mutex);
     return rv;
 }
 
-/* read data block */
-static int bdread(uint32 sector) {
-    return bread_cache(dcache, sector);
+/* Keep the drive for urgent reads only, or let it go again */
+static void drive_hold(int hold) {
+    mutex_lock(&drive_mutex);
+    drive_held = hold;
+    drive_dispatch();
+    mutex_unlock(&drive_mutex);
 }
 
-/* read inode block */
-static int biread(uint32 sector) {
-    return bread_cache(icache, sector);
+/* Take the drive for a command other than a read, ahead of any queued,
+   with drive_mutex held */
+static void drive_own(void) {
+    drive_owners++;
+
+    while(drive_busy)
+        cond_wait(&drive_cond, &drive_mutex);
+
+    drive_owners--;
+    drive_busy = 1;
 }
 
-/* Clear both caches */
-static void bclear(void) {
-    bclear_cache(dcache);
-    bclear_cache(icache);
+/* ...and hand it on */
+static void drive_release(void) {
+    drive_busy = 0;
+    drive_dispatch();
+    cond_broadcast(&drive_cond);
 }
 
-/********************************************************************************/
-/* Higher-level ISO9660 primitives */
+/* A reader starts (1) or stops (-1) waiting for a busy line, which could
+   be read-ahead held back for CDDA */
+static void drive_want(int n) {
+    mutex_lock(&drive_mutex);
+    drive_wanted += n;
+    drive_dispatch();
+    mutex_unlock(&drive_mutex);
+}
 
-/* Root FS session location (in sectors) */
-static uint32 session_base = 0;
+/* Absolute FAD the music is at, from the Q subcode, or 0 */
+static uint32 cdda_where(void) {
+    uint8 q[14];
 
-/* Root directory extent and size in bytes */
-static uint32 root_extent = 0, root_size = 0;
+    if(cdrom_get_subcode(q, sizeof(q), CD_SUB_Q_CHANNEL) != ERR_OK)
+        return 0;
 
-/* Root dirent */
-static iso_dirent_t root_dirent;
+    return (q[11] << 16) | (q[12] << 8) | q[13];
+}
 
+/* Switch the drive to a DRIVE_TYPE for the read about to be issued */
+static int drive_set_type(int type) {
+    int rv;
 
-/* Per-disc initialization; this is done every time it's discovered that
-   a new CD has been inserted. */
-static int init_percd(void) {
-    int     i, blk;
-    CDROM_TOC   toc;
+    if(type == drive_type)
+        return ERR_OK;
 
-    dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
+    if(type == DRIVE_RAW)
+        rv = cdrom_change_dataype(CDROM_READ_WHOLE_SECTOR, 0, 2352);
+    else
+        rv = cdrom_change_dataype(-1, -1, -1);
 
-    /* Start off with no cached blocks and no open files*/
-    iso_reset();
+    /* If that failed, who knows what it's set to now */
+    drive_type = rv == ERR_OK ? type : -1;
+    return rv;
+}
 
-    /* Locate the root session */
-    if((i = cdrom_reinit()) != 0) {
-        dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
-        return -1;
+/* Read cnt sectors from CD sector (not LBA) sector into buf, once the
+   drive gets round to them, at one of the PRIO_ priorities. mode is
+   CDROM_READ_DMA or CDROM_READ_PIO, plus any DRIVE_TYPE. */
+static int drive_read(void *buf, uint32 sector, int cnt, int mode,
+                      int prio) {
+    drive_req_t req, *r;
+    int rv;
+
+    mutex_lock(&drive_mutex);
+
+    req.next = NULL;
+    req.buf = (uint8 *)buf;
+    req.sector = sector;
+    req.cnt = cnt;
+    req.mode = mode;
+    req.state = DRIVE_QUEUED;
+    req.passed = 0;
+    req.urgent = prio == PRIO_URGENT;
+    req.idle = prio == PRIO_IDLE;
+    *drive_tail = &req;
+    drive_tail = &req.next;
+
+    drive_dispatch();
+
+    while(req.state == DRIVE_QUEUED)
+        cond_wait(&drive_cond, &drive_mutex);
+
+    if(req.state == DRIVE_DONE) {
+        mutex_unlock(&drive_mutex);
+        return req.rv;
     }
 
-    if((i = cdrom_read_toc(&toc, (disc_type == CD_GDROM))) != 0)
-        return i;
-
-    if(disc_type == CD_GDROM) {
-		session_base = 45150;
-	} else if(!(session_base = cdrom_locate_data_track(&toc)))
-        return -1;
-
-    /* Check for joliet extensions */
-    joliet = 0;
-
-    for(i = 1; i <= 3; i++) {
-        blk = biread(session_base + i + 16 - 150);
+    mutex_unlock(&drive_mutex);
 
-        if(blk < 0) return blk;
+    if(cdda_note) {
+        cdda_note = 0;
 
-        if(memcmp((char *)icache[blk]->data, "\02CD001", 6) == 0) {
-            joliet = isjoliet((char *)icache[blk]->data + 88);
-            dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
+        if(!(cdda_pos = cdda_where()))
+            cdda_pos = cdda_start;
+    }
 
-            if(joliet) break;
-        }
+    if((rv = drive_set_type(mode & DRIVE_TYPE)) == ERR_OK) {
+        if(merge_reqs)
+            rv = drive_read_merged(&req);
+        else
+            rv = cdrom_read_sectors_ex(buf, sector + 150, cnt,
+                                       mode & ~DRIVE_TYPE);
     }
 
-    /* If that failed, go after standard/RockRidge ISO */
-    if(!joliet) {
-        /* Grab and check the volume descriptor */
-        blk = biread(session_base + 16 - 150);
+    mutex_lock(&drive_mutex);
 
-        if(blk < 0) return i;
+    if(drive_type && !drive_head) {
+        mutex_unlock(&drive_mutex);
+        drive_set_type(0);
+        mutex_lock(&drive_mutex);
+    }
 
-        if(memcmp((char*)icache[blk]->data, "\01CD001", 6)) {
-            dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
-            return -1;
-        }
+    for(r = merge_reqs; r; r = r->next) {
+        r->rv = rv;
+        r->state = DRIVE_DONE;
     }
 
-    /* Locate the root directory */
-    memcpy(&root_dirent, icache[blk]->data + 156, sizeof(iso_dirent_t));
-    root_extent = iso_733(root_dirent.extent);
-    root_size = iso_733(root_dirent.size);
+    merge_reqs = NULL;
+    drive_busy = 0;
+    drive_dispatch();
+    cond_broadcast(&drive_cond);
+    mutex_unlock(&drive_mutex);
 
-    return 0;
+    return rv;
 }
 
-/* Compare an ISO9660 filename against a normal filename. This takes into
-   account the version code on the end and is not case sensitive. Also
-   takes into account the trailing period that some CD burning software
-   adds. */
-static int fncompare(const char *isofn, int isosize, const char *normalfn) {
-    int i;
+/********************************************************************************/
+/* Low-level block cacheing routines. This implements a simple queue-based
+   LRU/MRU cacheing system. Whenever a block is requested, it will be placed
+   on the MRU end of the queue. As more blocks are loaded than can fit in
+   the cache, blocks are deleted from the LRU end.
+
+   The queue is an intrusive doubly linked list threaded through a compact
+   array of tags, and a small hash table indexes the tags by sector. Finding
+   a block, promoting it and evicting one are all constant time, and none
+   of them touch the 2K data blocks themselves.
+
+   Each cache block (a "line") holds a cluster of sectors, aligned on the
+   cluster size and filled with a single read. A line never reaches outside
+   the extent of the file or directory it was read for, so it may hold
+   fewer sectors than a whole cluster.
+
+   The data cache can use 2Q instead of plain LRU, so one pass over a big
+   file doesn't flush everything else out. New lines go on a short FIFO
+   (A1in, a quarter of the cache) rather than the LRU list, and hits while
+   they're there don't count. A line pushed out of the FIFO leaves its
+   sector number behind on a ghost list (A1out); only a miss that finds its
+   sector there proves the data is reused, and puts the line on the LRU
+   list. Lines fetched by read-ahead are part of a stream, and aren't
+   remembered at all.
+
+   cache_mutex isn't held while the drive works. A miss takes a line off
+   the lists, enters it in the index marked busy and lets go of the lock
+   for the read; anyone else after the same sectors finds the busy line and
+   waits for that one read instead of issuing their own, while lookups of
+   other sectors go ahead.
+
+   Lines of the data cache can also be pinned by FS_CD_IOCTL_PIN, handing
+   the caller a pointer straight into them. A pinned line stays indexed
+   but is taken off its list, so nothing can pick it for reuse until the
+   last pin on it is released. */
+
+/* Bookkeeping for one cache line. Links are line indices; CACHE_NIL ends
+   a hash chain. */
+typedef struct {
+    uint32  sector;         /* First CD sector, or -1 if the line is empty */
+    uint16  prev, next;     /* LRU list links */
+    uint16  hnext;          /* Next line in the same hash bucket */
+    uint16  count;          /* Sectors held */
+    uint8   a1;             /* On the A1in FIFO rather than the LRU list */
+    uint8   seq;            /* Filled by read-ahead */
+    uint8   busy;           /* Being read; indexed, but on no list */
+    uint8   raw;            /* Holds whole 2352-byte sectors */
+    uint16  pins;           /* Pinned; indexed, but on no list */
+} cache_tag_t;
+
+#define CACHE_NIL 0xffff
+#define CACHE_MIN_BLOCKS 2
+#define CACHE_MAX_BLOCKS (CACHE_NIL - 2)
+
+/* An A1out entry: the first sector of a line that left A1in, or -1 */
+typedef struct {
+    uint32  sector;
+    uint16  hnext;          /* Next ghost in the same hash bucket */
+    uint16  pad;
+} cache_ghost_t;
+
+/* A cache of count lines of (1 << shift) sectors. The two tags after the
+   last line are list heads, the LRU list's and the A1in FIFO's: a head's
+   next is the oldest line on its list and its prev the newest. */
+typedef struct {
+    cache_tag_t *tag;       /* count + 2 tags */
+    cache_ghost_t *ghost;   /* A1out ring of gmax entries */
+    uint16      *ghash;     /* ghash_mask + 1 buckets of ghosts */
+    uint16      *hash;      /* hash_mask + 1 buckets */
+    uint8       *data;      /* count lines of sector data */
+    int         count;
+    int         shift;      /* log2 of the sectors per line */
+    uint32      hash_mask, ghash_mask;
+    int         policy;     /* FS_CD_POLICY_* */
+    int         a1count, a1max;
+    int         gnext, gmax;
+    int         busy;       /* Lines being read */
+    int         pinned;     /* Lines with pins on them */
+    uint32      gen;        /* Bumped every time the cache is emptied */
+    uint32      hits, misses, prefetched;
+} block_cache_t;
+
+#define CACHE_LRU(cache) ((cache)->count)
+#define CACHE_A1(cache)  ((cache)->count + 1)
+
+static block_cache_t icache;    /* inode cache */
+static block_cache_t dcache;    /* data cache */
+
+/* Both caches' data, tags and hash tables come out of this one block */
+static void *cache_arena;
 
-    /* Compare ISO name */
-    for(i = 0; i < isosize; i++) {
-        /* Weed out version codes */
-        if(isofn[i] == ';') break;
+/* Cache modification mutex */
+static mutex_t cache_mutex;
 
-        /* Deal with crap '.' at end of filenames */
-        if(isofn[i] == '.' &&
-                (i == (isosize - 1) || isofn[i + 1] == ';'))
-            break;
+#define CACHE_MAX_CLUSTER 64
 
-        /* Otherwise, compare the chars normally */
-        if(tolower((int)isofn[i]) != tolower((int)normalfn[i]))
-            return -1;
-    }
+/* How misses are read: CDROM_READ_DMA or CDROM_READ_PIO */
+static int fill_mode = CDROM_READ_DMA;
 
-    /* Catch ISO name shorter than normal name */
-    if(normalfn[i] != '/' && normalfn[i] != '\0')
-        return -1;
-    else
+/* The disc's audio tracks, filled in by init_percd. Their sectors are
+   read whole, 2352 bytes each, and a data cache line holds half as many
+   of them as it does 2048-byte sectors (see bvictim). */
+typedef struct {
+    uint32  lba, count;
+    int     num;
+} pcm_track_t;
+
+static pcm_track_t pcm_tracks[99];
+static int pcm_count;
+
+/* Read-ahead requests, one per file handle: the sectors [next, end) of the
+   file occupying [lo, hi) are still to be fetched into the data cache, for
+   a reader now at cur. */
+typedef struct {
+    uint32  next, end;
+    uint32  lo, hi;
+    uint32  cur;
+} ra_req_t;
+
+/* Bandwidth reservations, one per file handle (see FS_CD_IOCTL_RESERVE).
+   margin is the read-ahead window the handle always gets, in sectors of
+   ssize bytes; 0 if it has no reservation. */
+typedef struct {
+    uint32  rate, margin, ssize;
+    uint32  underruns, refills;
+} rsv_t;
+
+static rsv_t rsv[FS_CD_MAX_FILES];
+
+/* While any handle has a reservation, the most bytes a handle without one
+   reads by DMA in a single command, so it can't hold the drive past a
+   reserved handle's deadline; 0 otherwise. Kept in bytes since the handle
+   reserving and the handle being held back needn't have the same sector
+   size: see rsv_cap(). */
+static uint32 rsv_chunk;
+
+/* All the margins added up: the read-ahead space others can't have */
+static uint32 rsv_total;
+
+/* rsv_chunk as a count of ss-byte sectors (at least one), or 0 if nothing
+   is reserved. Called with cache_mutex held. */
+static uint32 rsv_cap(uint32 ss) {
+    if(!rsv_chunk)
         return 0;
+
+    return rsv_chunk / ss ? rsv_chunk / ss : 1;
 }
 
-/* Locate an ISO9660 object in the given directory; this can be a directory or
-   a file, it works fine for either one. Pass in:
+static ra_req_t ra_req[FS_CD_MAX_FILES];
+static int ra_max = FS_CD_READAHEAD_MAX;    /* Largest window in sectors */
+static int ra_quit;
+static condvar_t ra_cond;       /* Read-ahead work queued */
+static kthread_t *ra_thd;
 
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+/* Signalled whenever a line stops being busy */
+static condvar_t fill_cond;
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object(const char *fn, int dir,
-                                 uint32 dir_extent, uint32 dir_size) {
-    int     i, c;
-    iso_dirent_t    *de;
+/* Current line sizes (log2 sectors per line), and the byte budgets the
+   lines are carved out of */
+static int icache_shift, dcache_shift;
+static size_t icache_budget, dcache_budget;
 
-    /* RockRidge */
-    int     len;
-    uint8       *pnt;
-    char        rrname[NAME_MAX];
-    int     rrnamelen;
-    int     size_left;
+/* Data of a 2K block as returned by bread_cache. Blocks are numbered
+   through the whole cache, so block >> shift is the line holding it. */
+static inline uint8 *bdata(block_cache_t *cache, int block) {
+    return cache->data + (block << 11);
+}
 
-    /* We need this to be signed for our while loop to end properly */
-    size_left = (int)dir_size;
+/* Data of the sector in a block, which for a raw line is the block's
+   index within the line times 2352 bytes in */
+static inline uint8 *bsector(block_cache_t *cache, int block) {
+    int mask = (1 << cache->shift) - 1;
 
-    /* Joliet */
-    uint8       * ucsname = (uint8 *)rrname;
+    if(!cache->tag[block >> cache->shift].raw)
+        return bdata(cache, block);
 
-    /* If this is a Joliet CD, then UCSify the name */
-    if(joliet)
-        utf2ucs(ucsname, (uint8 *)fn);
+    return bdata(cache, block & ~mask) + (block & mask) * 2352;
+}
 
-    while(size_left > 0) {
-        c = biread(dir_extent);
+/* Is sector part of an audio track? */
+static int braw(uint32 sector) {
+    int i;
 
-        if(c < 0) return NULL;
+    for(i = 0; i < pcm_count; i++) {
+        if(sector - pcm_tracks[i].lba < pcm_tracks[i].count)
+            return 1;
+    }
 
-        for(i = 0; i < 2048 && i < size_left;) {
-            /* Locate the current dirent */
-            de = (iso_dirent_t *)(icache[c]->data + i);
+    return 0;
+}
 
-            if(!de->length) break;
+/* Lines are hashed by cluster number */
+static inline uint16 *bhash(block_cache_t *cache, uint32 sector) {
+    return cache->hash + ((sector >> cache->shift) & cache->hash_mask);
+}
 
-            /* Try the Joliet filename if the CD is a Joliet disc */
-            if(joliet) {
-                if(!ucscompare((uint8 *)de->name, ucsname, de->name_len)) {
-                    if(!((dir << 1) ^ de->flags))
-                        return de;
-                }
-            }
-            else {
-                /* Assume no Rock Ridge name */
-                rrnamelen = 0;
+/* Take a block off whichever list it's on */
+static inline void blru_unlink(block_cache_t *cache, int block) {
+    cache_tag_t *t = cache->tag + block;
 
-                /* Check for Rock Ridge NM extension */
-                len = de->length - sizeof(iso_dirent_t)
-                      + sizeof(de->name) - de->name_len;
-                pnt = (uint8*)de + sizeof(iso_dirent_t)
-                      - sizeof(de->name) + de->name_len;
+    cache->tag[t->prev].next = t->next;
+    cache->tag[t->next].prev = t->prev;
 
-                if((de->name_len & 1) == 0) {
-                    pnt++;
-                    len--;
-                }
+    if(t->a1)
+        cache->a1count--;
+}
 
-                while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
-                    if(strncmp((char *)pnt, "NM", 2) == 0) {
-                        rrnamelen = pnt[2] - 5;
-                        strncpy(rrname, (char *)(pnt + 5), rrnamelen);
-                        rrname[rrnamelen] = 0;
-                    }
+/* Put a block on the MRU (newest) end of a list */
+static inline void blru_push_mru(block_cache_t *cache, int list, int block) {
+    cache_tag_t *head = cache->tag + list;
 
-                    len -= pnt[2];
-                    pnt += pnt[2];
-                }
+    cache->tag[block].prev = head->prev;
+    cache->tag[block].next = list;
+    cache->tag[head->prev].next = block;
+    head->prev = block;
 
-                /* Check the filename against the requested one */
-                if(rrnamelen > 0) {
-                    char *p = strchr(fn, '/');
-                    int fnlen;
+    if((cache->tag[block].a1 = (list == CACHE_A1(cache))))
+        cache->a1count++;
+}
 
-                    if(p)
-                        fnlen = p - fn;
-                    else
-                        fnlen = strlen(fn);
+/* Put a block on the LRU end of the LRU list, so it's the next one
+   reused */
+static inline void blru_push_lru(block_cache_t *cache, int block) {
+    cache_tag_t *head = cache->tag + CACHE_LRU(cache);
 
-                    if(!strncasecmp(rrname, fn, fnlen) && ! *(rrname + fnlen)) {
-                        if(!((dir << 1) ^ de->flags))
-                            return de;
-                    }
-                }
-                else {
-                    if(!fncompare(de->name, de->name_len, fn)) {
-                        if(!((dir << 1) ^ de->flags))
-                            return de;
-                    }
-                }
-            }
+    cache->tag[block].next = head->next;
+    cache->tag[block].prev = CACHE_LRU(cache);
+    cache->tag[head->next].prev = block;
+    head->next = block;
+    cache->tag[block].a1 = 0;
+}
 
-            i += de->length;
-        }
+/* Ghosts are hashed by cluster number too */
+static inline uint16 *bghash(block_cache_t *cache, uint32 sector) {
+    return cache->ghash + ((sector >> cache->shift) & cache->ghash_mask);
+}
 
-        dir_extent++;
-        size_left -= 2048;
-    }
+/* Drop a ghost from its hash bucket and forget it */
+static void bghost_drop(block_cache_t *cache, int g) {
+    uint16 *p = bghash(cache, cache->ghost[g].sector);
 
-    return NULL;
+    while(*p != g)
+        p = &cache->ghost[*p].hnext;
+
+    *p = cache->ghost[g].hnext;
+    cache->ghost[g].sector = (uint32)-1;
 }
 
-/* Locate an ISO9660 object anywhere on the disc, starting at the root,
-   and expecting a fully qualified path name. This is analogous to find_object
-   but it searches with the path in mind.
+/* Remember the sector of a line leaving A1in, in place of the oldest
+   ghost */
+static void bghost_add(block_cache_t *cache, uint32 sector) {
+    int g = cache->gnext;
 
-   fn:      object filename (relative to the passed directory)
-   dir:     0 if looking for a file, 1 if looking for a dir
-   dir_extent:  directory extent to start with
-   dir_size:    directory size (in bytes)
+    if(cache->ghost[g].sector != (uint32)-1)
+        bghost_drop(cache, g);
 
-   It will return a pointer to a transient dirent buffer (i.e., don't
-   expect this buffer to stay around much longer than the call itself).
- */
-static iso_dirent_t *find_object_path(const char *fn, int dir, iso_dirent_t *start) {
-    char        *cur;
+    cache->ghost[g].sector = sector;
+    cache->ghost[g].hnext = *bghash(cache, sector);
+    *bghash(cache, sector) = g;
+    cache->gnext = (g + 1) % cache->gmax;
+}
 
-    /* If the object is in a sub-tree, traverse the trees looking
-       for the right directory */
-    while((cur = strchr(fn, '/'))) {
-        if(cur != fn) {
-            /* Note: trailing path parts don't matter since find_object
-               only compares based on the FN length on the disc. */
-            start = find_object(fn, 1, iso_733(start->extent), iso_733(start->size));
+/* Was this line recently pushed out of A1in? Forgets it if so. */
+static int bghost_take(block_cache_t *cache, uint32 sector) {
+    uint16 g = *bghash(cache, sector);
 
-            if(start == NULL) return NULL;
-        }
+    while(g != CACHE_NIL && cache->ghost[g].sector != sector)
+        g = cache->ghost[g].hnext;
 
-        fn = cur + 1;
-    }
+    if(g == CACHE_NIL)
+        return 0;
+
+    bghost_drop(cache, g);
+    return 1;
+}
+
+/* A hit. Lines on the LRU list move to its MRU end; lines on A1in stay
+   where they are, as a file streaming through a line hits it again and
+   again without that meaning anything. */
+static inline void btouch(block_cache_t *cache, int block) {
+    if(cache->tag[block].a1 || cache->tag[block].pins)
+        return;
+
+    blru_unlink(cache, block);
+    blru_push_mru(cache, CACHE_LRU(cache), block);
+}
+
+/* Drop a block from the sector index */
+static void bunhash(block_cache_t *cache, int block) {
+    uint16 *p = bhash(cache, cache->tag[block].sector);
+
+    while(*p != block)
+        p = &cache->tag[*p].hnext;
+
+    *p = cache->tag[block].hnext;
+}
+
+/* Look a sector up in the index; returns the line holding it or -1 */
+static inline int bfind(block_cache_t *cache, uint32 sector) {
+    uint16 i = *bhash(cache, sector);
+
+    while(i != CACHE_NIL &&
+          sector - cache->tag[i].sector >= cache->tag[i].count)
+        i = cache->tag[i].hnext;
+
+    return i == CACHE_NIL ? -1 : i;
+}
+
+/* Is there a line that could be reused? Busy lines aren't on the lists,
+   so with enough reads in flight there may be none. */
+static inline int bspare(block_cache_t *cache) {
+    return cache->tag[CACHE_LRU(cache)].next != CACHE_LRU(cache) ||
+           cache->tag[CACHE_A1(cache)].next != CACHE_A1(cache);
+}
+
+/* Empties a cache and links every block onto the LRU list. Busy lines are
+   dropped from the index and left to their readers, who see gen change
+   and put them back empty. Pinned lines keep their data for whoever holds
+   them, but are emptied, to go back on the list once let go of. */
+static void binit_cache(block_cache_t *cache) {
+    cache_tag_t *head = cache->tag + CACHE_LRU(cache);
+    uint32 i;
+
+    for(i = 0; i <= cache->hash_mask; i++)
+        cache->hash[i] = CACHE_NIL;
+
+    head->next = head->prev = CACHE_LRU(cache);
+    head = cache->tag + CACHE_A1(cache);
+    head->next = head->prev = CACHE_A1(cache);
+    cache->a1count = 0;
+    cache->gen++;
+
+    for(i = 0; i < (uint32)cache->count; i++) {
+        if(cache->tag[i].busy)
+            continue;
+
+        if(cache->tag[i].pins) {
+            cache->tag[i].sector = (uint32)-1;
+            cache->tag[i].count = 0;
+            continue;
+        }
+
+        cache->tag[i].sector = (uint32)-1;
+        cache->tag[i].count = 0;
+        cache->tag[i].hnext = CACHE_NIL;
+        cache->tag[i].seq = 0;
+        blru_push_mru(cache, CACHE_LRU(cache), i);
+    }
+
+    for(i = 0; i < (uint32)cache->gmax; i++)
+        cache->ghost[i].sector = (uint32)-1;
+
+    for(i = 0; i <= cache->ghash_mask; i++)
+        cache->ghash[i] = CACHE_NIL;
+
+    cache->gnext = 0;
+}
+
+/* Clears all cache blocks */
+static void bclear_cache(block_cache_t *cache) {
+    mutex_lock(&cache_mutex);
+    binit_cache(cache);
+
+    /* Nothing queued for read-ahead is wanted any more */
+    if(cache == &dcache)
+        memset(ra_req, 0, sizeof(ra_req));
+
+    mutex_unlock(&cache_mutex);
+}
+
+/* Keep the hash at least twice the block count so chains stay short */
+static uint32 bhash_size(int count) {
+    uint32 hsize = 1;
+
+    while(hsize < (uint32)count * 2)
+        hsize <<= 1;
+
+    return hsize;
+}
+
+/* 2Q's tuning from the paper: A1in holds a quarter of the lines and A1out
+   remembers half as many as the cache holds */
+static size_t bmeta_size(int count) {
+    return (count + 2) * sizeof(cache_tag_t) +
+           (count / 2 + 1) * sizeof(cache_ghost_t) +
+           bhash_size(count / 2 + 1) * sizeof(uint16) +
+           bhash_size(count) * sizeof(uint16);
+}
+
+/* Carve a cache of count lines out of the arena: its data at *data and
+   its tags, ghost ring and hash tables at *meta. Both pointers are
+   advanced. */
+static void bplace_cache(block_cache_t *cache, int count, int shift,
+                         uint8 **data, uint8 **meta) {
+    uint32 hsize = bhash_size(count), gsize = bhash_size(count / 2 + 1);
+
+    cache->count = count;
+    cache->shift = shift;
+    cache->hash_mask = hsize - 1;
+    cache->a1max = count / 4 ? count / 4 : 1;
+    cache->gmax = count / 2 + 1;
+    cache->data = *data;
+    *data += count << (11 + shift);
+    cache->tag = (cache_tag_t *)*meta;
+    *meta += (count + 2) * sizeof(cache_tag_t);
+    cache->ghost = (cache_ghost_t *)*meta;
+    *meta += cache->gmax * sizeof(cache_ghost_t);
+    cache->ghash = (uint16 *)*meta;
+    cache->ghash_mask = gsize - 1;
+    *meta += gsize * sizeof(uint16);
+    cache->hash = (uint16 *)*meta;
+    *meta += hsize * sizeof(uint16);
+}
+
+static int bcount(size_t bytes, int shift) {
+    size_t count = bytes >> (11 + shift);
+
+    if(count < CACHE_MIN_BLOCKS)
+        return CACHE_MIN_BLOCKS;
+
+    if(count > CACHE_MAX_BLOCKS)
+        return CACHE_MAX_BLOCKS;
+
+    return (int)count;
+}
+
+/* (Re)allocate both caches in one 32-byte aligned arena: the data lines
+   first, so every block stays aligned, then the tags and hash tables. The
+   caller holds cache_mutex with no reads in flight (or is the init code).
+   Pinned lines would be freed from under their holders, so they make this
+   fail. */
+static int balloc_caches(size_t icache_bytes, size_t dcache_bytes,
+                         int ishift, int dshift) {
+    int ni = bcount(icache_bytes, ishift), nd = bcount(dcache_bytes, dshift);
+    size_t dsize = ((size_t)ni << (11 + ishift)) +
+                   ((size_t)nd << (11 + dshift));
+    uint8 *arena, *data, *meta;
+
+    if(icache.pinned || dcache.pinned) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    arena = memalign(32, dsize + bmeta_size(ni) + bmeta_size(nd));
+
+    if(!arena) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    data = arena;
+    meta = arena + dsize;
+    memset(meta, 0, bmeta_size(ni) + bmeta_size(nd));
+    bplace_cache(&icache, ni, ishift, &data, &meta);
+    bplace_cache(&dcache, nd, dshift, &data, &meta);
+    binit_cache(&icache);
+    binit_cache(&dcache);
+
+    free(cache_arena);
+    cache_arena = arena;
+    icache_budget = icache_bytes;
+    dcache_budget = dcache_bytes;
+    icache_shift = ishift;
+    dcache_shift = dshift;
+
+    return 0;
+}
+
+/* Turn a cluster size in sectors into a shift, or -1 if it's unusable */
+static int bcluster_shift(int sectors) {
+    int shift = 0;
+
+    if(sectors < 1 || sectors > CACHE_MAX_CLUSTER ||
+       (sectors & (sectors - 1)))
+        return -1;
+
+    while((1 << shift) < sectors)
+        shift++;
+
+    return shift;
+}
+
+/* Take the line to reuse off its list and out of the index, to be filled
+   with the cluster around sector clamped to [lo, hi). The run of sectors
+   it will hold goes in [*first, *last).
+
+   Empty lines always sit at the LRU end of the LRU list and go first.
+   Otherwise 2Q takes the oldest line on A1in once that has grown past its
+   share, and the LRU line if not.
+
+   Audio sectors come in half clusters, as that many 2352-byte sectors
+   always fit in a line and stay in its cluster's hash bucket. A cache of
+   one-sector lines can't hold them at all; the caller checks. */
+static int bvictim(block_cache_t *cache, uint32 sector, uint32 lo, uint32 hi,
+                   uint32 *first, uint32 *last) {
+    int i, shift = cache->shift - braw(sector);
+
+    *first = sector & ~((1 << shift) - 1);
+    *last = *first + (1 << shift);
+
+    if(*first < lo)
+        *first = lo;
+
+    if(*last > hi)
+        *last = hi;
+
+    i = cache->tag[CACHE_LRU(cache)].next;
+
+    if(cache->policy == FS_CD_POLICY_2Q &&
+       (i == CACHE_LRU(cache) || cache->tag[i].sector != (uint32)-1) &&
+       (cache->a1count > cache->a1max || i == CACHE_LRU(cache))) {
+        i = cache->tag[CACHE_A1(cache)].next;
+
+        if(!cache->tag[i].seq)
+            bghost_add(cache, cache->tag[i].sector);
+    }
+
+    blru_unlink(cache, i);
+
+    if(cache->tag[i].sector != (uint32)-1) {
+        bunhash(cache, i);
+        cache->tag[i].sector = (uint32)-1;
+        cache->tag[i].count = 0;
+    }
+
+    return i;
+}
+
+/* Read the sectors [first, last) into a line taken by bvictim. Lines are
+   32-byte aligned, so the drive can DMA straight into one once the operand
+   cache has forgotten it; otherwise a dirty cache line could be written
+   back over the new data, or a stale one read in its place. */
+static int bread_line(block_cache_t *cache, int i, uint32 first,
+                      uint32 last, int prio) {
+    uint8 *data = bdata(cache, i << cache->shift);
+    int type = cache->tag[i].raw ? DRIVE_RAW : 0;
+
+    if(fill_mode == CDROM_READ_DMA) {
+        dcache_inval_range((uint32)data, (last - first) *
+                           (type ? 2352 : 2048));
+        return drive_read((void *)((uint32)data & 0x0FFFFFFF), first,
+                          last - first, CDROM_READ_DMA | type, prio);
+    }
+
+    return drive_read(data, first, last - first, CDROM_READ_PIO | type,
+                      prio);
+}
+
+/* Enter a line taken by bvictim into the index as busy, to be read with
+   the lock let go of. Returns the cache generation to hand to bfill_end. */
+static uint32 bfill_begin(block_cache_t *cache, int i, uint32 first,
+                          uint32 last) {
+    cache->tag[i].sector = first;
+    cache->tag[i].count = last - first;
+    cache->tag[i].busy = 1;
+    cache->tag[i].raw = braw(first);
+    cache->tag[i].hnext = *bhash(cache, first);
+    *bhash(cache, first) = i;
+    cache->busy++;
+
+    return cache->gen;
+}
+
+/* The read of a busy line is over; the caller holds cache_mutex again. If
+   it worked and the cache wasn't emptied meanwhile, the line goes on as
+   most recently used, or for 2Q on the A1in FIFO unless its ghost shows it
+   has been used before. Otherwise it goes back empty, to be reused first.
+   seq is set for lines read ahead of a stream. Returns whether the line
+   was kept. */
+static int bfill_end(block_cache_t *cache, int i, uint32 gen, int ok,
+                     int seq) {
+    cache_tag_t *t = cache->tag + i;
+
+    t->busy = 0;
+    cache->busy--;
+    cond_broadcast(&fill_cond);
+
+    if(!ok || gen != cache->gen) {
+        if(gen == cache->gen)
+            bunhash(cache, i);
+
+        t->sector = (uint32)-1;
+        t->count = 0;
+        blru_push_lru(cache, i);
+        return 0;
+    }
+
+    t->seq = seq;
+
+    if(cache->policy == FS_CD_POLICY_2Q && !bghost_take(cache, t->sector))
+        blru_push_mru(cache, CACHE_A1(cache), i);
+    else
+        blru_push_mru(cache, CACHE_LRU(cache), i);
+
+    return 1;
+}
+
+/* Wait on fill_cond for a busy line, with cache_mutex held. The line
+   could be read-ahead held back while CDDA plays, so let that go. */
+static void bwait(void) {
+    drive_want(1);
+    cond_wait(&fill_cond, &cache_mutex);
+    drive_want(-1);
+}
+
+/* Wait for every busy line to be done with, before the caches are
+   reallocated or reorganized. The caller holds cache_mutex, so no new read
+   can start until it lets go. */
+static void bidle(void) {
+    while(icache.busy || dcache.busy)
+        bwait();
+}
+
+/* Pin a line returned by bread_locked. At least one line is always left
+   for reads to use, so a pin is refused (-1) if it would take the last. */
+static int bpin(block_cache_t *cache, int i) {
+    if(!cache->tag[i].pins) {
+        if(cache->pinned + 1 >= cache->count)
+            return -1;
+
+        blru_unlink(cache, i);
+        cache->pinned++;
+    }
+
+    cache->tag[i].pins++;
+    return 0;
+}
+
+/* Drop a pin. The last one puts the line back where it was, or at the LRU
+   end if the cache was emptied meanwhile. */
+static void bunpin(block_cache_t *cache, int i) {
+    cache_tag_t *t = cache->tag + i;
+
+    if(--t->pins)
+        return;
+
+    cache->pinned--;
+
+    if(t->sector == (uint32)-1)
+        blru_push_lru(cache, i);
+    else
+        blru_push_mru(cache, t->a1 ? CACHE_A1(cache) : CACHE_LRU(cache), i);
+
+    cond_broadcast(&fill_cond);
+}
+
+/* Pulls the requested sector into a cache block and returns the cache
+   block index. Note that the sector in question may already be in the
+   cache, in which case it just returns the containing block.
+
+   On a miss the whole cluster around the sector is read with one command,
+   clamped to [lo, hi): the extent of the file or directory being read,
+   and ahead of other reads if urgent is set.
+   cache_mutex is let go of for the read, and held again on return. */
+static void iso_break_all(void);
+static int bread_locked(block_cache_t *cache, uint32 sector, uint32 lo,
+                        uint32 hi, int urgent) {
+    int i, j;
+    uint32 first, last, gen;
+
+    /* Look for a pre-existing cache block. One that's still being read is
+       waited for, as is a line to reuse if every one is busy or pinned. */
+    for(;;) {
+        if((i = bfind(cache, sector)) >= 0) {
+            if(!cache->tag[i].busy)
+                break;
+        }
+        else if(bspare(cache)) {
+            break;
+        }
+
+        bwait();
+    }
+
+    if(i >= 0) {
+        btouch(cache, i);
+        cache->hits++;
+        return (i << cache->shift) + (sector - cache->tag[i].sector);
+    }
+
+    /* If not, kick a block out of cache and load the requested blocks */
+    if(!cache->shift && braw(sector))
+        return -1;
+
+    cache->misses++;
+    i = bvictim(cache, sector, lo, hi, &first, &last);
+    gen = bfill_begin(cache, i, first, last);
+
+    mutex_unlock(&cache_mutex);
+    j = bread_line(cache, i, first, last, urgent);
+    mutex_lock(&cache_mutex);
+
+    if(!bfill_end(cache, i, gen, j == ERR_OK, 0)) {
+        //dbglog(DBG_ERROR, "fs_iso9660: can't read_sectors for %d: %d\n",
+        //  sector+150, j);
+        if(j == ERR_DISC_CHG || j == ERR_NO_DISC)
+            return -2;
+
+        return -1;
+    }
+
+    /* Return the new cache block index */
+    return (i << cache->shift) + (sector - first);
+}
+
+/* Handles the disc having gone away once cache_mutex is let go of, as
+   init_percd clears the caches itself */
+static int bread_cache(block_cache_t *cache, uint32 sector, uint32 lo,
+                       uint32 hi) {
+    int rv;
+
+    mutex_lock(&cache_mutex);
+    rv = bread_locked(cache, sector, lo, hi, 0);
+    mutex_unlock(&cache_mutex);
+
+    if(rv == -2) {
+        init_percd();
+        rv = -1;
+    }
+
+    return rv;
+}
+
+/* One past the last sector of an extent */
+static inline uint32 extent_end(uint32 extent, uint32 size) {
+    return extent + (size + 2047) / 2048;
+}
+
+/* read data: copy len bytes from offset off into a block of the extent
+   [lo, hi), reading it urgently if it misses.
+   The copy is made before the lock is dropped, as another miss could reuse
+   the block as soon as it is. */
+static int bdcopy(uint32 sector, uint32 lo, uint32 hi, void *out, int off,
+                  int len, int urgent) {
+    int c;
+
+    mutex_lock(&cache_mutex);
+
+    if((c = bread_locked(&dcache, sector, lo, hi, urgent)) >= 0)
+        memcpy(out, bsector(&dcache, c) + off, len);
+
+    mutex_unlock(&cache_mutex);
+
+    if(c == -2)
+        init_percd();
+
+    return c < 0 ? -1 : 0;
+}
+
+/* read inode block of the extent [lo, hi) */
+static int biread(uint32 sector, uint32 lo, uint32 hi) {
+    return bread_cache(&icache, sector, lo, hi);
+}
+
+/* Like biread, but on success returns with cache_mutex still held, so
+   the line can't be refilled by another thread's miss while the caller
+   looks through it. The caller lets go of the lock when it's done. */
+static int biread_hold(uint32 sector, uint32 lo, uint32 hi) {
+    int rv;
+
+    mutex_lock(&cache_mutex);
+
+    if((rv = bread_locked(&icache, sector, lo, hi, 0)) >= 0)
+        return rv;
+
+    mutex_unlock(&cache_mutex);
+
+    if(rv == -2)
+        init_percd();
+
+    return -1;
+}
+
+/* Clear both caches */
+static void bclear(void) {
+    bclear_cache(&dcache);
+    bclear_cache(&icache);
+}
+
+/********************************************************************************/
+/* Read-ahead. Handles that read sequentially get a window of sectors past
+   their position fetched into the data cache by a background thread, so
+   later reads find their data waiting instead of stopping for the drive.
+   The thread fills one line at a time, the same way a miss does. Handles
+   with a reservation whose window isn't all there go first, the one with
+   the least time left buffered first; the drive is held for their fills
+   until every reservation has its margin again. Otherwise the thread takes
+   the handles in turn. */
+
+/* The reserved handle with the least buffered, if any is short of its
+   margin. Called with cache_mutex held. */
+static int ra_urgent(void) {
+    int fd, best = -1;
+    uint64 t, least = 0;
+
+    for(fd = 0; fd < FS_CD_MAX_FILES; fd++) {
+        if(!rsv[fd].margin || ra_req[fd].next >= ra_req[fd].end)
+            continue;
+
+        /* Compare in units of time: margins differ by rate */
+        t = (uint64)(ra_req[fd].next - ra_req[fd].cur) * rsv[fd].ssize *
+            1000 / rsv[fd].rate;
+
+        if(best < 0 || t < least) {
+            best = fd;
+            least = t;
+        }
+    }
+
+    return best;
+}
+
+static void *ra_thread(void *param) {
+    int fd = 0, n, i, j, urgent, held = 0;
+    uint32 first, last, gen;
+    ra_req_t *r;
+
+    (void)param;
+
+    mutex_lock(&cache_mutex);
+
+    while(!ra_quit) {
+        if((n = ra_urgent()) >= 0) {
+            urgent = 1;
+            r = ra_req + n;
+        }
+        else {
+            if(held)
+                drive_hold(held = 0);
+
+            for(n = 0; n < FS_CD_MAX_FILES; n++) {
+                fd = (fd + 1) % FS_CD_MAX_FILES;
+
+                if(ra_req[fd].next < ra_req[fd].end)
+                    break;
+            }
+
+            if(n == FS_CD_MAX_FILES) {
+                cond_wait(&ra_cond, &cache_mutex);
+                continue;
+            }
+
+            urgent = 0;
+            r = ra_req + fd;
+        }
+
+        /* Skip over anything that's already cached or being read */
+        if((i = bfind(&dcache, r->next)) >= 0) {
+            r->next = dcache.tag[i].sector + dcache.tag[i].count;
+            continue;
+        }
+
+        if(!dcache.shift && braw(r->next)) {
+            r->end = r->next;
+            continue;
+        }
+
+        /* Waiting for a line could mean waiting on reads held back */
+        if(!bspare(&dcache)) {
+            if(held)
+                drive_hold(held = 0);
+
+            cond_wait(&fill_cond, &cache_mutex);
+            continue;
+        }
+
+        i = bvictim(&dcache, r->next, r->lo, r->hi, &first, &last);
+        r->next = last;
+        gen = bfill_begin(&dcache, i, first, last);
+
+        if(urgent) {
+            rsv[r - ra_req].refills++;
+
+            if(!held)
+                drive_hold(held = 1);
+        }
+
+        mutex_unlock(&cache_mutex);
+
+        j = bread_line(&dcache, i, first, last, urgent ? PRIO_URGENT :
+                       PRIO_IDLE);
+
+        mutex_lock(&cache_mutex);
+
+        if(bfill_end(&dcache, i, gen, j == ERR_OK, 1))
+            dcache.prefetched++;
+        else if(gen == dcache.gen)
+            r->end = r->next;   /* Leave errors for the reader to run into */
+    }
+
+    if(held)
+        drive_hold(0);
+
+    mutex_unlock(&cache_mutex);
+    return NULL;
+}
+
+/* A handle is about to read cnt sectors of ss bytes from sector on
+   straight off the disc. Returns how many of them, up to the first one
+   that's cached or being read (or rsv_cap(), for a handle without a
+   reservation), it should read itself; read-ahead skips those. Whole
+   2352-byte sectors only come in pairs: an odd run of them ends halfway
+   through a 32-byte line, and invalidating that before the DMA would throw
+   away whatever the caller has after it. */
+static int ra_claim(int fd, uint32 sector, int cnt, uint32 ss) {
+    uint32 c;
+    int i;
+
+    mutex_lock(&cache_mutex);
+
+    if(!rsv[fd].margin && (c = rsv_cap(ss)) && (uint32)cnt > c)
+        cnt = c;
+
+    for(i = 0; i < cnt; i++) {
+        if(bfind(&dcache, sector + i) >= 0)
+            break;
+    }
+
+    if(ss & 0x1F)
+        i &= ~1;
+
+    if(ra_req[fd].next < sector + i && ra_req[fd].end > sector)
+        ra_req[fd].next = sector + i;
+
+    mutex_unlock(&cache_mutex);
+
+    return i;
+}
+
+/* Forget whatever is queued for a handle */
+static void ra_drop(int fd) {
+    mutex_lock(&cache_mutex);
+    memset(ra_req + fd, 0, sizeof(ra_req_t));
+    mutex_unlock(&cache_mutex);
+}
+
+/********************************************************************************/
+/* Higher-level ISO9660 primitives */
+
+/* Root FS session location (in sectors) */
+static uint32 session_base = 0;
+
+/* Root directory extent and size in bytes */
+static uint32 root_extent = 0, root_size = 0;
+
+/* Root dirent */
+static iso_dirent_t root_dirent;
+
+
+/* Note the audio tracks in a TOC, for iso_open to offer as trackNN.pcm */
+static void pcm_scan(CDROM_TOC *toc) {
+    int i, first = TOC_TRACK(toc->first), last = TOC_TRACK(toc->last);
+    uint32 start, end;
+
+    if(first < 1 || last > 99)
+        return;
+
+    for(i = first; i <= last; i++) {
+        if(TOC_CTRL(toc->entry[i - 1]) & 4)
+            continue;
+
+        start = TOC_LBA(toc->entry[i - 1]);
+        end = TOC_LBA(i < last ? toc->entry[i] : toc->leadout_sector);
+
+        if(end <= start || pcm_count >= 99)
+            continue;
+
+        pcm_tracks[pcm_count].num = i;
+        pcm_tracks[pcm_count].lba = start - 150;
+        pcm_tracks[pcm_count].count = end - start;
+        pcm_count++;
+    }
+}
+
+/* Per-disc initialization; this is done every time it's discovered that
+   a new CD has been inserted. */
+static int init_percd(void) {
+    int     i, blk;
+    CDROM_TOC   toc;
+
+    dbglog(DBG_NOTICE, "fs_iso9660: disc change detected\n");
+
+    /* Start off with no cached blocks and no open files*/
+    iso_reset();
+
+    /* Locate the root session; the drive goes back to 2048-byte sectors */
+    drive_type = 0;
+    pcm_count = 0;
+
+    if((i = cdrom_reinit()) != 0) {
+        dbglog(DBG_ERROR, "fs_iso9660:init_percd: cdrom_reinit returned %d\n", i);
+        return -1;
+    }
+
+    if((i = cdrom_read_toc(&toc, (disc_type == CD_GDROM))) != 0)
+        return i;
+
+    if(disc_type == CD_GDROM) {
+		session_base = 45150;
+	} else if(!(session_base = cdrom_locate_data_track(&toc)))
+        return -1;
+
+    /* A GD-ROM's audio can be in either area */
+    pcm_scan(&toc);
+
+    if(disc_type == CD_GDROM && cdrom_read_toc(&toc, 0) == 0)
+        pcm_scan(&toc);
+
+    /* Check for joliet extensions */
+    joliet = 0;
+
+    for(i = 1; i <= 3; i++) {
+        blk = biread(session_base + i + 16 - 150, 0, (uint32)-1);
+
+        if(blk < 0) return blk;
+
+        if(memcmp((char *)bdata(&icache, blk), "\02CD001", 6) == 0) {
+            joliet = isjoliet((char *)bdata(&icache, blk) + 88);
+            dbglog(DBG_NOTICE, "  (joliet level %d extensions detected)\n", joliet);
+
+            if(joliet) break;
+        }
+    }
+
+    /* If that failed, go after standard/RockRidge ISO */
+    if(!joliet) {
+        /* Grab and check the volume descriptor */
+        blk = biread(session_base + 16 - 150, 0, (uint32)-1);
+
+        if(blk < 0) return i;
+
+        if(memcmp((char*)bdata(&icache, blk), "\01CD001", 6)) {
+            dbglog(DBG_ERROR, "fs_iso9660: disc is not iso9660\r\n");
+            return -1;
+        }
+    }
+
+    /* Locate the root directory */
+    memcpy(&root_dirent, bdata(&icache, blk) + 156, sizeof(iso_dirent_t));
+    root_extent = iso_733(root_dirent.extent);
+    root_size = iso_733(root_dirent.size);
+
+    return 0;
+}
+
+/* Serializes the mounting below */
+static mutex_t percd_mutex;
+
+/* Look the disc over if that hasn't been done since it went in. Threads
+   that get here together wait for the first to do it, instead of each
+   resetting the caches and handles under the others. */
+static int percd_mount(void) {
+    int rv = 0;
+
+    mutex_lock(&percd_mutex);
+
+    if(!percd_done) {
+        if(init_percd() < 0)
+            rv = -1;
+        else
+            percd_done = 1;
+    }
+
+    mutex_unlock(&percd_mutex);
+    return rv;
+}
+
+/* Compare an ISO9660 filename against a normal filename. This takes into
+   account the version code on the end and is not case sensitive. Also
+   takes into account the trailing period that some CD burning software
+   adds. */
+static int fncompare(const char *isofn, int isosize, const char *normalfn) {
+    int i;
+
+    /* Compare ISO name */
+    for(i = 0; i < isosize; i++) {
+        /* Weed out version codes */
+        if(isofn[i] == ';') break;
+
+        /* Deal with crap '.' at end of filenames */
+        if(isofn[i] == '.' &&
+                (i == (isosize - 1) || isofn[i + 1] == ';'))
+            break;
+
+        /* Otherwise, compare the chars normally */
+        if(tolower((int)isofn[i]) != tolower((int)normalfn[i]))
+            return -1;
+    }
+
+    /* Catch ISO name shorter than normal name */
+    if(normalfn[i] != '/' && normalfn[i] != '\0')
+        return -1;
+    else
+        return 0;
+}
+
+/* Locate an ISO9660 object in the given directory; this can be a directory or
+   a file, it works fine for either one. Pass in:
+
+   fn:      object filename (relative to the passed directory)
+   dir:     0 if looking for a file, 1 if looking for a dir
+   dir_extent:  directory extent to start with
+   dir_size:    directory size (in bytes)
+
+   The entry found is copied to out (without its name), as the cache line
+   it's in can be reused as soon as the scan lets go of cache_mutex; out
+   is returned, or NULL if there's no such entry.
+ */
+static iso_dirent_t *find_object(const char *fn, int dir,
+                                 uint32 dir_extent, uint32 dir_size,
+                                 iso_dirent_t *out) {
+    int     i, c;
+    iso_dirent_t    *de;
+    uint32      dir_start = dir_extent;
+    uint32      dir_end = extent_end(dir_extent, dir_size);
+
+    /* RockRidge */
+    int     len;
+    uint8       *pnt;
+    char        rrname[NAME_MAX];
+    int     rrnamelen;
+    int     size_left;
+
+    /* We need this to be signed for our while loop to end properly */
+    size_left = (int)dir_size;
+
+    /* Joliet */
+    uint8       * ucsname = (uint8 *)rrname;
+
+    /* If this is a Joliet CD, then UCSify the name */
+    if(joliet)
+        utf2ucs(ucsname, (uint8 *)fn);
+
+    while(size_left > 0) {
+        c = biread_hold(dir_extent, dir_start, dir_end);
+
+        if(c < 0) return NULL;
+
+        for(i = 0; i < 2048 && i < size_left;) {
+            /* Locate the current dirent */
+            de = (iso_dirent_t *)(bdata(&icache, c) + i);
+
+            if(!de->length) break;
+
+            /* Try the Joliet filename if the CD is a Joliet disc */
+            if(joliet) {
+                if(!ucscompare((uint8 *)de->name, ucsname, de->name_len)) {
+                    if(!((dir << 1) ^ de->flags))
+                        goto found;
+                }
+            }
+            else {
+                /* Assume no Rock Ridge name */
+                rrnamelen = 0;
+
+                /* Check for Rock Ridge NM extension */
+                len = de->length - sizeof(iso_dirent_t)
+                      + sizeof(de->name) - de->name_len;
+                pnt = (uint8*)de + sizeof(iso_dirent_t)
+                      - sizeof(de->name) + de->name_len;
+
+                if((de->name_len & 1) == 0) {
+                    pnt++;
+                    len--;
+                }
+
+                while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+                    if(strncmp((char *)pnt, "NM", 2) == 0) {
+                        rrnamelen = pnt[2] - 5;
+                        strncpy(rrname, (char *)(pnt + 5), rrnamelen);
+                        rrname[rrnamelen] = 0;
+                    }
+
+                    len -= pnt[2];
+                    pnt += pnt[2];
+                }
+
+                /* Check the filename against the requested one */
+                if(rrnamelen > 0) {
+                    char *p = strchr(fn, '/');
+                    int fnlen;
+
+                    if(p)
+                        fnlen = p - fn;
+                    else
+                        fnlen = strlen(fn);
+
+                    if(!strncasecmp(rrname, fn, fnlen) && ! *(rrname + fnlen)) {
+                        if(!((dir << 1) ^ de->flags))
+                            goto found;
+                    }
+                }
+                else {
+                    if(!fncompare(de->name, de->name_len, fn)) {
+                        if(!((dir << 1) ^ de->flags))
+                            goto found;
+                    }
+                }
+            }
+
+            i += de->length;
+        }
+
+        mutex_unlock(&cache_mutex);
+        dir_extent++;
+        size_left -= 2048;
+    }
+
+    return NULL;
+
+found:
+    memcpy(out, de, sizeof(iso_dirent_t));
+    mutex_unlock(&cache_mutex);
+    return out;
+}
+
+/* Locate an ISO9660 object anywhere on the disc, starting at the root,
+   and expecting a fully qualified path name. This is analogous to find_object
+   but it searches with the path in mind.
+
+   fn:      object filename (relative to the passed directory)
+   dir:     0 if looking for a file, 1 if looking for a dir
+   dir_extent:  directory extent to start with
+   dir_size:    directory size (in bytes)
+
+   It will return start for the directory itself, or out with the entry
+   copied into it, or NULL.
+ */
+static iso_dirent_t *find_object_path(const char *fn, int dir,
+                                      iso_dirent_t *start,
+                                      iso_dirent_t *out) {
+    char        *cur;
+
+    /* If the object is in a sub-tree, traverse the trees looking
+       for the right directory */
+    while((cur = strchr(fn, '/'))) {
+        if(cur != fn) {
+            /* Note: trailing path parts don't matter since find_object
+               only compares based on the FN length on the disc. */
+            start = find_object(fn, 1, iso_733(start->extent),
+                                iso_733(start->size), out);
+
+            if(start == NULL) return NULL;
+        }
+
+        fn = cur + 1;
+    }
 
     /* Locate the file in the resulting directory */
     if(*fn) {
-        start = find_object(fn, dir, iso_733(start->extent), iso_733(start->size));
+        start = find_object(fn, dir, iso_733(start->extent),
+                            iso_733(start->size), out);
         return start;
     }
     else {
-        if(!dir)
-            return NULL;
+        if(!dir)
+            return NULL;
+        else
+            return start;
+    }
+}
+
+/********************************************************************************/
+/* File primitives */
+
+/* File handles.. I could probably do this with a linked list, but I'm just
+   too lazy right now. =) */
+static struct {
+    int     inuse;      /* >0 if the handle is open: an audio track can
+                           start at sector 0, so first_extent can't say */
+    uint32      first_extent;   /* First sector */
+    int     dir;        /* >0 if a directory */
+    uint32      ptr;        /* Current read position in bytes */
+    uint32      size;       /* Length of file in bytes */
+    dirent_t    dirent;     /* A static dirent to pass back to clients */
+    int     broken;     /* >0 if the CD has been swapped out since open */
+    uint32      ra_ptr;     /* Where the last read ended */
+    int     ra_window;  /* Read-ahead window in sectors, 0 if not streaming */
+    mutex_t     mutex;      /* Held while the handle is read or moved */
+    int     aio_pending;    /* Asynchronous reads queued on the handle */
+    uint8       *map;       /* The whole file, once it's been mmapped */
+    int     track;      /* Audio track read as PCM, or 0 */
+    int     pcm_next;   /* Next trackNN.pcm the root directory lists */
+} fh[FS_CD_MAX_FILES];
+
+/* Mutex for file handles */
+static mutex_t fh_mutex;
+
+/* Bytes per sector of a file: an audio track's are read whole */
+static inline uint32 fh_ssize(file_t fd) {
+    return fh[fd].track ? 2352 : 2048;
+}
+
+/* One past a file's last sector */
+static inline uint32 fh_end(file_t fd) {
+    return fh[fd].first_extent + (fh[fd].size + fh_ssize(fd) - 1) /
+           fh_ssize(fd);
+}
+
+/* The audio track fn names, as trackNN.pcm in the root directory; returns
+   its index in pcm_tracks or -1 */
+static int pcm_find(const char *fn) {
+    int i, num;
+
+    while(*fn == '/')
+        fn++;
+
+    if(strncasecmp(fn, "track", 5) || !isdigit((unsigned char)fn[5]) ||
+       !isdigit((unsigned char)fn[6]) || strcasecmp(fn + 7, ".pcm"))
+        return -1;
+
+    num = (fn[5] - '0') * 10 + fn[6] - '0';
+
+    for(i = 0; i < pcm_count; i++) {
+        if(pcm_tracks[i].num == num)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Break all of our open file descriptor. This is necessary when the disc
+   is changed so that we don't accidentally try to keep on doing stuff
+   with the old info. As files are closed and re-opened, the broken flag
+   will be cleared. */
+static void iso_break_all(void) {
+    int i;
+
+    mutex_lock(&fh_mutex);
+
+    for(i = 0; i < FS_CD_MAX_FILES; i++)
+        fh[i].broken = 1;
+
+    mutex_unlock(&fh_mutex);
+}
+
+/* Give a handle a reservation of rate bytes per second with deadline_ms
+   worth of data kept ahead of it, or take it away with a rate of 0. The
+   caller holds the handle's mutex. */
+static void rsv_set(file_t fd, uint32 rate, uint32 deadline_ms) {
+    uint32 c;
+    int i;
+
+    mutex_lock(&cache_mutex);
+
+    rsv[fd].rate = rate;
+    rsv[fd].ssize = fh_ssize(fd);
+    rsv[fd].margin = (uint32)(((uint64)rate * deadline_ms / 1000 +
+                               fh_ssize(fd) - 1) / fh_ssize(fd));
+
+    if(rate && !rsv[fd].margin)
+        rsv[fd].margin = 1;
+
+    /* Others' commands get half the tightest margin, or a line */
+    rsv_chunk = rsv_total = 0;
+
+    for(i = 0; i < FS_CD_MAX_FILES; i++) {
+        if(!rsv[i].margin)
+            continue;
+
+        rsv_total += rsv[i].margin;
+
+        if((c = rsv[i].margin * rsv[i].ssize / 2) < 2048U << dcache.shift)
+            c = 2048 << dcache.shift;
+
+        if(!rsv_chunk || c < rsv_chunk)
+            rsv_chunk = c;
+    }
+
+    mutex_unlock(&cache_mutex);
+}
+
+/* A read of bytes from the position of a handle with a reservation should
+   find them all in the cache already. If they aren't, that's an underrun:
+   count it and return 1, so the read's own misses jump the drive queue.
+   The caller holds the handle's mutex. */
+static int rsv_underrun(file_t fd, size_t bytes) {
+    uint32 sector, last;
+    int i, rv = 0;
+
+    if(!rsv[fd].margin || fh[fd].ptr >= fh[fd].size)
+        return 0;
+
+    if(bytes > fh[fd].size - fh[fd].ptr)
+        bytes = fh[fd].size - fh[fd].ptr;
+
+    sector = fh[fd].first_extent + fh[fd].ptr / fh_ssize(fd);
+    last = fh[fd].first_extent + (fh[fd].ptr + bytes + fh_ssize(fd) - 1) /
+           fh_ssize(fd);
+
+    mutex_lock(&cache_mutex);
+
+    while(sector < last) {
+        if((i = bfind(&dcache, sector)) < 0 || dcache.tag[i].busy) {
+            rsv[fd].underruns++;
+            rv = 1;
+            break;
+        }
+
+        sector = dcache.tag[i].sector + dcache.tag[i].count;
+    }
+
+    mutex_unlock(&cache_mutex);
+
+    return rv;
+}
+
+/* Open a file or directory */
+static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
+    file_t      fd;
+    iso_dirent_t    *de, found;
+    uint32      extent, size;
+    int     track = 0, t;
+
+    (void)vfs;
+
+    /* Make sure they don't want to open things as writeable */
+    if((mode & O_MODE_MASK) != O_RDONLY)
+        return 0;
+
+    /* Do this only when we need to */
+    if(!percd_done && percd_mount() < 0)
+        return 0;
+
+    /* Find the file we want: one in the file system, or failing that an
+       audio track, so a file on the disc named trackNN.pcm comes first */
+    if((de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent,
+                              &found))) {
+        extent = iso_733(de->extent);
+        size = iso_733(de->size);
+    }
+    else if(!(mode & O_DIR) && (t = pcm_find(fn)) >= 0) {
+        extent = pcm_tracks[t].lba;
+        size = pcm_tracks[t].count * 2352;
+        track = pcm_tracks[t].num;
+    }
+    else {
+        return 0;
+    }
+
+    /* Find a free file handle */
+    mutex_lock(&fh_mutex);
+
+    for(fd = 0; fd < FS_CD_MAX_FILES; fd++)
+        if(!fh[fd].inuse) {
+            fh[fd].inuse = 1;
+            break;
+        }
+
+    mutex_unlock(&fh_mutex);
+
+    if(fd >= FS_CD_MAX_FILES)
+        return 0;
+
+    /* Fill in the file handle and return the fd */
+    fh[fd].first_extent = extent;
+    fh[fd].dir = (mode & O_DIR) ? 1 : 0;
+    fh[fd].ptr = 0;
+    fh[fd].size = size;
+    fh[fd].track = track;
+    fh[fd].pcm_next = 0;
+    fh[fd].broken = 0;
+    fh[fd].ra_ptr = (uint32)-1;
+    fh[fd].ra_window = 0;
+    fh[fd].map = NULL;
+    ra_drop(fd);
+    rsv_set(fd, 0, 0);
+    rsv[fd].underruns = rsv[fd].refills = 0;
+
+    return (void *)fd;
+}
+
+/* Close a file or directory */
+static int iso_close(void * h) {
+    file_t fd = (file_t)h;
+
+    /* Check that the fd is valid */
+    if(fd < FS_CD_MAX_FILES) {
+        /* Let a read still going on it finish first */
+        mutex_lock(&fh[fd].mutex);
+        fh[fd].inuse = 0;
+        ra_drop(fd);
+        rsv_set(fd, 0, 0);
+        free(fh[fd].map);
+        fh[fd].map = NULL;
+        mutex_unlock(&fh[fd].mutex);
+    }
+    return 0;
+}
+
+/* Called after every read: a read that picked up where the last one left
+   off grows the handle's read-ahead window (starting at one cache line and
+   doubling up to ra_max, or half the data cache; for 2Q, the size of
+   A1in, less the reservations' margins), anything else drops it. A handle
+   with a reservation has its margin for a window from the start, whatever
+   it reads, within the same limits bar ra_max and the other margins.
+   Whatever part of the window isn't fetched or queued yet is handed to the
+   read-ahead thread. */
+static void ra_update(file_t fd, int seq) {
+    ra_req_t *r = ra_req + fd;
+    uint32 cur, hi, end;
+    int max;
+
+    mutex_lock(&cache_mutex);
+
+    max = (dcache.count << dcache.shift) / 2;
+
+    /* Under 2Q what's read ahead waits on A1in, and more than that holds
+       would push out the start of the window before it's been read */
+    if(dcache.policy == FS_CD_POLICY_2Q && max > dcache.a1max << dcache.shift)
+        max = dcache.a1max << dcache.shift;
+
+    if(rsv[fd].margin) {
+        fh[fd].ra_window = (int)rsv[fd].margin < max ? (int)rsv[fd].margin :
+                           max;
+    }
+    else {
+        /* What the reservations' margins leave over */
+        max -= (int)rsv_total < max ? (int)rsv_total : max;
+
+        if(max > ra_max)
+            max = ra_max;
+
+        if(!seq || max <= 0) {
+            fh[fd].ra_window = 0;
+            r->end = r->next;
+            mutex_unlock(&cache_mutex);
+            return;
+        }
+
+        if(!fh[fd].ra_window)
+            fh[fd].ra_window = 1 << dcache.shift;
+        else
+            fh[fd].ra_window <<= 1;
+
+        /* Audio sectors take two to a cluster's room */
+        if(fh[fd].track)
+            max /= 2;
+
+        if(fh[fd].ra_window > max)
+            fh[fd].ra_window = max;
+    }
+
+    cur = fh[fd].first_extent + fh[fd].ptr / fh_ssize(fd);
+    hi = fh_end(fd);
+    end = cur + fh[fd].ra_window;
+    r->cur = cur;
+
+    if(end > hi)
+        end = hi;
+
+    /* Start over if this is a new stream, it has overtaken the last, or it
+       was moved */
+    if(r->lo != fh[fd].first_extent || r->end < cur || !seq) {
+        r->lo = fh[fd].first_extent;
+        r->hi = hi;
+        r->next = r->end = cur;
+    }
+
+    if(r->next < cur)
+        r->next = cur;
+
+    if(end > r->end) {
+        r->end = end;
+        cond_broadcast(&ra_cond);
+    }
+
+    mutex_unlock(&cache_mutex);
+}
+
+/* Bounce buffer for runs of sectors bound for a buffer DMA can't reach,
+   allocated the first time one comes along. A read that finds another
+   using it goes through the cache instead of waiting. */
+#define BOUNCE_SECTORS (FS_CD_BOUNCE_SIZE / 2048)
+static uint8 *bounce;
+static mutex_t bounce_mutex;
+
+/* Read n whole sectors from the current position of a file straight into
+   outbuf by DMA, bypassing the cache. An outbuf that isn't 32-byte aligned
+   gets them through the bounce buffer, at most BOUNCE_SECTORS at a time.
+   whole is set if the read asked for a whole number of sectors, urgent if
+   it should jump the drive queue. Returns the number of sectors read, 0 if
+   they should go through the cache instead, or -1 on error. The caller
+   holds the handle's mutex. */
+static int iso_read_direct(file_t fd, uint8 *outbuf, int n, int whole,
+                           int urgent) {
+    uint32 ss = fh_ssize(fd), sector = fh[fd].first_extent + fh[fd].ptr / ss;
+    uint8 *dst = outbuf;
+    int rv;
+
+    /* A run shorter than a line is better off in the cache, where the rest
+       of the line is there for the next read; unless the caller reads in
+       whole sectors into an aligned buffer, and so will never want it */
+    if(n < (1 << dcache.shift) && (whole == 0 || ((uint32)outbuf & 0x1F)))
+        return 0;
+
+    if((uint32)outbuf & 0x1F) {
+        if(BOUNCE_SECTORS <= 0 || mutex_trylock(&bounce_mutex))
+            return 0;
+
+        if(!bounce && !(bounce = memalign(32, BOUNCE_SECTORS * 2048))) {
+            mutex_unlock(&bounce_mutex);
+            return 0;
+        }
+
+        if(n > BOUNCE_SECTORS * 2048 / (int)ss)
+            n = BOUNCE_SECTORS * 2048 / ss;
+
+        dst = bounce;
+    }
+
+    /* Stop at the first sector read-ahead has cached or is fetching */
+    if((rv = ra_claim(fd, sector, n, ss)) > 0) {
+        dcache_inval_range((uint32)dst, rv * ss);
+
+        if(drive_read((void *)((uint32)dst & 0x0FFFFFFF), sector, rv,
+                      CDROM_READ_DMA | (fh[fd].track ? DRIVE_RAW : 0),
+                      urgent) != ERR_OK)
+            rv = -1;
+        else if(dst != outbuf)
+            memcpy(outbuf, dst, rv * ss);
+    }
+
+    if(dst != outbuf)
+        mutex_unlock(&bounce_mutex);
+
+    return rv;
+}
+
+/* Read from a file. A read is split into up to three parts: whatever is
+   left of the sector at the current position comes out of the cache, the
+   whole sectors after that are read by DMA (see iso_read_direct), and the
+   part of the last sector wanted comes out of the cache again. */
+static ssize_t iso_read(void * h, void *buf, size_t bytes) {
+    int rv, toread, thissect, seq, n, urgent, ss;
+    uint8 * outbuf;
+    file_t fd = (file_t)h;
+
+    /* Check that the fd is valid */
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken)
+        return -1;
+
+    mutex_lock(&fh[fd].mutex);
+
+    rv = 0;
+    outbuf = (uint8 *)buf;
+    ss = fh_ssize(fd);
+    seq = fh[fd].ptr == fh[fd].ra_ptr;
+    urgent = rsv_underrun(fd, bytes);
+
+    /* Read zero or more sectors into the buffer from the current pos */
+    while(bytes > 0) {
+        /* Figure out how much we still need to read */
+        toread = (bytes > (fh[fd].size - fh[fd].ptr)) ?
+                 fh[fd].size - fh[fd].ptr : bytes;
+
+        if(toread == 0) break;
+
+        /* How much more can we read in the current sector? */
+        thissect = ss - (fh[fd].ptr % ss);
+        n = 0;
+
+        if(thissect == ss && toread >= ss &&
+           (n = iso_read_direct(fd, outbuf, toread / ss,
+                                !(bytes % ss), urgent)) < 0) {
+            mutex_unlock(&fh[fd].mutex);
+            return -1;
+        }
+
+        if(n > 0) {
+            toread = n * ss;
+        }
+        else {
+            toread = (toread > thissect) ? thissect : toread;
+
+            /* Do the read */
+            if(bdcopy(fh[fd].first_extent + fh[fd].ptr / ss,
+                      fh[fd].first_extent, fh_end(fd),
+                      outbuf, fh[fd].ptr % ss, toread, urgent) < 0) {
+                mutex_unlock(&fh[fd].mutex);
+                return -1;
+            }
+        }
+
+        /* Adjust pointers */
+        outbuf += toread;
+        fh[fd].ptr += toread;
+        bytes -= toread;
+        rv += toread;
+    }
+
+    fh[fd].ra_ptr = fh[fd].ptr;
+    ra_update(fd, seq);
+
+    mutex_unlock(&fh[fd].mutex);
+    return rv;
+}
+
+/* Seek elsewhere in a file */
+static off_t iso_seek(void * h, off_t offset, int whence) {
+    file_t fd = (file_t)h;
+    off_t rv;
+
+    /* Check that the fd is valid */
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    mutex_lock(&fh[fd].mutex);
+
+    /* Update current position according to arguments */
+    switch(whence) {
+        case SEEK_SET:
+            if(offset < 0)
+                goto inval;
+
+            fh[fd].ptr = offset;
+            break;
+
+        case SEEK_CUR:
+            if(offset < 0 && ((uint32)-offset) > fh[fd].ptr)
+                goto inval;
+
+            fh[fd].ptr += offset;
+            break;
+
+        case SEEK_END:
+            if(offset < 0 && ((uint32)-offset) > fh[fd].size)
+                goto inval;
+
+            fh[fd].ptr = fh[fd].size + offset;
+            break;
+
+        default:
+            goto inval;
+    }
+
+    /* Check bounds */
+    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
+
+    rv = fh[fd].ptr;
+    mutex_unlock(&fh[fd].mutex);
+    return rv;
+
+inval:
+    mutex_unlock(&fh[fd].mutex);
+    errno = EINVAL;
+    return -1;
+}
+
+/* Tell where in the file we are */
+static off_t iso_tell(void * h) {
+    file_t fd = (file_t)h;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken)
+        return -1;
+
+    return fh[fd].ptr;
+}
+
+/* Tell how big the file is */
+static size_t iso_total(void * h) {
+    file_t fd = (file_t)h;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken)
+        return -1;
+
+    return fh[fd].size;
+}
+
+/* Helper function for readdir: post-processes an ISO filename to make
+   it a bit prettier. */
+static void fn_postprocess(char *fnin) {
+    char    * fn = fnin;
+
+    while(*fn && *fn != ';') {
+        *fn = tolower((int) * fn);
+        fn++;
+    }
+
+    *fn = 0;
+
+    /* Strip trailing dots */
+    if(fn > fnin && fn[-1] == '.') {
+        fn[-1] = 0;
+    }
+}
+
+/* Read a directory entry into the handle's dirent; the caller holds the
+   handle's mutex. The entry is parsed with cache_mutex held, so its line
+   can't be refilled under it. Returns 1 for an entry, 0 at the end of the
+   directory, or -1 (errno EIO) if it couldn't be read. */
+static int iso_readdir_locked(file_t fd) {
+    int     c;
+    iso_dirent_t    *de;
+
+    /* RockRidge */
+    int     len;
+    uint8       *pnt;
+
+    /* Scan forwards until we find the next valid entry, an
+       end-of-entry mark, or run out of dir size. */
+    c = -1;
+    de = NULL;
+
+    while(fh[fd].ptr < fh[fd].size) {
+        /* Get the current dirent block */
+        c = biread_hold(fh[fd].first_extent + fh[fd].ptr / 2048,
+                        fh[fd].first_extent,
+                        extent_end(fh[fd].first_extent, fh[fd].size));
+
+        if(c < 0) {
+            errno = EIO;
+            return -1;
+        }
+
+        de = (iso_dirent_t *)(bdata(&icache, c) + (fh[fd].ptr % 2048));
+
+        if(de->length) break;
+
+        /* Skip to the next sector */
+        mutex_unlock(&cache_mutex);
+        fh[fd].ptr += 2048 - (fh[fd].ptr % 2048);
+    }
+
+    if(fh[fd].ptr >= fh[fd].size) return 0;
+
+    /* If we're at the first, skip the two blank entries */
+    if(!de->name[0] && de->name_len == 1) {
+        fh[fd].ptr += de->length;
+        de = (iso_dirent_t *)(bdata(&icache, c) + (fh[fd].ptr % 2048));
+        fh[fd].ptr += de->length;
+        de = (iso_dirent_t *)(bdata(&icache, c) + (fh[fd].ptr % 2048));
+
+        if(!de->length) {
+            mutex_unlock(&cache_mutex);
+            return 0;
+        }
+    }
+
+    if(joliet) {
+        ucs2utfn((uint8 *)fh[fd].dirent.name, (uint8 *)de->name, de->name_len);
+    }
+    else {
+        /* Fill out the VFS dirent */
+        strncpy(fh[fd].dirent.name, de->name, de->name_len);
+        fh[fd].dirent.name[de->name_len] = 0;
+        fn_postprocess(fh[fd].dirent.name);
+
+        /* Check for Rock Ridge NM extension */
+        len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
+        pnt = (uint8*)de + sizeof(iso_dirent_t) - sizeof(de->name) + de->name_len;
+
+        if((de->name_len & 1) == 0) {
+            pnt++;
+            len--;
+        }
+
+        while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
+            if(strncmp((char *)pnt, "NM", 2) == 0) {
+                strncpy(fh[fd].dirent.name, (char *)(pnt + 5), pnt[2] - 5);
+                fh[fd].dirent.name[pnt[2] - 5] = 0;
+            }
+
+            len -= pnt[2];
+            pnt += pnt[2];
+        }
+    }
+
+    if(de->flags & 2) {
+        fh[fd].dirent.size = -1;
+        fh[fd].dirent.attr = O_DIR;
+    }
+    else {
+        fh[fd].dirent.size = iso_733(de->size);
+        fh[fd].dirent.attr = 0;
+    }
+
+    fh[fd].ptr += de->length;
+    mutex_unlock(&cache_mutex);
+
+    return 1;
+}
+
+/* After the root directory's own entries, list the audio tracks */
+static dirent_t *pcm_readdir(file_t fd) {
+    pcm_track_t *t;
+    iso_dirent_t found;
+
+    if(fh[fd].first_extent != root_extent)
+        return NULL;
+
+    /* Leave out a track a file on the disc has the name of: iso_open would
+       never get to it, and the file's already been listed */
+    do {
+        if(fh[fd].pcm_next >= pcm_count)
+            return NULL;
+
+        t = pcm_tracks + fh[fd].pcm_next++;
+        sprintf(fh[fd].dirent.name, "track%02d.pcm", t->num);
+    } while(find_object_path(fh[fd].dirent.name, 0, &root_dirent, &found));
+    fh[fd].dirent.size = t->count * 2352;
+    fh[fd].dirent.attr = 0;
+
+    return &fh[fd].dirent;
+}
+
+static dirent_t *iso_readdir(void * h) {
+    file_t fd = (file_t)h;
+    dirent_t *rv;
+    int got;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || !fh[fd].dir ||
+       fh[fd].broken) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    mutex_lock(&fh[fd].mutex);
+
+    /* The audio tracks only come once the disc's own entries are over */
+    if((got = iso_readdir_locked(fd)) > 0)
+        rv = &fh[fd].dirent;
+    else if(!got)
+        rv = pcm_readdir(fd);
+    else
+        rv = NULL;
+
+    mutex_unlock(&fh[fd].mutex);
+
+    return rv;
+}
+
+static int iso_rewinddir(void * h) {
+    file_t fd = (file_t)h;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || !fh[fd].dir ||
+       fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* Rewind to the beginning of the directory. */
+    mutex_lock(&fh[fd].mutex);
+    fh[fd].ptr = 0;
+    fh[fd].pcm_next = 0;
+    mutex_unlock(&fh[fd].mutex);
+    return 0;
+}
+
+int iso_reset(void) {
+    iso_break_all();
+    bclear();
+    percd_done = 0;
+    return 0;
+}
+
+/* This handler will be called during every vblank. We have to
+   be careful about modifying variables that are in use in the
+   foreground, so instead we'll just set a "dead" flag and next
+   time someone calls in it'll get reset. */
+static int iso_last_status;
+static int iso_vblank_hnd;
+static void iso_vblank(uint32 evt) {
+    int status;
+
+    (void)evt;
+
+    /* Get the status. This may fail if a CD operation is in
+       progress in the foreground. */
+    if(cdrom_get_status(&status, &disc_type) < 0)
+        return;
+
+    if(iso_last_status != status) {
+        if(status == CD_STATUS_OPEN || status == CD_STATUS_NO_DISC)
+            percd_done = 0;
+
+        iso_last_status = status;
+    }
+}
+
+static int iso_fcntl(void *h, int cmd, va_list ap) {
+    file_t fd = (file_t)h;
+    int rv = -1;
+
+    (void)ap;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    switch(cmd) {
+        case F_GETFL:
+            rv = O_RDONLY;
+
+            if(fh[fd].dir)
+                rv |= O_DIR;
+
+            break;
+
+        case F_SETFL:
+        case F_GETFD:
+        case F_SETFD:
+            rv = 0;
+            break;
+
+        default:
+            errno = EINVAL;
+    }
+
+    return rv;
+}
+
+/********************************************************************************/
+/* Asynchronous reads. Requests queue up in order and one thread works
+   through them with the same calls fs_read() and friends use, so the
+   caller's thread only has to hand a request over and pick the result up
+   later. The drive is shared and serial anyway: one thread for all the
+   requests is enough to keep it busy.
+
+   This stands in for the BIOS request ids of cdrom_submit_cmd(): the drive
+   queue gives the drive to one waiting thread at a time, and this thread
+   is the one waiting for every asynchronous read, so only one of them is
+   ever at the drive, lined up with everyone else's reads. Several of them
+   can't be merged or put in disc order by the scheduler the way reads
+   from several threads can. */
+
+static fs_iso9660_aio_t *aio_head, **aio_tail = &aio_head;
+static mutex_t aio_mutex;
+static condvar_t aio_cond;          /* Work queued */
+static condvar_t aio_done_cond;     /* A request completed */
+static int aio_quit;
+static kthread_t *aio_thd;
+
+static int iso_aio_queue(fs_iso9660_aio_t *req) {
+    req->done = 0;
+    req->rv = -1;
+    req->err = 0;
+    req->next = NULL;
+
+    mutex_lock(&aio_mutex);
+
+    if(aio_quit) {
+        mutex_unlock(&aio_mutex);
+        errno = ENODEV;
+        return -1;
+    }
+
+    if(!req->path)
+        fh[req->fd].aio_pending++;
+
+    *aio_tail = req;
+    aio_tail = &req->next;
+    cond_signal(&aio_cond);
+    mutex_unlock(&aio_mutex);
+
+    return 0;
+}
+
+/* Carry out one request, with nothing locked */
+static void iso_aio_run(fs_iso9660_aio_t *req) {
+    void *h;
+
+    if(req->path) {
+        if(!(h = iso_open(NULL, req->path, O_RDONLY))) {
+            req->err = ENOENT;
+            return;
+        }
+    }
+    else {
+        h = (void *)req->fd;
+    }
+
+    errno = 0;
+
+    if(req->offset < 0 || iso_seek(h, req->offset, SEEK_SET) >= 0)
+        req->rv = iso_read(h, req->buf, req->bytes);
+
+    if(req->rv < 0)
+        req->err = errno ? errno : EIO;
+
+    if(req->path)
+        iso_close(h);
+}
+
+static void *aio_thread(void *param) {
+    fs_iso9660_aio_t *req;
+    semaphore_t *sem;
+
+    (void)param;
+
+    mutex_lock(&aio_mutex);
+
+    /* Whatever is queued when shutdown comes is still carried out */
+    for(;;) {
+        if(!(req = aio_head)) {
+            if(aio_quit)
+                break;
+
+            cond_wait(&aio_cond, &aio_mutex);
+            continue;
+        }
+
+        if(!(aio_head = req->next))
+            aio_tail = &aio_head;
+
+        mutex_unlock(&aio_mutex);
+
+        iso_aio_run(req);
+
+        if(req->callback)
+            req->callback(req);
+
+        /* The request may be gone as soon as done is seen */
+        sem = req->sem;
+        mutex_lock(&aio_mutex);
+
+        if(!req->path)
+            fh[req->fd].aio_pending--;
+
+        req->done = 1;
+        cond_broadcast(&aio_done_cond);
+
+        if(sem) {
+            mutex_unlock(&aio_mutex);
+            sem_signal(sem);
+            mutex_lock(&aio_mutex);
+        }
+    }
+
+    mutex_unlock(&aio_mutex);
+    return NULL;
+}
+
+/********************************************************************************/
+/* Batch reads */
+
+/* A batch read is a list of byte ranges on the disc, sorted by sector, and
+   read in one sweep up the disc. Each command either reads whole sectors
+   of one big range straight into its (aligned) buffer, or reads a stretch
+   of FS_CD_BATCH_SIZE holding as many small ranges and the gaps between
+   them as fit into a staging buffer, to be copied out. Batch loads and
+   positional reads are both made of these. */
+
+#define BATCH_SECTORS (FS_CD_BATCH_SIZE / 2048)
+
+typedef struct {
+    uint32  first, last;    /* Sectors [first, last) wanted */
+    uint32  skip;           /* Bytes of the first one that aren't */
+    uint32  size;           /* Bytes wanted */
+    uint8   *buf;
+    int     err;            /* errno once a read of it has failed */
+    int     idx;            /* Which of the caller's it is */
+    int     alloc;          /* buf was allocated for it */
+} batch_ent_t;
+
+/* Fill in e for size bytes from offset in the extent starting at sector */
+static void batch_ent(batch_ent_t *e, uint32 sector, uint32 offset,
+                      uint32 size, void *buf, int idx) {
+    e->first = sector + offset / 2048;
+    e->last = sector + (offset + size + 2047) / 2048;
+    e->skip = offset % 2048;
+    e->size = size;
+    e->buf = buf;
+    e->err = 0;
+    e->idx = idx;
+    e->alloc = 0;
+}
+
+static int batch_cmp(const void *a, const void *b) {
+    const batch_ent_t *x = a, *y = b;
+
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/* How many sectors from s on should be read straight into e's buffer; 0
+   if they're better off sharing a staged command */
+static uint32 batch_direct(const batch_ent_t *e, const batch_ent_t *next,
+                           uint32 s, uint32 cap) {
+    uint32 pos, n;
+
+    if(s < e->first)
+        return 0;
+
+    pos = (s - e->first) * 2048;
+
+    if(pos < e->skip || pos >= e->skip + e->size ||
+       ((uint32)e->buf + pos - e->skip) & 0x1F)
+        return 0;
+
+    n = (e->skip + e->size - pos) / 2048;
+
+    /* Whatever starts inside the run wants a copy too */
+    if(next && next->first < s + n) {
+        if(next->first <= s)
+            return 0;
+
+        n = next->first - s;
+    }
+
+    if(n > cap)
+        n = cap;
+
+    return n >= BATCH_SECTORS ? n : 0;
+}
+
+/* Copy whatever each entry from e on wants of [s, s + n) out of buf (or
+   just count it, if it was read straight into place), returning the bytes
+   copied; on a failed read, fail them instead */
+static size_t batch_copy(batch_ent_t *e, batch_ent_t *end, const uint8 *buf,
+                         uint32 s, uint32 n, int err) {
+    uint32 a, b, lo, hi;
+    size_t rv = 0;
+
+    for(; e < end && e->first < s + n; e++) {
+        if(e->last <= s || e->err)
+            continue;
+
+        if(err) {
+            e->err = err;
+            continue;
+        }
+
+        /* [lo, hi) of what's wanted, counting from the first sector */
+        a = e->first > s ? e->first : s;
+        b = e->last < s + n ? e->last : s + n;
+        lo = (a - e->first) * 2048;
+        hi = (b - e->first) * 2048;
+
+        if(hi > e->skip + e->size)
+            hi = e->skip + e->size;
+
+        if(lo < e->skip) {
+            if(buf)
+                memcpy(e->buf, buf + (a - s) * 2048 + e->skip - lo,
+                       hi - e->skip);
+
+            rv += hi - e->skip;
+        }
+        else {
+            if(buf)
+                memcpy(e->buf + lo - e->skip, buf + (a - s) * 2048, hi - lo);
+
+            rv += hi - lo;
+        }
+    }
+
+    return rv;
+}
+
+/* Sort [ents, end) and read it all, calling callback after every command.
+   Failures are left in each entry's err. */
+static void batch_run(batch_ent_t *ents, batch_ent_t *end, size_t total,
+                      fs_iso9660_batch_cb_t callback, void *data) {
+    batch_ent_t *e;
+    uint8 *stage = NULL, *dst;
+    size_t done = 0;
+    uint32 pos = 0, s, last, n, cap;
+    int i, err;
+
+    qsort(ents, end - ents, sizeof(batch_ent_t), batch_cmp);
+
+    /* Best-effort commands are kept short while a reservation is held */
+    mutex_lock(&cache_mutex);
+    if(!(cap = rsv_cap(2048)))
+        cap = (uint32)-1;
+    mutex_unlock(&cache_mutex);
+
+    /* e is the first entry not read to the end */
+    for(e = ents; e < end;) {
+        s = e->first > pos ? e->first : pos;
+
+        if((n = batch_direct(e, e + 1 < end ? e + 1 : NULL, s, cap))) {
+            dst = e->buf + (s - e->first) * 2048 - e->skip;
+            dcache_inval_range((uint32)dst, n * 2048);
+            err = drive_read((void *)((uint32)dst & 0x0FFFFFFF), s, n,
+                             CDROM_READ_DMA, 0) != ERR_OK ? EIO : 0;
+            done += batch_copy(e, end, NULL, s, n, err);
+        }
+        else {
+            /* Take in whatever follows closely enough, up to a big range
+               that can have commands of its own */
+            last = e->last;
+            n = BATCH_SECTORS < cap ? BATCH_SECTORS : cap;
+
+            for(i = 1; e + i < end; i++) {
+                if(e[i].first > last + FS_CD_BATCH_GAP ||
+                   e[i].first >= s + n)
+                    break;
+
+                if(e[i].first > s &&
+                   batch_direct(e + i, e + i + 1 < end ? e + i + 1 : NULL,
+                                e[i].first, cap)) {
+                    if(last > e[i].first)
+                        last = e[i].first;
+
+                    break;
+                }
+
+                if(e[i].last > last)
+                    last = e[i].last;
+            }
+
+            if(last > s + n)
+                last = s + n;
+
+            n = last - s;
+
+            if(!stage && !(stage = memalign(32, BATCH_SECTORS * 2048))) {
+                err = ENOMEM;
+            }
+            else {
+                dcache_inval_range((uint32)stage, n * 2048);
+                err = drive_read((void *)((uint32)stage & 0x0FFFFFFF), s, n,
+                                 CDROM_READ_DMA, 0) != ERR_OK ? EIO : 0;
+            }
+
+            done += batch_copy(e, end, stage, s, n, err);
+        }
+
+        pos = s + n;
+
+        while(e < end && e->last <= pos)
+            e++;
+
+        if(callback)
+            callback(done, total, data);
+    }
+
+    free(stage);
+}
+
+/* Read each of cnt ranges of a file at their own offsets. Ranges that are
+   all in the data cache come out of it; the rest are read as one batch.
+   Nothing about the handle is touched but its extent and size. */
+static int iso_preadv(file_t fd, fs_iso9660_pread_t *vec, int cnt) {
+    uint32 extent = fh[fd].first_extent, size = fh[fd].size;
+    uint32 s, off, len, got;
+    batch_ent_t *ents, *e;
+    int i, c, rv = 0;
+    size_t total = 0;
+
+    if(cnt <= 0)
+        return 0;
+
+    if(!(ents = malloc(cnt * sizeof(batch_ent_t)))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(i = 0, e = ents; i < cnt; i++) {
+        if(vec[i].offset < 0) {
+            free(ents);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if((uint32)vec[i].offset >= size)
+            vec[i].bytes = 0;
+        else if(vec[i].bytes > size - (uint32)vec[i].offset)
+            vec[i].bytes = size - (uint32)vec[i].offset;
+
+        if(!vec[i].bytes)
+            continue;
+
+        batch_ent(e, extent, vec[i].offset, vec[i].bytes, vec[i].buf, i);
+
+        /* Already there: no need to go to the drive for it */
+        mutex_lock(&cache_mutex);
+
+        for(s = e->first; s < e->last; s++) {
+            if((c = bfind(&dcache, s)) < 0 || dcache.tag[c].busy)
+                break;
+        }
+
+        mutex_unlock(&cache_mutex);
+
+        if(s < e->last) {
+            total += e->size;
+            e++;
+            continue;
+        }
+
+        /* Sector by sector, as any of them could be gone by now */
+        for(s = e->first, off = e->skip, got = 0; s < e->last; s++, off = 0) {
+            len = 2048 - off < e->size - got ? 2048 - off : e->size - got;
+
+            if(bdcopy(s, extent, extent_end(extent, size), e->buf + got, off,
+                      len, 0) < 0) {
+                free(ents);
+                errno = EIO;
+                return -1;
+            }
+
+            got += len;
+        }
+    }
+
+    batch_run(ents, e, total, NULL, NULL);
+
+    for(i = 0; ents + i < e; i++) {
+        if(ents[i].err) {
+            errno = ents[i].err;
+            rv = -1;
+        }
+    }
+
+    free(ents);
+    return rv;
+}
+
+/********************************************************************************/
+/* Streams */
+
+/* A stream keeps an application's ring buffer topped up from a file. The
+   ring's produce and consume counts only ever go up (wrapping), so
+   produce - consume is the fill level and each count modulo the size is
+   where in the ring it's at. The stream thread is the only producer and
+   the application the only consumer; stream_mutex covers the counts.
+
+   Once the level falls to the low-water mark the thread refills the ring
+   until it's full, by DMA of whole sectors straight into it where the ring
+   and the file line up, otherwise through a staging buffer. What's left of
+   a staged sector that didn't fit, as at the ring's end, is kept for the
+   next refill, which starts with it instead of reading it again. Refills
+   below the mark are urgent. At the end of the file, or of the loop set, it
+   carries on from the loop's start, so the ring never runs dry for a
+   seek. */
+
+#define STREAM_SECTORS (FS_CD_BOUNCE_SIZE / 2048 > 0 ? \
+                        FS_CD_BOUNCE_SIZE / 2048 : 1)
+
+struct fs_iso9660_stream {
+    uint8       *ring;
+    uint32      size, low;          /* Ring size, low-water mark */
+    uint32      produce, consume;   /* Bytes put in and taken out */
+    uint32      extent, fsize;      /* The file */
+    uint32      ssize;              /* Its bytes per sector */
+    uint32      pos;                /* Where in it the next refill's from */
+    uint32      loop_start, loop_end;
+    int         loop;
+    int         filling;            /* Topping up until full */
+    int         busy;               /* A refill is running */
+    int         closing;
+    int         eof, err;
+    int         dry;                /* Found empty, and counted (or not
+                                       started yet) */
+    uint32      underruns, refills;
+    uint8       carry[2352];        /* The rest of the last sector staged */
+    uint32      carry_pos;          /* Where in the file it's from */
+    uint32      carry_len;
+    struct fs_iso9660_stream *next;
+};
+
+static fs_iso9660_stream_t *streams;
+static mutex_t stream_mutex;
+static condvar_t stream_cond;       /* A stream wants a refill */
+static condvar_t stream_done_cond;  /* A refill is over */
+static int stream_quit;
+static kthread_t *stream_thd;
+static uint8 *stream_stage;
+
+/* The stream most in need of a refill, with stream_mutex held */
+static fs_iso9660_stream_t *stream_pick(void) {
+    fs_iso9660_stream_t *s, *best = NULL;
+
+    for(s = streams; s; s = s->next) {
+        if(s->closing || s->eof || s->err)
+            continue;
+
+        if(s->produce - s->consume <= s->low)
+            s->filling = 1;
+
+        if(s->produce - s->consume == s->size)
+            s->filling = 0;
+
+        if(s->filling && (!best || s->produce - s->consume <
+                          best->produce - best->consume))
+            best = s;
+    }
+
+    return best;
+}
+
+/* n more bytes of s are in the ring, from pos in the file, with
+   stream_mutex held */
+static void stream_produced(fs_iso9660_stream_t *s, uint32 pos, uint32 n,
+                            uint32 end) {
+    s->pos = pos + n;
+    s->produce += n;
+    s->dry = 0;
+
+    /* Say so now, not once the ring has run dry */
+    if(s->pos >= end && (!s->loop || s->loop_start >= end))
+        s->eof = 1;
+
+    cond_broadcast(&stream_done_cond);
+}
+
+/* Refill some of s from the file, with stream_mutex held (and let go of
+   for the read itself) */
+static void stream_refill(fs_iso9660_stream_t *s) {
+    uint32 level = s->produce - s->consume, w = s->produce % s->size;
+    uint32 end = s->loop && s->loop_end ? s->loop_end : s->fsize;
+    uint32 pos = s->pos, ss = s->ssize, n, sector, cnt, left;
+    uint8 *dst;
+    int urgent = level < s->low, rv;
+
+    if(pos >= end) {
+        if(!s->loop || s->loop_start >= end) {
+            s->eof = 1;
+            cond_broadcast(&stream_done_cond);
+            return;
+        }
+
+        pos = s->loop_start;
+    }
+
+    /* As much as fits before the ring wraps, up to one staging buffer */
+    n = s->size - level < s->size - w ? s->size - level : s->size - w;
+
+    if(n > end - pos)
+        n = end - pos;
+
+    /* The rest of the sector the last refill staged needs no read */
+    if(s->carry_len && s->carry_pos == pos) {
+        if(n > s->carry_len)
+            n = s->carry_len;
+
+        memcpy(s->ring + w, s->carry, n);
+        s->carry_len -= n;
+        s->carry_pos += n;
+        memmove(s->carry, s->carry + n, s->carry_len);
+        stream_produced(s, pos, n, end);
+        return;
+    }
+
+    s->carry_len = 0;
+
+    if(n > STREAM_SECTORS * ss)
+        n = STREAM_SECTORS * ss;
+
+    sector = s->extent + pos / ss;
+    dst = s->ring + w;
+
+    /* Straight into the ring if that's whole sectors to a 32-byte line,
+       and an even number of them if they're 2352 bytes (see ra_claim) */
+    if(!(pos % ss) && !((uint32)dst & 0x1F) &&
+       n >= (ss & 0x1F ? 2 : 1) * ss) {
+        cnt = n / ss;
+
+        if(ss & 0x1F)
+            cnt &= ~1;
+
+        n = cnt * ss;
+    }
+    else {
+        cnt = (pos % ss + n + ss - 1) / ss;
+
+        if(cnt > STREAM_SECTORS) {
+            cnt = STREAM_SECTORS;
+            n = cnt * ss - pos % ss;
+        }
+
+        /* Room for audio tracks' whole sectors too, to the end of a line */
+        if(!stream_stage &&
+           !(stream_stage = memalign(32, (STREAM_SECTORS * 2352 + 31) &
+                                         ~31))) {
+            s->err = ENOMEM;
+            cond_broadcast(&stream_done_cond);
+            return;
+        }
+
+        dst = stream_stage;
+    }
+
+    s->busy = 1;
+    mutex_unlock(&stream_mutex);
+
+    dcache_inval_range((uint32)dst, cnt * ss);
+    rv = drive_read((void *)((uint32)dst & 0x0FFFFFFF), sector, cnt,
+                    CDROM_READ_DMA | (ss == 2352 ? DRIVE_RAW : 0), urgent);
+
+    if(rv == ERR_OK && dst == stream_stage) {
+        memcpy(s->ring + w, dst + pos % ss, n);
+
+        /* Keep what's left of the last sector, up to the end */
+        left = cnt * ss - pos % ss - n;
+
+        if(left > end - pos - n)
+            left = end - pos - n;
+
+        memcpy(s->carry, dst + pos % ss + n, left);
+        s->carry_pos = pos + n;
+        s->carry_len = left;
+    }
+
+    mutex_lock(&stream_mutex);
+    s->busy = 0;
+    s->refills++;
+
+    if(rv != ERR_OK) {
+        s->err = EIO;
+        cond_broadcast(&stream_done_cond);
+    }
+    else {
+        stream_produced(s, pos, n, end);
+    }
+}
+
+static void *stream_thread(void *param) {
+    fs_iso9660_stream_t *s;
+
+    (void)param;
+
+    mutex_lock(&stream_mutex);
+
+    while(!stream_quit) {
+        if((s = stream_pick()))
+            stream_refill(s);
         else
-            return start;
+            cond_wait(&stream_cond, &stream_mutex);
+    }
+
+    mutex_unlock(&stream_mutex);
+    return NULL;
+}
+
+/********************************************************************************/
+/* CDDA */
+
+/* The CDDA thread puts the music back after a break. Once the drive has
+   been idle for cdda_linger ms it takes the drive and plays from where the
+   break began (CMD_PLAY2) to the end of the range. That doesn't repeat:
+   cdda_tail is set, and the thread asks for the drive's status every
+   CDDA_POLL ms, to start the range over once the music has stopped. */
+
+#define CDDA_POLL       250
+
+static int cdda_tail;               /* Playing out a range broken into */
+static int cdda_quit;
+static kthread_t *cdda_thd;
+
+/* Has the music stopped? With drive_mutex held, and the drive idle. */
+static int cdda_stopped(void) {
+    int status, rv;
+
+    drive_own();
+    mutex_unlock(&drive_mutex);
+    rv = cdrom_get_status(&status, NULL);
+    mutex_lock(&drive_mutex);
+    drive_release();
+
+    return rv >= 0 && status != CD_STATUS_PLAYING &&
+           status != CD_STATUS_BUSY && status != CD_STATUS_SEEKING;
+}
+
+static void *cdda_thread(void *param) {
+    uint32 start, end, repeat;
+    int rv;
+
+    (void)param;
+
+    mutex_lock(&drive_mutex);
+
+    while(!cdda_quit) {
+        if(!cdda_on || drive_busy) {
+            cond_wait(&drive_cond, &drive_mutex);
+            continue;
+        }
+
+        if(cdda_playing) {
+            if(cond_wait_timed(&drive_cond, &drive_mutex, CDDA_POLL) >= 0 ||
+               !cdda_on || !cdda_playing || drive_busy || !cdda_stopped())
+                continue;
+
+            /* Come to the end of the range; it may have been broken into
+               meanwhile */
+            if(cdda_playing) {
+                cdda_playing = 0;
+
+                if(cdda_tail)
+                    cdda_pos = cdda_end;
+                else
+                    cdda_on = 0;
+            }
+
+            continue;
+        }
+
+        /* Give reads following on a moment to turn up */
+        if(cdda_linger && cond_wait_timed(&drive_cond, &drive_mutex,
+                                          cdda_linger) >= 0)
+            continue;
+
+        if(!cdda_on || cdda_playing || drive_busy)
+            continue;
+
+        start = cdda_pos;
+        end = cdda_end;
+        repeat = 0;
+
+        if(start <= cdda_start || start >= end) {
+            if(start >= end && !cdda_repeat) {
+                cdda_on = 0;
+                continue;
+            }
+
+            start = cdda_start;
+            repeat = cdda_repeat;
+        }
+
+        drive_own();
+        mutex_unlock(&drive_mutex);
+        rv = cdrom_cdda_play(start, end, repeat, CDDA_SECTORS);
+        mutex_lock(&drive_mutex);
+
+        if(rv == ERR_OK) {
+            cdda_playing = 1;
+            cdda_tail = start != cdda_start && cdda_repeat;
+        }
+        else {
+            cdda_on = 0;
+        }
+
+        drive_release();
+    }
+
+    mutex_unlock(&drive_mutex);
+    return NULL;
+}
+
+/* Pin the data at a file's position, up to the end of its cache line, and
+   move past it as a read would */
+static int iso_pin(file_t fd, fs_iso9660_pin_t *pin) {
+    uint32 sector, lo, hi, off, avail, ss = fh_ssize(fd);
+    int c, seq, urgent;
+    cache_tag_t *t;
+
+    if(fh[fd].ptr >= fh[fd].size) {
+        pin->data = NULL;
+        pin->len = 0;
+        return 0;
+    }
+
+    seq = fh[fd].ptr == fh[fd].ra_ptr;
+    sector = fh[fd].first_extent + fh[fd].ptr / ss;
+    lo = fh[fd].first_extent;
+    hi = fh_end(fd);
+    off = fh[fd].ptr % ss;
+    urgent = rsv_underrun(fd, 1);
+
+    mutex_lock(&cache_mutex);
+
+    if((c = bread_locked(&dcache, sector, lo, hi, urgent)) >= 0) {
+        t = dcache.tag + (c >> dcache.shift);
+
+        if(bpin(&dcache, c >> dcache.shift) < 0) {
+            mutex_unlock(&cache_mutex);
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        avail = (t->sector + t->count - sector) * ss - off;
+    }
+
+    mutex_unlock(&cache_mutex);
+
+    if(c < 0) {
+        if(c == -2)
+            init_percd();
+
+        errno = EIO;
+        return -1;
+    }
+
+    if(avail > fh[fd].size - fh[fd].ptr)
+        avail = fh[fd].size - fh[fd].ptr;
+
+    if(pin->len && pin->len < avail)
+        avail = pin->len;
+
+    pin->data = bsector(&dcache, c) + off;
+    pin->len = avail;
+    fh[fd].ptr += avail;
+    fh[fd].ra_ptr = fh[fd].ptr;
+    ra_update(fd, seq);
+
+    return 0;
+}
+
+/* Stage for the whole sectors of XA reads, allocated the first time one
+   comes along. xa_mutex keeps them to one at a time. */
+static uint8 *xa_stage;
+static mutex_t xa_mutex;
+
+/* The channel of xa the whole Mode 2 sector s goes to, if any */
+static fs_iso9660_xa_chan_t *xa_chan(fs_iso9660_xa_read_t *xa,
+                                     const uint8 *s) {
+    int i;
+
+    if(s[15] != 2 || (xa->file >= 0 && s[16] != xa->file))
+        return NULL;
+
+    for(i = 0; i < xa->nchan; i++) {
+        if(xa->chan[i].channel == s[17] &&
+           (!xa->chan[i].submode || (xa->chan[i].submode & s[18])))
+            return xa->chan + i;
+    }
+
+    return NULL;
+}
+
+/* Read XA sectors from a file's position whole, FS_CD_XA_SECTORS at a
+   time, and hand out their data by subheader (bytes 16 to 19 of the
+   frame: file, channel, submode, coding). The caller holds the handle's
+   mutex. */
+static int iso_xa_read(file_t fd, fs_iso9660_xa_read_t *xa) {
+    uint32 sector = fh[fd].first_extent + fh[fd].ptr / 2048;
+    uint32 end = fh_end(fd), want = xa->sectors, done = 0, i, n, len;
+    fs_iso9660_xa_chan_t *c;
+    uint8 *s;
+    int rv = 0, full = 0;
+
+    xa->sectors = xa->skipped = 0;
+    xa->eof = 0;
+
+    if(want > end - sector)
+        want = sector < end ? end - sector : 0;
+
+    if(!want)
+        return 0;
+
+    mutex_lock(&xa_mutex);
+
+    /* To the end of a line, which invalidating an odd count reaches */
+    if(!xa_stage &&
+       !(xa_stage = memalign(32, (FS_CD_XA_SECTORS * 2352 + 31) & ~31))) {
+        mutex_unlock(&xa_mutex);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while(done < want && !full && !xa->eof) {
+        n = want - done < FS_CD_XA_SECTORS ? want - done : FS_CD_XA_SECTORS;
+        dcache_inval_range((uint32)xa_stage, n * 2352);
+
+        if(drive_read((void *)((uint32)xa_stage & 0x0FFFFFFF), sector + done,
+                      n, CDROM_READ_DMA | DRIVE_RAW, PRIO_NORMAL) != ERR_OK) {
+            errno = EIO;
+            rv = -1;
+            break;
+        }
+
+        for(i = 0, s = xa_stage; i < n; i++, s += 2352) {
+            if(!(c = xa_chan(xa, s))) {
+                xa->skipped++;
+            }
+            else {
+                len = (s[18] & FS_CD_XA_FORM2) ? 2324 : 2048;
+
+                if(c->len + len > c->size) {
+                    full = 1;
+                    break;
+                }
+
+                memcpy((uint8 *)c->buf + c->len, s + 24, len);
+                c->len += len;
+            }
+
+            done++;
+
+            /* Only the end of the file asked for, or of one a channel
+               took data from, as files can be interleaved */
+            if(s[15] == 2 && (s[18] & FS_CD_XA_EOF) &&
+               (c || (xa->file >= 0 && s[16] == xa->file))) {
+                xa->eof = 1;
+                break;
+            }
+        }
+    }
+
+    mutex_unlock(&xa_mutex);
+
+    fh[fd].ptr += done * 2048;
+
+    if(fh[fd].ptr > fh[fd].size)
+        fh[fd].ptr = fh[fd].size;
+
+    xa->sectors = done;
+    return rv;
+}
+
+static int iso_ioctl(void *h, int cmd, va_list ap) {
+    file_t fd = (file_t)h;
+    fs_iso9660_aio_t *aio;
+    fs_iso9660_reserve_t *r;
+    fs_iso9660_reserve_stats_t *st;
+    fs_iso9660_pread_t *vec;
+    int rv;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
+
+    switch(cmd) {
+        case FS_CD_IOCTL_PIN:
+            if(fh[fd].dir) {
+                errno = EISDIR;
+                return -1;
+            }
+
+            mutex_lock(&fh[fd].mutex);
+            rv = iso_pin(fd, va_arg(ap, fs_iso9660_pin_t *));
+            mutex_unlock(&fh[fd].mutex);
+            return rv;
+
+        case FS_CD_IOCTL_AIO_READ:
+            if(fh[fd].dir) {
+                errno = EISDIR;
+                return -1;
+            }
+
+            aio = va_arg(ap, fs_iso9660_aio_t *);
+            aio->path = NULL;
+            aio->fd = fd;
+            return iso_aio_queue(aio);
+
+        case FS_CD_IOCTL_RESERVE:
+            if(fh[fd].dir) {
+                errno = EISDIR;
+                return -1;
+            }
+
+            r = va_arg(ap, fs_iso9660_reserve_t *);
+
+            /* Start filling the margin from where the handle is now */
+            mutex_lock(&fh[fd].mutex);
+            rsv_set(fd, r ? r->rate : 0, r ? r->deadline_ms : 0);
+            ra_update(fd, fh[fd].ptr == fh[fd].ra_ptr);
+            mutex_unlock(&fh[fd].mutex);
+            return 0;
+
+        case FS_CD_IOCTL_RESERVE_STATS:
+            st = va_arg(ap, fs_iso9660_reserve_stats_t *);
+
+            mutex_lock(&cache_mutex);
+            st->underruns = rsv[fd].underruns;
+            st->refills = rsv[fd].refills;
+            st->level_ms = 0;
+
+            if(rsv[fd].rate && ra_req[fd].next > ra_req[fd].cur)
+                st->level_ms = (uint32)((uint64)(ra_req[fd].next -
+                                                 ra_req[fd].cur) *
+                                        rsv[fd].ssize * 1000 / rsv[fd].rate);
+
+            mutex_unlock(&cache_mutex);
+            return 0;
+
+        case FS_CD_IOCTL_MUNMAP:
+            mutex_lock(&fh[fd].mutex);
+            free(fh[fd].map);
+            fh[fd].map = NULL;
+            mutex_unlock(&fh[fd].mutex);
+            return 0;
+
+        case FS_CD_IOCTL_PREAD:
+        case FS_CD_IOCTL_PREADV:
+            if(fh[fd].dir) {
+                errno = EISDIR;
+                return -1;
+            }
+
+            /* Batches are made of 2048-byte sectors */
+            if(fh[fd].track) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            vec = va_arg(ap, fs_iso9660_pread_t *);
+            return iso_preadv(fd, vec, cmd == FS_CD_IOCTL_PREAD ? 1 :
+                              va_arg(ap, int));
+
+        case FS_CD_IOCTL_XA_READ:
+            if(fh[fd].dir) {
+                errno = EISDIR;
+                return -1;
+            }
+
+            if(fh[fd].track) {
+                errno = EINVAL;
+                return -1;
+            }
+
+            mutex_lock(&fh[fd].mutex);
+            rv = iso_xa_read(fd, va_arg(ap, fs_iso9660_xa_read_t *));
+            mutex_unlock(&fh[fd].mutex);
+            return rv;
+
+        default:
+            errno = EINVAL;
+            return -1;
+    }
+}
+
+/* A handle is readable unless asynchronous reads are still queued on it */
+static short iso_poll(void *h, short events) {
+    file_t fd = (file_t)h;
+    short rv = 0;
+
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken)
+        return POLLNVAL;
+
+    mutex_lock(&aio_mutex);
+
+    if(!fh[fd].aio_pending)
+        rv = events & (POLLIN | POLLRDNORM);
+
+    mutex_unlock(&aio_mutex);
+
+    return rv;
+}
+
+/* A buffer iso_load_fd() can read a file into: 32-byte aligned, with room
+   for the whole of its last sector, up to the end of a 32-byte line */
+static uint8 *iso_load_buf(file_t fd) {
+    uint32 len = (fh_end(fd) - fh[fd].first_extent) * fh_ssize(fd);
+
+    return memalign(32, len ? (len + 31) & ~31 : 1);
+}
+
+/* Read a whole file into buf, from iso_load_buf(): every sector, the last
+   one too, in one DMA run straight into place (or runs no longer than
+   rsv_cap(), while a reservation is held). Reading the last sector's slack
+   costs less than the extra command getting just the tail would. */
+static int iso_load_fd(file_t fd, uint8 *buf) {
+    uint32 first = fh[fd].first_extent, ss = fh_ssize(fd);
+    uint32 cnt = fh_end(fd) - first, done, n, cap;
+    int mode = CDROM_READ_DMA | (fh[fd].track ? DRIVE_RAW : 0);
+
+    mutex_lock(&cache_mutex);
+    if(!(cap = rsv_cap(ss)))
+        cap = cnt;
+    mutex_unlock(&cache_mutex);
+
+    /* Every run but the last has to end on a 32-byte line for the next to
+       start on one, so 2352-byte sectors are read in pairs */
+    if((ss & 0x1F) && cap < cnt)
+        cap = cap > 1 ? cap & ~1 : 2;
+
+    for(done = 0; done < cnt; done += n) {
+        n = cnt - done < cap ? cnt - done : cap;
+        dcache_inval_range((uint32)buf + done * ss, n * ss);
+
+        if(drive_read((void *)(((uint32)buf + done * ss) & 0x0FFFFFFF),
+                      first + done, n, mode, 0) != ERR_OK) {
+            errno = EIO;
+            return -1;
+        }
     }
+
+    return 0;
 }
 
-/********************************************************************************/
-/* File primitives */
+/* Load the whole file into memory, once, and hand out the same copy until
+   it's unmapped or the file is closed */
+static void *iso_mmap(void *h) {
+    file_t fd = (file_t)h;
+    uint8 *map;
 
-/* File handles.. I could probably do this with a linked list, but I'm just
-   too lazy right now. =) */
-static struct {
-    uint32      first_extent;   /* First sector */
-    int     dir;        /* >0 if a directory */
-    uint32      ptr;        /* Current read position in bytes */
-    uint32      size;       /* Length of file in bytes */
-    dirent_t    dirent;     /* A static dirent to pass back to clients */
-    int     broken;     /* >0 if the CD has been swapped out since open */
-} fh[FS_CD_MAX_FILES];
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken) {
+        errno = EBADF;
+        return NULL;
+    }
 
-/* Mutex for file handles */
-static mutex_t fh_mutex;
+    if(fh[fd].dir) {
+        errno = EISDIR;
+        return NULL;
+    }
 
-/* Break all of our open file descriptor. This is necessary when the disc
-   is changed so that we don't accidentally try to keep on doing stuff
-   with the old info. As files are closed and re-opened, the broken flag
-   will be cleared. */
-static void iso_break_all(void) {
-    int i;
+    mutex_lock(&fh[fd].mutex);
 
-    mutex_lock(&fh_mutex);
+    if(!(map = fh[fd].map)) {
+        if(!(map = iso_load_buf(fd))) {
+            errno = ENOMEM;
+        }
+        else if(iso_load_fd(fd, map) < 0) {
+            free(map);
+            map = NULL;
+        }
 
-    for(i = 0; i < FS_CD_MAX_FILES; i++)
-        fh[i].broken = 1;
+        fh[fd].map = map;
+    }
 
-    mutex_unlock(&fh_mutex);
+    mutex_unlock(&fh[fd].mutex);
+
+    return map;
 }
 
-/* Open a file or directory */
-static void * iso_open(vfs_handler_t * vfs, const char *fn, int mode) {
-    file_t      fd;
-    iso_dirent_t    *de;
+static int iso_fstat(void *h, struct stat *st) {
+    file_t fd = (file_t)h;
 
-    (void)vfs;
+    if(fd >= FS_CD_MAX_FILES || !fh[fd].inuse || fh[fd].broken) {
+        errno = EBADF;
+        return -1;
+    }
 
-    /* Make sure they don't want to open things as writeable */
-    if((mode & O_MODE_MASK) != O_RDONLY)
-        return 0;
+    memset(st, 0, sizeof(struct stat));
 
-    /* Do this only when we need to (this is still imperfect) */
-    if(!percd_done && init_percd() < 0)
-        return 0;
+    if(fh[fd].dir) {
+        st->st_size = 0;
+        st->st_dev = 'c' | ('d' << 8);
+        st->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR |
+            S_IXGRP | S_IXOTH;
+        st->st_nlink = 1;
+        st->st_blksize = 512;
+    }
+    else {
+        st->st_size = fh[fd].size;
+        st->st_dev = 'c' | ('d' << 8);
+        st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR |
+            S_IXGRP | S_IXOTH;
+        st->st_nlink = 1;
+        st->st_blksize = 512;
+    }
 
-    percd_done = 1;
+    return 0;
+}
 
-    /* Find the file we want */
-    de = find_object_path(fn, (mode & O_DIR) ? 1 : 0, &root_dirent);
+/* Put everything together */
+static vfs_handler_t vh = {
+    /* Name handler */
+    {
+        "/cd",          /* name */
+        0,              /* tbfi */
+        0x00010000,     /* Version 1.0 */
+        0,              /* flags */
+        NMMGR_TYPE_VFS, /* VFS handler */
+        NMMGR_LIST_INIT
+    },
 
-    if(!de) return 0;
+    0, NULL,            /* no cacheing, privdata */
 
-    /* Find a free file handle */
-    mutex_lock(&fh_mutex);
+    iso_open,
+    iso_close,
+    iso_read,
+    NULL,
+    iso_seek,
+    iso_tell,
+    iso_total,
+    iso_readdir,
+    iso_ioctl,
+    NULL,
+    NULL,
+    iso_mmap,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    iso_fcntl,
+    iso_poll,
+    NULL,               /* link */
+    NULL,               /* symlink */
+    NULL,               /* seek64 */
+    NULL,               /* tell64 */
+    NULL,               /* total64 */
+    NULL,               /* readlink */
+    iso_rewinddir,
+    iso_fstat
+};
 
-    for(fd = 0; fd < FS_CD_MAX_FILES; fd++)
-        if(fh[fd].first_extent == 0) {
-            fh[fd].first_extent = -1;
-            break;
-        }
+int fs_iso9660_set_cache_size(size_t icache_bytes, size_t dcache_bytes) {
+    int rv;
 
-    mutex_unlock(&fh_mutex);
+    mutex_lock(&cache_mutex);
+    bidle();
+    rv = balloc_caches(icache_bytes, dcache_bytes, icache_shift,
+                       dcache_shift);
+    mutex_unlock(&cache_mutex);
 
-    if(fd >= FS_CD_MAX_FILES)
-        return 0;
+    return rv;
+}
 
-    /* Fill in the file handle and return the fd */
-    fh[fd].first_extent = iso_733(de->extent);
-    fh[fd].dir = (mode & O_DIR) ? 1 : 0;
-    fh[fd].ptr = 0;
-    fh[fd].size = iso_733(de->size);
-    fh[fd].broken = 0;
+int fs_iso9660_set_cache_cluster(int icache_sectors, int dcache_sectors) {
+    int ishift = bcluster_shift(icache_sectors);
+    int dshift = bcluster_shift(dcache_sectors);
+    int rv;
 
-    return (void *)fd;
+    if(ishift < 0 || dshift < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_lock(&cache_mutex);
+    bidle();
+    rv = balloc_caches(icache_budget, dcache_budget, ishift, dshift);
+    mutex_unlock(&cache_mutex);
+
+    return rv;
 }
 
-/* Close a file or directory */
-static int iso_close(void * h) {
-    file_t fd = (file_t)h;
+int fs_iso9660_set_fill_mode(int mode) {
+    if(mode != CDROM_READ_DMA && mode != CDROM_READ_PIO) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    /* Check that the fd is valid */
-    if(fd < FS_CD_MAX_FILES) {
-        /* No need to lock the mutex: this is an atomic op */
-        fh[fd].first_extent = 0;
+    mutex_lock(&cache_mutex);
+    fill_mode = mode;
+    mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+int fs_iso9660_set_readahead(int max_sectors) {
+    if(max_sectors < 0) {
+        errno = EINVAL;
+        return -1;
     }
+
+    mutex_lock(&cache_mutex);
+    ra_max = max_sectors;
+    mutex_unlock(&cache_mutex);
+
     return 0;
 }
 
-/* Read from a file */
-static ssize_t iso_read(void * h, void *buf, size_t bytes) {
-    int rv, toread, thissect, c;
-    uint8 * outbuf;
-    file_t fd = (file_t)h;
+int fs_iso9660_set_cache_policy(int policy) {
+    if(policy != FS_CD_POLICY_LRU && policy != FS_CD_POLICY_2Q) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    /* Check that the fd is valid */
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
+    mutex_lock(&cache_mutex);
+    bidle();
+    dcache.policy = policy;
+    binit_cache(&dcache);
+    memset(ra_req, 0, sizeof(ra_req));
+    mutex_unlock(&cache_mutex);
+
+    return 0;
+}
+
+int fs_iso9660_set_sched(int sched) {
+    if(sched != FS_CD_SCHED_FIFO && sched != FS_CD_SCHED_ELEVATOR) {
+        errno = EINVAL;
         return -1;
+    }
+
+    mutex_lock(&drive_mutex);
+    drive_sched = sched;
+    mutex_unlock(&drive_mutex);
+
+    return 0;
+}
+
+void fs_iso9660_get_cache_stats(fs_iso9660_cache_stats_t *stats) {
+    mutex_lock(&cache_mutex);
+    stats->ihits = icache.hits;
+    stats->imisses = icache.misses;
+    stats->dhits = dcache.hits;
+    stats->dmisses = dcache.misses;
+    stats->dprefetched = dcache.prefetched;
+    mutex_unlock(&cache_mutex);
+}
+
+int fs_iso9660_unpin(const void *data) {
+    uint32 off;
+    int i, rv = -1;
+
+    mutex_lock(&cache_mutex);
+
+    off = (const uint8 *)data - dcache.data;
+    i = off >> (11 + dcache.shift);
+
+    if((const uint8 *)data >= dcache.data && i < dcache.count &&
+       dcache.tag[i].pins) {
+        bunpin(&dcache, i);
+        rv = 0;
+    }
+    else {
+        errno = EINVAL;
+    }
+
+    mutex_unlock(&cache_mutex);
+
+    return rv;
+}
 
-    while(mutex_is_locked(&iso_mutex)) {
-        thd_pass();
+int fs_iso9660_aio_submit(fs_iso9660_aio_t *req) {
+    if(!req->path) {
+        errno = EINVAL;
+        return -1;
     }
 
-    mutex_lock(&iso_mutex);
+    return iso_aio_queue(req);
+}
+
+int fs_iso9660_aio_poll(fs_iso9660_aio_t *req) {
+    return req->done;
+}
 
-    rv = 0;
-    outbuf = (uint8 *)buf;
+ssize_t fs_iso9660_aio_wait(fs_iso9660_aio_t *req) {
+    mutex_lock(&aio_mutex);
 
-    if(!((uint32)buf & 0x1F) && !(bytes & 0x7FF) && !(fh[fd].ptr & 0x7FF)) {
-        rv = cdrom_read_sectors_ex ((void *) ((uint32) buf & 0x0FFFFFFF),
-                                   (fh[fd].first_extent + 150) + fh[fd].ptr / 2048,
-                                   bytes / 2048, CDROM_READ_DMA);
-        if(rv < 0) {
-            mutex_unlock(&iso_mutex);
-            return -1;
-        }
-        fh[fd].ptr += bytes;
+    while(!req->done)
+        cond_wait(&aio_done_cond, &aio_mutex);
+
+    mutex_unlock(&aio_mutex);
+
+    if(req->rv < 0)
+        errno = req->err;
 
-        mutex_unlock(&iso_mutex);
+    return req->rv;
+}
+
+int fs_iso9660_load_batch(fs_iso9660_batch_t *files, int cnt,
+                          fs_iso9660_batch_cb_t callback, void *data) {
+    batch_ent_t *ents, *e;
+    iso_dirent_t *de, found;
+    size_t total = 0;
+    uint32 size;
+    int i, err, rv = 0;
+
+    if(cnt <= 0)
+        return 0;
 
-        return bytes;
+    if(!(ents = malloc(cnt * sizeof(batch_ent_t)))) {
+        errno = ENOMEM;
+        return -1;
     }
 
-    /* Read zero or more sectors into the buffer from the current pos */
-    while(bytes > 0) {
-        /* Figure out how much we still need to read */
-        toread = (bytes > (fh[fd].size - fh[fd].ptr)) ?
-                 fh[fd].size - fh[fd].ptr : bytes;
+    /* Look everything up before the head goes anywhere */
+    err = !percd_done && percd_mount() < 0 ? ENODEV : 0;
 
-        if(toread == 0) break;
+    for(i = 0, e = ents; i < cnt; i++) {
+        files[i].err = err;
 
-        /* How much more can we read in the current sector? */
-        thissect = 2048 - (fh[fd].ptr % 2048);
-
-        /* If we're on a sector boundary and we have more than one
-           full sector to read, then short-circuit the cache here
-           and use the multi-sector reads from the CD unit (this
-           should theoretically be a lot faster) */
-        /* XXX This code isn't actually faster, but I'm leaving it
-           here commented out in case we could find a better use
-           for it later than speed (i.e., preventing thread context
-           switches). */
-        /* if(thissect == 2048 && toread >= 2048) {
-            // Round it off to an even sector count
-            thissect = toread / 2048;
-            toread = thissect * 2048;
-
-            printf("cdrom: short-circuit read for %d sectors\n",
-                thissect);
-
-            // Do the read
-            if(cdrom_read_sectors(outbuf,
-                fh[fd].first_extent + fh[fd].ptr/2048 + 150,
-                thissect) < 0)
-            {
-                // Something went wrong...
-                return -1;
+        if(err)
+            continue;
+
+        if(!files[i].path ||
+           !(de = find_object_path(files[i].path, 0, &root_dirent,
+                                   &found))) {
+            files[i].err = ENOENT;
+            continue;
+        }
+
+        size = iso_733(de->size);
+
+        if(files[i].buf && files[i].bytes < size)
+            size = files[i].bytes;
+
+        batch_ent(e, iso_733(de->extent), 0, size, files[i].buf, i);
+
+        if(!files[i].buf) {
+            if(!(e->buf = files[i].buf = memalign(32, size ? size : 1))) {
+                files[i].err = ENOMEM;
+                continue;
             }
-        } else { */
-        toread = (toread > thissect) ? thissect : toread;
 
-        /* Do the read */
-        c = bdread(fh[fd].first_extent + fh[fd].ptr / 2048);
+            e->alloc = 1;
+        }
+
+        files[i].bytes = size;
 
-        if(c < 0) {
-            mutex_unlock(&iso_mutex);
-            return -1;
+        /* Nothing to read */
+        if(size) {
+            total += size;
+            e++;
         }
+    }
 
-        memcpy(outbuf, dcache[c]->data + (fh[fd].ptr % 2048), toread);
-        /* } */
+    batch_run(ents, e, total, callback, data);
 
-        /* Adjust pointers */
-        outbuf += toread;
-        fh[fd].ptr += toread;
-        bytes -= toread;
-        rv += toread;
+    while(e-- > ents) {
+        if((files[e->idx].err = e->err) && e->alloc) {
+            free(e->buf);
+            files[e->idx].buf = NULL;
+        }
+    }
+
+    free(ents);
+
+    for(i = 0; i < cnt; i++) {
+        if(!files[i].err)
+            continue;
+
+        files[i].bytes = 0;
+
+        if(!rv) {
+            errno = files[i].err;
+            rv = -1;
+        }
     }
 
-    mutex_unlock(&iso_mutex);
     return rv;
 }
 
-/* Seek elsewhere in a file */
-static off_t iso_seek(void * h, off_t offset, int whence) {
-    file_t fd = (file_t)h;
+ssize_t fs_iso9660_load(const char *path, void **out) {
+    file_t fd;
+    uint8 *buf;
+    ssize_t rv;
 
-    /* Check that the fd is valid */
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken) {
-        errno = EBADF;
+    if(!(fd = (file_t)iso_open(NULL, path, O_RDONLY))) {
+        errno = ENOENT;
         return -1;
     }
 
-    /* Update current position according to arguments */
-    switch(whence) {
-        case SEEK_SET:
-            if(offset < 0) {
-                errno = EINVAL;
-                return -1;
-            }
+    rv = fh[fd].size;
 
-            fh[fd].ptr = offset;
-            break;
+    if(!(buf = iso_load_buf(fd))) {
+        errno = ENOMEM;
+        rv = -1;
+    }
+    else if(iso_load_fd(fd, buf) < 0) {
+        free(buf);
+        rv = -1;
+    }
+    else {
+        *out = buf;
+    }
 
-        case SEEK_CUR:
-            if(offset < 0 && ((uint32)-offset) > fh[fd].ptr) {
-                errno = EINVAL;
-                return -1;
-            }
+    iso_close((void *)fd);
 
-            fh[fd].ptr += offset;
-            break;
+    return rv;
+}
+
+fs_iso9660_stream_t *fs_iso9660_stream_open(const char *path, void *ring,
+                                            size_t size, size_t low_water) {
+    fs_iso9660_stream_t *s;
+    iso_dirent_t *de = NULL, found;
+    int t;
 
-        case SEEK_END:
-            if(offset < 0 && ((uint32)-offset) > fh[fd].size) {
-                errno = EINVAL;
-                return -1;
-            }
+    if(!path || !ring || !size || low_water >= size) {
+        errno = EINVAL;
+        return NULL;
+    }
 
-            fh[fd].ptr = fh[fd].size + offset;
-            break;
+    if(!percd_done && percd_mount() < 0) {
+        errno = EIO;
+        return NULL;
+    }
 
-        default:
-            errno = EINVAL;
-            return -1;
+    if(!(de = find_object_path(path, 0, &root_dirent, &found)) &&
+       (t = pcm_find(path)) < 0) {
+        errno = ENOENT;
+        return NULL;
     }
 
-    /* Check bounds */
-    if(fh[fd].ptr > fh[fd].size) fh[fd].ptr = fh[fd].size;
+    if(!(s = calloc(1, sizeof(fs_iso9660_stream_t)))) {
+        errno = ENOMEM;
+        return NULL;
+    }
 
-    return fh[fd].ptr;
-}
+    s->ring = ring;
+    s->size = size;
+    s->low = low_water;
 
-/* Tell where in the file we are */
-static off_t iso_tell(void * h) {
-    file_t fd = (file_t)h;
+    if(de) {
+        s->extent = iso_733(de->extent);
+        s->fsize = iso_733(de->size);
+        s->ssize = 2048;
+    }
+    else {
+        s->extent = pcm_tracks[t].lba;
+        s->fsize = pcm_tracks[t].count * 2352;
+        s->ssize = 2352;
+    }
+    s->filling = 1;
+    s->dry = 1;                     /* Waiting for the first fill is fine */
 
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
-        return -1;
+    mutex_lock(&stream_mutex);
+    s->next = streams;
+    streams = s;
+    cond_signal(&stream_cond);
+    mutex_unlock(&stream_mutex);
 
-    return fh[fd].ptr;
+    return s;
 }
 
-/* Tell how big the file is */
-static size_t iso_total(void * h) {
-    file_t fd = (file_t)h;
+int fs_iso9660_stream_close(fs_iso9660_stream_t *s) {
+    fs_iso9660_stream_t **p;
 
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || fh[fd].broken)
-        return -1;
+    mutex_lock(&stream_mutex);
+    s->closing = 1;
 
-    return fh[fd].size;
-}
+    while(s->busy)
+        cond_wait(&stream_done_cond, &stream_mutex);
 
-/* Helper function for readdir: post-processes an ISO filename to make
-   it a bit prettier. */
-static void fn_postprocess(char *fnin) {
-    char    * fn = fnin;
+    for(p = &streams; *p != s; p = &(*p)->next)
+        ;
 
-    while(*fn && *fn != ';') {
-        *fn = tolower((int) * fn);
-        fn++;
-    }
+    *p = s->next;
+    mutex_unlock(&stream_mutex);
 
-    *fn = 0;
+    free(s);
+    return 0;
+}
 
-    /* Strip trailing dots */
-    if(fn > fnin && fn[-1] == '.') {
-        fn[-1] = 0;
+/* With stream_mutex held: count an underrun the first time s is found dry */
+static void stream_dry(fs_iso9660_stream_t *s) {
+    if(s->produce == s->consume && !s->eof && !s->err && !s->dry) {
+        s->dry = 1;
+        s->underruns++;
     }
 }
 
-/* Read a directory entry */
-static dirent_t *iso_readdir(void * h) {
-    int     c;
-    iso_dirent_t    *de;
+size_t fs_iso9660_stream_peek(fs_iso9660_stream_t *s, const void **data) {
+    uint32 level, r;
 
-    /* RockRidge */
-    int     len;
-    uint8       *pnt;
+    mutex_lock(&stream_mutex);
+    level = s->produce - s->consume;
+    r = s->consume % s->size;
+    stream_dry(s);
+    mutex_unlock(&stream_mutex);
 
-    file_t fd = (file_t)h;
+    *data = s->ring + r;
+    return level < s->size - r ? level : s->size - r;
+}
 
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || !fh[fd].dir ||
-       fh[fd].broken) {
-        errno = EBADF;
-        return NULL;
-    }
+void fs_iso9660_stream_consume(fs_iso9660_stream_t *s, size_t bytes) {
+    uint32 level;
 
-    /* Scan forwards until we find the next valid entry, an
-       end-of-entry mark, or run out of dir size. */
-    c = -1;
-    de = NULL;
+    mutex_lock(&stream_mutex);
+    level = s->produce - s->consume;
 
-    while(fh[fd].ptr < fh[fd].size) {
-        /* Get the current dirent block */
-        c = biread(fh[fd].first_extent + fh[fd].ptr / 2048);
+    if(bytes > level)
+        bytes = level;
 
-        if(c < 0) return NULL;
+    s->consume += bytes;
 
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+    if(level - bytes <= s->low)
+        cond_signal(&stream_cond);
 
-        if(de->length) break;
+    mutex_unlock(&stream_mutex);
+}
 
-        /* Skip to the next sector */
-        fh[fd].ptr += 2048 - (fh[fd].ptr % 2048);
-    }
+size_t fs_iso9660_stream_wait(fs_iso9660_stream_t *s, size_t bytes) {
+    size_t level;
 
-    if(fh[fd].ptr >= fh[fd].size) return NULL;
+    if(bytes > s->size)
+        bytes = s->size;
 
-    /* If we're at the first, skip the two blank entries */
-    if(!de->name[0] && de->name_len == 1) {
-        fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
-        fh[fd].ptr += de->length;
-        de = (iso_dirent_t *)(icache[c]->data + (fh[fd].ptr % 2048));
+    mutex_lock(&stream_mutex);
 
-        if(!de->length) return NULL;
-    }
+    while((level = s->produce - s->consume) < bytes && !s->eof && !s->err) {
+        stream_dry(s);
 
-    if(joliet) {
-        ucs2utfn((uint8 *)fh[fd].dirent.name, (uint8 *)de->name, de->name_len);
+        /* Top up now, whatever the level */
+        s->filling = 1;
+        cond_signal(&stream_cond);
+        cond_wait(&stream_done_cond, &stream_mutex);
     }
-    else {
-        /* Fill out the VFS dirent */
-        strncpy(fh[fd].dirent.name, de->name, de->name_len);
-        fh[fd].dirent.name[de->name_len] = 0;
-        fn_postprocess(fh[fd].dirent.name);
 
-        /* Check for Rock Ridge NM extension */
-        len = de->length - sizeof(iso_dirent_t) + sizeof(de->name) - de->name_len;
-        pnt = (uint8*)de + sizeof(iso_dirent_t) - sizeof(de->name) + de->name_len;
+    mutex_unlock(&stream_mutex);
 
-        if((de->name_len & 1) == 0) {
-            pnt++;
-            len--;
-        }
+    return level;
+}
 
-        while((len >= 4) && ((pnt[3] == 1) || (pnt[3] == 2))) {
-            if(strncmp((char *)pnt, "NM", 2) == 0) {
-                strncpy(fh[fd].dirent.name, (char *)(pnt + 5), pnt[2] - 5);
-                fh[fd].dirent.name[pnt[2] - 5] = 0;
-            }
+int fs_iso9660_stream_loop(fs_iso9660_stream_t *s, off_t start, off_t end) {
+    if(end <= 0 || end > (off_t)s->fsize)
+        end = s->fsize;
 
-            len -= pnt[2];
-            pnt += pnt[2];
-        }
+    if(start >= end) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if(de->flags & 2) {
-        fh[fd].dirent.size = -1;
-        fh[fd].dirent.attr = O_DIR;
+    mutex_lock(&stream_mutex);
+
+    if(start < 0) {
+        s->loop = 0;
     }
     else {
-        fh[fd].dirent.size = iso_733(de->size);
-        fh[fd].dirent.attr = 0;
+        s->loop = 1;
+        s->loop_start = start;
+        s->loop_end = end;
+
+        /* Wake it up again if it had run out of file */
+        s->eof = 0;
+        cond_signal(&stream_cond);
     }
 
-    fh[fd].ptr += de->length;
+    mutex_unlock(&stream_mutex);
 
-    return &fh[fd].dirent;
+    return 0;
 }
 
-static int iso_rewinddir(void * h) {
-    file_t fd = (file_t)h;
+void fs_iso9660_stream_get_stats(fs_iso9660_stream_t *s,
+                                 fs_iso9660_stream_stats_t *stats) {
+    mutex_lock(&stream_mutex);
+    stats->level = s->produce - s->consume;
+    stats->produce = s->produce % s->size;
+    stats->consume = s->consume % s->size;
+    stats->underruns = s->underruns;
+    stats->refills = s->refills;
+    stats->eof = s->eof && s->produce == s->consume;
+    stats->err = s->err;
+    mutex_unlock(&stream_mutex);
+}
 
-    if(fd >= FS_CD_MAX_FILES || fh[fd].first_extent == 0 || !fh[fd].dir ||
-       fh[fd].broken) {
-        errno = EBADF;
+int fs_iso9660_cdda_play(uint32 start, uint32 end, uint32 repeat) {
+    int rv;
+
+    if(start >= end || repeat > 15) {
+        errno = EINVAL;
         return -1;
     }
 
-    /* Rewind to the beginning of the directory. */
-    fh[fd].ptr = 0;
-    return 0;
-}
-
-int iso_reset(void) {
-    iso_break_all();
-    bclear();
-    percd_done = 0;
-    return 0;
-}
-
-/* This handler will be called during every vblank. We have to
-   be careful about modifying variables that are in use in the
-   foreground, so instead we'll just set a "dead" flag and next
-   time someone calls in it'll get reset. */
-static int iso_last_status;
-static int iso_vblank_hnd;
-static void iso_vblank(uint32 evt) {
-    int status;
+    /* Mount now, rather than reinit the drive under the music later */
+    if(!percd_done && percd_mount() < 0) {
+        errno = ENODEV;
+        return -1;
+    }
 
-    (void)evt;
+    mutex_lock(&drive_mutex);
+    drive_own();
+    cdda_on = cdda_playing = 0;
+    mutex_unlock(&drive_mutex);
 
-    /* Get the status. This may fail if a CD operation is in
-       progress in the foreground. */
-    if(cdrom_get_status(&status, &disc_type) < 0)
-        return;
+    rv = cdrom_cdda_play(start, end, repeat, CDDA_SECTORS);
 
-    if(iso_last_status != status) {
-        if(status == CD_STATUS_OPEN || status == CD_STATUS_NO_DISC)
-            percd_done = 0;
+    mutex_lock(&drive_mutex);
 
-        iso_last_status = status;
+    if(rv == ERR_OK) {
+        cdda_on = cdda_playing = 1;
+        cdda_tail = 0;
+        cdda_start = start;
+        cdda_end = end;
+        cdda_repeat = repeat;
     }
-}
-
-static int iso_fcntl(void *h, int cmd, va_list ap) {
-    file_t fd = (file_t)h;
-    int rv = -1;
 
-    (void)ap;
+    drive_release();
+    mutex_unlock(&drive_mutex);
 
-    if(fd >= FS_CD_MAX_FILES || !fh[fd].first_extent || fh[fd].broken) {
-        errno = EBADF;
+    if(rv != ERR_OK) {
+        errno = EIO;
         return -1;
     }
 
-    switch(cmd) {
-        case F_GETFL:
-            rv = O_RDONLY;
+    return 0;
+}
 
-            if(fh[fd].dir)
-                rv |= O_DIR;
+int fs_iso9660_cdda_stop(void) {
+    int playing, rv = ERR_OK;
 
-            break;
+    mutex_lock(&drive_mutex);
+    drive_own();
+    playing = cdda_playing;
+    cdda_on = cdda_playing = 0;
+    mutex_unlock(&drive_mutex);
 
-        case F_SETFL:
-        case F_GETFD:
-        case F_SETFD:
-            rv = 0;
-            break;
+    if(playing)
+        rv = cdrom_cdda_pause();
 
-        default:
-            errno = EINVAL;
+    mutex_lock(&drive_mutex);
+    drive_release();
+    mutex_unlock(&drive_mutex);
+
+    if(rv != ERR_OK) {
+        errno = EIO;
+        return -1;
     }
 
-    return rv;
+    return 0;
 }
 
-static int iso_fstat(void *h, struct stat *st) {
-    file_t fd = (file_t)h;
-
-    if(fd >= FS_CD_MAX_FILES || !fh[fd].first_extent || fh[fd].broken) {
-        errno = EBADF;
+int fs_iso9660_set_cdda_linger(int ms) {
+    if(ms < 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    memset(st, 0, sizeof(struct stat));
-
-    if(fh[fd].dir) {
-        st->st_size = 0;
-        st->st_dev = 'c' | ('d' << 8);
-        st->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR |
-            S_IXGRP | S_IXOTH;
-        st->st_nlink = 1;
-        st->st_blksize = 512;
-    }
-    else {
-        st->st_size = fh[fd].size;
-        st->st_dev = 'c' | ('d' << 8);
-        st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH | S_IXUSR |
-            S_IXGRP | S_IXOTH;
-        st->st_nlink = 1;
-        st->st_blksize = 512;
-    }
+    mutex_lock(&drive_mutex);
+    cdda_linger = ms;
+    drive_dispatch();
+    cond_broadcast(&drive_cond);
+    mutex_unlock(&drive_mutex);
 
     return 0;
 }
 
-/* Put everything together */
-static vfs_handler_t vh = {
-    /* Name handler */
-    {
-        "/cd",          /* name */
-        0,              /* tbfi */
-        0x00010000,     /* Version 1.0 */
-        0,              /* flags */
-        NMMGR_TYPE_VFS, /* VFS handler */
-        NMMGR_LIST_INIT
-    },
+void fs_iso9660_get_cache_size(size_t *icache_bytes, size_t *dcache_bytes) {
+    mutex_lock(&cache_mutex);
 
-    0, NULL,            /* no cacheing, privdata */
+    if(icache_bytes)
+        *icache_bytes = (size_t)icache.count << (11 + icache.shift);
 
-    iso_open,
-    iso_close,
-    iso_read,
-    NULL,
-    iso_seek,
-    iso_tell,
-    iso_total,
-    iso_readdir,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    iso_fcntl,
-    NULL,               /* poll */
-    NULL,               /* link */
-    NULL,               /* symlink */
-    NULL,               /* seek64 */
-    NULL,               /* tell64 */
-    NULL,               /* total64 */
-    NULL,               /* readlink */
-    iso_rewinddir,
-    iso_fstat
-};
+    if(dcache_bytes)
+        *dcache_bytes = (size_t)dcache.count << (11 + dcache.shift);
+
+    mutex_unlock(&cache_mutex);
+}
+
+/* Cache sizes set with KOS_INIT_ISO9660_CACHE, if the program used it */
+extern const size_t __kos_iso9660_cache[2] __attribute__((weak));
 
 /* Initialize the file system */
 int fs_iso9660_init(void) {
@@ -1088,19 +4280,63 @@ int fs_iso9660_init(void) {
     memset(fh, 0, sizeof(fh));
 
     /* Mark the first as active so we can have an error FD of zero */
-    fh[0].first_extent = -1;
+    fh[0].inuse = 1;
 
     /* Init thread mutexes */
     mutex_init(&cache_mutex, MUTEX_TYPE_NORMAL);
     mutex_init(&fh_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&percd_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&drive_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&bounce_mutex, MUTEX_TYPE_NORMAL);
+    mutex_init(&xa_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&drive_cond);
+
+    for(i = 0; i < FS_CD_MAX_FILES; i++)
+        mutex_init(&fh[i].mutex, MUTEX_TYPE_NORMAL);
 
     /* Allocate cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        icache[i] = malloc(sizeof(cache_block_t));
-        icache[i]->sector = -1;
-        dcache[i] = malloc(sizeof(cache_block_t));
-        dcache[i]->sector = -1;
-    }
+    icache.policy = FS_CD_POLICY_LRU;
+    dcache.policy = FS_CD_DCACHE_POLICY;
+
+    if(&__kos_iso9660_cache != NULL)
+        i = balloc_caches(__kos_iso9660_cache[0], __kos_iso9660_cache[1],
+                          bcluster_shift(FS_CD_ICACHE_CLUSTER),
+                          bcluster_shift(FS_CD_DCACHE_CLUSTER));
+    else
+        i = balloc_caches(FS_CD_ICACHE_SIZE, FS_CD_DCACHE_SIZE,
+                          bcluster_shift(FS_CD_ICACHE_CLUSTER),
+                          bcluster_shift(FS_CD_DCACHE_CLUSTER));
+
+    if(i < 0)
+        return -1;
+
+    /* Start the read-ahead thread */
+    cond_init(&ra_cond);
+    cond_init(&fill_cond);
+    memset(ra_req, 0, sizeof(ra_req));
+    ra_quit = 0;
+    ra_thd = thd_create(0, ra_thread, NULL);
+
+    /* ...and the asynchronous read thread */
+    mutex_init(&aio_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&aio_cond);
+    cond_init(&aio_done_cond);
+    aio_quit = 0;
+    aio_thd = thd_create(0, aio_thread, NULL);
+
+    /* ...and the stream thread */
+    mutex_init(&stream_mutex, MUTEX_TYPE_NORMAL);
+    cond_init(&stream_cond);
+    cond_init(&stream_done_cond);
+    streams = NULL;
+    stream_quit = 0;
+    stream_thd = thd_create(0, stream_thread, NULL);
+
+    /* ...and the CDDA thread */
+    drive_wanted = drive_owners = 0;
+    cdda_on = cdda_playing = 0;
+    cdda_quit = 0;
+    cdda_thd = thd_create(0, cdda_thread, NULL);
 
     percd_done = 0;
     iso_last_status = -1;
@@ -1114,20 +4350,78 @@ int fs_iso9660_init(void) {
 
 /* De-init the file system */
 int fs_iso9660_shutdown(void) {
+    fs_iso9660_stream_t *s;
     int i;
 
     /* De-register with vblank */
     vblank_handler_remove(iso_vblank_hnd);
 
-    /* Dealloc cache block space */
-    for(i = 0; i < NUM_CACHE_BLOCKS; i++) {
-        free(icache[i]);
-        free(dcache[i]);
+    /* Let the asynchronous reads already queued finish */
+    mutex_lock(&aio_mutex);
+    aio_quit = 1;
+    cond_signal(&aio_cond);
+    mutex_unlock(&aio_mutex);
+    thd_join(aio_thd, NULL);
+    mutex_destroy(&aio_mutex);
+    cond_destroy(&aio_cond);
+    cond_destroy(&aio_done_cond);
+
+    /* Stop refilling streams; any left open are simply dropped */
+    mutex_lock(&stream_mutex);
+    stream_quit = 1;
+    cond_signal(&stream_cond);
+    mutex_unlock(&stream_mutex);
+    thd_join(stream_thd, NULL);
+    mutex_destroy(&stream_mutex);
+    cond_destroy(&stream_cond);
+    cond_destroy(&stream_done_cond);
+    free(stream_stage);
+    stream_stage = NULL;
+
+    while((s = streams)) {
+        streams = s->next;
+        free(s);
     }
 
+    /* Leave the music be, but stop holding reads back for it */
+    mutex_lock(&drive_mutex);
+    cdda_quit = 1;
+    cdda_on = cdda_playing = 0;
+    drive_dispatch();
+    cond_broadcast(&drive_cond);
+    mutex_unlock(&drive_mutex);
+    thd_join(cdda_thd, NULL);
+
+    /* Stop the read-ahead thread */
+    mutex_lock(&cache_mutex);
+    ra_quit = 1;
+    cond_broadcast(&ra_cond);
+    mutex_unlock(&cache_mutex);
+    thd_join(ra_thd, NULL);
+    cond_destroy(&ra_cond);
+    cond_destroy(&fill_cond);
+
+    /* Dealloc cache block space */
+    free(cache_arena);
+    cache_arena = NULL;
+    free(bounce);
+    bounce = NULL;
+    free(xa_stage);
+    xa_stage = NULL;
+    free(merge_buf);
+    merge_buf = NULL;
+
     /* Free muteces */
     mutex_destroy(&cache_mutex);
     mutex_destroy(&fh_mutex);
+    mutex_destroy(&percd_mutex);
+    mutex_destroy(&drive_mutex);
+    mutex_destroy(&bounce_mutex);
+    mutex_destroy(&xa_mutex);
+    cond_destroy(&drive_cond);
+
+    for(i = 0; i < FS_CD_MAX_FILES; i++)
+        mutex_destroy(&fh[i].mutex);
 
     return nmmgr_handler_remove(&vh.nmmgr);
 }
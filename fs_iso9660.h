@@ -0,0 +1,866 @@
+/* KallistiOS ##version##
+
+   dc/fs_iso9660.h
+   Copyright (C) 2000-2003 Megan Potter
+   Copyright (C) 2012 Lawrence Sebald
+
+*/
+
+/** \file   dc/fs_iso9660.h
+    \brief  ISO9660 (CD-ROM) filesystem driver.
+
+    This driver implements support for reading files from a CD-ROM or CD-R in
+    the Dreamcast's disc drive, as well as from the high density area of a
+    GD-ROM. It is mounted on /cd by default.
+
+    Each audio track on the disc also shows up in the root directory as a
+    read-only file, /cd/trackNN.pcm for track NN, holding the track's raw
+    2352-byte sectors: 44.1kHz 16-bit little-endian stereo samples, ready to
+    mix in software. These are read like any other file, through the same
+    cache, read-ahead and DMA, and can be streamed with
+    fs_iso9660_stream_open(); only FS_CD_IOCTL_PREAD(V) and
+    fs_iso9660_load_batch() don't take them. A file on the disc by the same
+    name hides the track.
+
+    \author Megan Potter
+    \author Lawrence Sebald
+*/
+
+#ifndef __DC_FS_ISO9660_H
+#define __DC_FS_ISO9660_H
+
+#include <sys/cdefs.h>
+__BEGIN_DECLS
+
+#include <arch/types.h>
+#include <kos/limits.h>
+#include <kos/fs.h>
+#include <kos/sem.h>
+
+/** \brief  Default size of the inode (directory) cache, in bytes.
+
+    Override in kos/opts.h, or per program with KOS_INIT_ISO9660_CACHE().
+*/
+#ifndef FS_CD_ICACHE_SIZE
+#define FS_CD_ICACHE_SIZE   (16 * 2048)
+#endif
+
+/** \brief  Default size of the data cache, in bytes.
+
+    Eight lines of FS_CD_DCACHE_CLUSTER sectors. With fewer, 2Q's A1in (a
+    quarter of the lines) is down to one, and read-ahead pushes out what
+    it fetched before it is read. Keep it at least eight lines if either
+    is changed.
+*/
+#ifndef FS_CD_DCACHE_SIZE
+#define FS_CD_DCACHE_SIZE   (64 * 2048)
+#endif
+
+/** \brief  Default inode cache line size, in sectors.
+
+    On a miss the cache reads this many sectors around the one asked for
+    (aligned on the line size, and never past the end of the directory) in
+    a single drive command. Must be a power of two from 1 to 64.
+
+    Most directories are a single sector, and a line never holds more than
+    one directory, so the default keeps one directory per line and as many
+    lines as FS_CD_ICACHE_SIZE has room for.
+*/
+#ifndef FS_CD_ICACHE_CLUSTER
+#define FS_CD_ICACHE_CLUSTER    1
+#endif
+
+/** \brief  Default data cache line size, in sectors. */
+#ifndef FS_CD_DCACHE_CLUSTER
+#define FS_CD_DCACHE_CLUSTER    8
+#endif
+
+/** \brief  Default read-ahead limit, in sectors.
+
+    Handles read sequentially have up to this many sectors past their
+    position fetched into the data cache in the background, though never
+    more than half the data cache.
+*/
+#ifndef FS_CD_READAHEAD_MAX
+#define FS_CD_READAHEAD_MAX     64
+#endif
+
+/** \brief  Size of the bounce buffer for reads into unaligned memory.
+
+    Whole sectors read into a buffer that isn't 32-byte aligned are read by
+    DMA into this buffer, up to this many bytes per drive command, and
+    copied out; it's allocated the first time it's needed. 0 turns this
+    off, leaving such reads to the data cache. It's also the largest
+    command the elevator merges queued reads into.
+*/
+#ifndef FS_CD_BOUNCE_SIZE
+#define FS_CD_BOUNCE_SIZE       (16 * 2048)
+#endif
+
+/** \brief  Largest drive command of a batch load, in bytes.
+
+    fs_iso9660_load_batch() and FS_CD_IOCTL_PREADV read files or ranges
+    that share a command through a buffer of this size they allocate for
+    the purpose, and copy them out.
+*/
+#ifndef FS_CD_BATCH_SIZE
+#define FS_CD_BATCH_SIZE        (32 * 2048)
+#endif
+
+/** \brief  Largest drive command of FS_CD_IOCTL_XA_READ, in sectors.
+
+    Whole 2352-byte sectors go through a buffer of this many the ioctl
+    allocates for the purpose, and their data is copied out.
+*/
+#ifndef FS_CD_XA_SECTORS
+#define FS_CD_XA_SECTORS        16
+#endif
+
+/** \brief  Widest gap between files a batch load reads across, in sectors.
+
+    Reading a few unwanted sectors is quicker than a new command and a seek
+    to skip them.
+*/
+#ifndef FS_CD_BATCH_GAP
+#define FS_CD_BATCH_GAP         16
+#endif
+
+/** \brief  Plain least-recently-used cache replacement. */
+#define FS_CD_POLICY_LRU        0
+
+/** \brief  2Q cache replacement.
+
+    Data read once, such as a movie or music file streaming through, is
+    kept on a short FIFO and can't push out data that's read again and
+    again, such as small assets and the sectors around them.
+*/
+#define FS_CD_POLICY_2Q         1
+
+/** \brief  Default data cache replacement policy. */
+#ifndef FS_CD_DCACHE_POLICY
+#define FS_CD_DCACHE_POLICY     FS_CD_POLICY_2Q
+#endif
+
+/** \brief  Serve drive reads first come first served. */
+#define FS_CD_SCHED_FIFO        0
+
+/** \brief  Serve drive reads in elevator order.
+
+    Reads queued by several threads go to the drive in order of sector,
+    sweeping up the disc from wherever the last one stopped, and reads that
+    overlap or touch are merged into one command of up to
+    FS_CD_BOUNCE_SIZE bytes.
+*/
+#define FS_CD_SCHED_ELEVATOR    1
+
+/** \brief  Default drive read scheduling. */
+#ifndef FS_CD_SCHED
+#define FS_CD_SCHED             FS_CD_SCHED_ELEVATOR
+#endif
+
+/** \brief  Most reads the elevator lets go ahead of a queued one.
+
+    Once that many have, it's served next wherever it is on the disc.
+*/
+#ifndef FS_CD_SCHED_MAX_BYPASS
+#define FS_CD_SCHED_MAX_BYPASS  8
+#endif
+
+/** \brief  fs_ioctl() command to pin file data in the cache.
+
+    Takes a pointer to a fs_iso9660_pin_t. Instead of copying file data out
+    like fs_read() does, this hands back a read-only pointer to it inside
+    the data cache, where it stays put until released with
+    fs_iso9660_unpin():
+
+    \code
+    fs_iso9660_pin_t pin = { NULL, 0 };
+
+    if(!fs_ioctl(fd, FS_CD_IOCTL_PIN, &pin) && pin.len) {
+        parse_header(pin.data, pin.len);
+        fs_iso9660_unpin(pin.data);
+    }
+    \endcode
+
+    At most the rest of the cache line holding the file position is pinned
+    (see fs_iso9660_set_cache_cluster()), or less if len asks for less. The
+    file position moves past it as if it had been read; at the end of the
+    file, data is NULL and len 0. Pinned data isn't evicted, so hold on to
+    as little as possible for as short as possible: the last line of the
+    cache can't be pinned (errno ENOBUFS). Fails with errno EIO on a read
+    error and EISDIR on a directory.
+*/
+#define FS_CD_IOCTL_PIN         0x43440001
+
+/** \brief  Data pinned by FS_CD_IOCTL_PIN. */
+typedef struct fs_iso9660_pin {
+    const void  *data;          /**< \brief Pinned file data */
+    size_t      len;            /**< \brief Bytes wanted (0 for as many
+                                     as possible); bytes pinned on return */
+} fs_iso9660_pin_t;
+
+/** \brief  Release data pinned by FS_CD_IOCTL_PIN.
+
+    The data can still be released after its file has been closed, or the
+    disc changed; it must not be touched afterwards.
+
+    \param  data            The data pointer FS_CD_IOCTL_PIN returned.
+    \retval 0               On success.
+    \retval -1              If data isn't pinned (errno EINVAL).
+*/
+int fs_iso9660_unpin(const void *data);
+
+/** \brief  fs_ioctl() command to read a file asynchronously.
+
+    Takes a pointer to a fs_iso9660_aio_t, whose path is ignored, and
+    queues a read from the file into it; see fs_iso9660_aio_submit(). Reads
+    queued on a handle are carried out in order, and move its position
+    just like fs_seek() and fs_read() would. Until they're all done,
+    fs_poll() doesn't report the handle readable (POLLIN). Don't close the
+    handle before then.
+*/
+#define FS_CD_IOCTL_AIO_READ    0x43440002
+
+struct fs_iso9660_aio;
+
+/** \brief  Completion callback for an asynchronous read.
+
+    Called from the driver's asynchronous read thread, once the read is
+    over and before done is set. Keep it short: other requests wait for it.
+*/
+typedef void (*fs_iso9660_aio_cb_t)(struct fs_iso9660_aio *req);
+
+/** \brief  An asynchronous read request.
+
+    Set up the fields up to sem and hand the request to
+    fs_iso9660_aio_submit() or FS_CD_IOCTL_AIO_READ. It must stay put
+    until done is set. When the read is over, the driver calls callback,
+    sets done, and signals sem, whichever of them are given.
+*/
+typedef struct fs_iso9660_aio {
+    const char  *path;          /**< \brief File to read, as a path under
+                                     /cd (fs_iso9660_aio_submit()) */
+    off_t       offset;         /**< \brief Offset to read from, or -1 for
+                                     the handle's position */
+    void        *buf;           /**< \brief Where to read to */
+    size_t      bytes;          /**< \brief How much to read */
+    fs_iso9660_aio_cb_t callback;   /**< \brief Called on completion */
+    void        *data;          /**< \brief For the callback's use */
+    semaphore_t *sem;           /**< \brief Signalled on completion */
+
+    volatile int done;          /**< \brief Set once the read is over */
+    ssize_t     rv;             /**< \brief What fs_read() would return */
+    int         err;            /**< \brief errno if rv is -1 */
+
+    /* \cond */
+    file_t      fd;
+    struct fs_iso9660_aio *next;
+    /* \endcond */
+} fs_iso9660_aio_t;
+
+/** \brief  Queue an asynchronous read of a file by name.
+
+    The file is opened, read from offset (or the start, for -1) and closed
+    again by the driver's asynchronous read thread, while the caller gets
+    on with something else. Requests are carried out in the order they're
+    queued. A file that can't be found ends the request with rv -1 and err
+    ENOENT.
+
+    The thread reads with the same blocking calls as fs_read(), one request
+    at a time; this doesn't go through cdrom_submit_cmd(). Only one
+    asynchronous read is at the drive at once, a long one holds up those
+    queued after it (so does a slow callback), and queued requests aren't
+    merged or sorted into disc order. For a set of files known up front,
+    fs_iso9660_load_batch() does that.
+
+    \code
+    static fs_iso9660_aio_t req;
+
+    req.path = "/data/level1.bin";     // /cd/data/level1.bin
+    req.offset = 0;
+    req.buf = level_buf;
+    req.bytes = level_size;
+    req.callback = NULL;
+    req.sem = NULL;
+    fs_iso9660_aio_submit(&req);
+
+    while(!fs_iso9660_aio_poll(&req))
+        draw_loading_screen();
+    \endcode
+
+    \param  req             The request.
+    \retval 0               On success.
+    \retval -1              If path is NULL (errno EINVAL), or the driver
+                            is shutting down (errno ENODEV).
+*/
+int fs_iso9660_aio_submit(fs_iso9660_aio_t *req);
+
+/** \brief  Check whether an asynchronous read is over.
+
+    \param  req             The request.
+    \return                 Nonzero once it's done.
+*/
+int fs_iso9660_aio_poll(fs_iso9660_aio_t *req);
+
+/** \brief  Wait for an asynchronous read to be over.
+
+    \param  req             The request.
+    \return                 The request's rv, with errno set from err if
+                            that's -1.
+*/
+ssize_t fs_iso9660_aio_wait(fs_iso9660_aio_t *req);
+
+/** \brief  Load a whole file into memory.
+
+    The quickest way to get a file from the disc into RAM: the buffer is
+    allocated 32-byte aligned and rounded up to whole sectors, and every
+    sector, the last one too, is read into it by DMA in one command.
+
+    \param  path            The file, as a path under /cd.
+    \param  out             Set to the buffer, to be released with free().
+    \return                 The size of the file, or -1 on failure (errno
+                            ENOENT if it isn't there, ENOMEM or EIO).
+*/
+ssize_t fs_iso9660_load(const char *path, void **out);
+
+/** \brief  One file of a batch load. */
+typedef struct fs_iso9660_batch {
+    const char  *path;          /**< \brief File to load, as a path under
+                                     /cd */
+    void        *buf;           /**< \brief Where to load it, or NULL to
+                                     have a buffer allocated */
+    size_t      bytes;          /**< \brief Room at buf; bytes loaded on
+                                     return */
+    int         err;            /**< \brief errno if the file couldn't be
+                                     loaded, otherwise 0 */
+} fs_iso9660_batch_t;
+
+/** \brief  Progress callback for a batch load.
+
+    Called in the loading thread after every drive command.
+
+    \param  done            Bytes loaded so far.
+    \param  total           Bytes to load in all.
+    \param  data            The data passed to fs_iso9660_load_batch().
+*/
+typedef void (*fs_iso9660_batch_cb_t)(size_t done, size_t total, void *data);
+
+/** \brief  Load a list of files in the order they're on the disc.
+
+    Every path is looked up before anything is read. The files are then
+    read in order of sector, so the head only ever moves one way, in as
+    few drive commands as possible: files closer together than
+    FS_CD_BATCH_GAP sectors share commands of up to FS_CD_BATCH_SIZE bytes,
+    reading across whatever is between them, and whole sectors of a large
+    file go straight into a 32-byte aligned buffer by DMA. No file handles
+    are used.
+
+    A file with a buf gets at most bytes of it loaded; one without gets a
+    32-byte aligned buffer of its size from memalign(), to be released
+    with free(). Either way bytes is what was loaded. A file that couldn't
+    be loaded has err set and bytes 0, and a buffer allocated for it is
+    freed and buf set back to NULL; the rest are loaded all the same.
+
+    \code
+    fs_iso9660_batch_t level[] = {
+        { "/data/level1.map", NULL, 0, 0 },
+        { "/data/level1.tex", tex_buf, sizeof(tex_buf), 0 },
+    };
+
+    fs_iso9660_load_batch(level, 2, draw_progress_bar, NULL);
+    \endcode
+
+    \param  files           The files to load.
+    \param  cnt             How many there are.
+    \param  callback        Called as loading goes along, or NULL.
+    \param  data            For the callback's use.
+    \retval 0               If every file was loaded.
+    \retval -1              If any wasn't, with errno the first one's err.
+*/
+int fs_iso9660_load_batch(fs_iso9660_batch_t *files, int cnt,
+                          fs_iso9660_batch_cb_t callback, void *data);
+
+/** \brief  A stream keeping a ring buffer filled from a file.
+
+    See fs_iso9660_stream_open().
+*/
+typedef struct fs_iso9660_stream fs_iso9660_stream_t;
+
+/** \brief  Where a stream is at, from fs_iso9660_stream_get_stats(). */
+typedef struct fs_iso9660_stream_stats {
+    size_t      level;          /**< \brief Bytes in the ring to consume */
+    size_t      produce;        /**< \brief Ring offset the next refill
+                                     goes to */
+    size_t      consume;        /**< \brief Ring offset of the next byte to
+                                     consume */
+    uint32      underruns;      /**< \brief Times the ring was found empty
+                                     before the end */
+    uint32      refills;        /**< \brief Drive reads made for it */
+    int         eof;            /**< \brief Everything's been consumed and
+                                     there's no more to come */
+    int         err;            /**< \brief errno if a refill failed,
+                                     which stops the stream */
+} fs_iso9660_stream_stats_t;
+
+/** \brief  Start streaming a file into a ring buffer.
+
+    For players that would otherwise stall on fs_read() every time they
+    need more: the driver's stream thread fills the ring from the start of
+    the file, and from then on tops it up whenever there's no more than
+    low_water bytes left in it, until it's full again. Refills below the
+    mark go to the drive ahead of other reads. The player takes data out
+    of the ring in place with fs_iso9660_stream_peek() and
+    fs_iso9660_stream_consume().
+
+    Give a ring that's 32-byte aligned and a multiple of 2048 bytes in
+    size, and refills are read by DMA straight into it; otherwise they go
+    through a staging buffer and get copied. No file handle is used.
+
+    \param  path            The file, as a path under /cd.
+    \param  ring            The ring buffer; it must stay put until the
+                            stream is closed.
+    \param  size            Its size in bytes.
+    \param  low_water       Level at which refilling starts, less than size.
+    \return                 The stream, or NULL (errno ENOENT, EINVAL or
+                            ENOMEM).
+*/
+fs_iso9660_stream_t *fs_iso9660_stream_open(const char *path, void *ring,
+                                            size_t size, size_t low_water);
+
+/** \brief  Stop a stream and free it. The ring is the caller's again.
+
+    \param  s               The stream.
+    \retval 0               Always.
+*/
+int fs_iso9660_stream_close(fs_iso9660_stream_t *s);
+
+/** \brief  Look at the data at a stream's consume pointer.
+
+    Never waits. Finding the ring empty before the end counts as an
+    underrun, once until it's refilled.
+
+    \param  s               The stream.
+    \param  data            Set to the consume pointer.
+    \return                 Bytes readable there, up to where the ring
+                            wraps; take the rest with another peek after
+                            consuming these.
+*/
+size_t fs_iso9660_stream_peek(fs_iso9660_stream_t *s, const void **data);
+
+/** \brief  Move a stream's consume pointer on, freeing ring space.
+
+    \param  s               The stream.
+    \param  bytes           Bytes done with, no more than the level.
+*/
+void fs_iso9660_stream_consume(fs_iso9660_stream_t *s, size_t bytes);
+
+/** \brief  Wait until a stream has data in its ring.
+
+    For prebuffering, or catching up after an underrun: starts a refill if
+    none is going, and waits for at least bytes (at most the ring size) to
+    be there, or the end of the file, or an error.
+
+    \param  s               The stream.
+    \param  bytes           Bytes wanted.
+    \return                 The level.
+*/
+size_t fs_iso9660_stream_wait(fs_iso9660_stream_t *s, size_t bytes);
+
+/** \brief  Loop a stream.
+
+    Once refills reach end they carry on from start, straight after in the
+    ring, so playback loops without a seek or a gap. Set it before the
+    refills get there; data already in the ring stays.
+
+    \param  s               The stream.
+    \param  start           Offset to loop back to, or -1 to stop looping
+                            and carry on to the end of the file.
+    \param  end             Offset to loop at, or 0 for the end of the
+                            file.
+    \retval 0               On success.
+    \retval -1              If start isn't before end (errno EINVAL).
+*/
+int fs_iso9660_stream_loop(fs_iso9660_stream_t *s, off_t start, off_t end);
+
+/** \brief  Get a stream's pointers, level and counters.
+
+    \param  s               The stream.
+    \param  stats           Filled in.
+*/
+void fs_iso9660_stream_get_stats(fs_iso9660_stream_t *s,
+                                 fs_iso9660_stream_stats_t *stats);
+
+/** \brief  How long the drive is left idle before CDDA plays on, in ms.
+
+    See fs_iso9660_cdda_play(). Reads that follow on within this long share
+    one break in the music.
+*/
+#ifndef FS_CD_CDDA_LINGER
+#define FS_CD_CDDA_LINGER       4
+#endif
+
+/** \brief  Play CD audio and keep it playing around /cd reads.
+
+    Like cdrom_cdda_play() with CDDA_SECTORS, except that reads from /cd
+    don't end the music. The first read to need the drive breaks into it,
+    after noting where it had got to from the Q subcode; once no read has
+    needed the drive for FS_CD_CDDA_LINGER ms, the driver plays on from
+    there. Meanwhile read-ahead waits for the next break rather than make
+    one of its own, unless a reader is waiting for the data, so a player
+    or loader reading through a file breaks the music once per read-ahead
+    window rather than once per cache line. Reserved handles
+    (FS_CD_IOCTL_RESERVE) still get their refills straight away.
+
+    After a break the range plays to its end and, if repeat isn't 0,
+    starts over with the same repeat count. Don't call cdrom_cdda_play()
+    or cdrom_cdda_pause() directly while this is in effect.
+
+    \param  start           First FAD to play (e.g. a track's TOC_LBA).
+    \param  end             FAD to stop at.
+    \param  repeat          Times to repeat, up to 15 for ever.
+    \retval 0               On success.
+    \retval -1              On error (errno EINVAL for a bad range,
+                            ENODEV with no disc, EIO if the drive refused).
+*/
+int fs_iso9660_cdda_play(uint32 start, uint32 end, uint32 repeat);
+
+/** \brief  Stop the music fs_iso9660_cdda_play() started.
+
+    \retval 0               On success.
+    \retval -1              If the drive refused (errno EIO).
+*/
+int fs_iso9660_cdda_stop(void);
+
+/** \brief  Set how long the drive idles before CDDA plays on.
+
+    0 plays on as soon as each read is over, and doesn't hold read-ahead
+    back, so every read is a break of its own.
+
+    \param  ms              Milliseconds, default FS_CD_CDDA_LINGER.
+    \retval 0               On success.
+    \retval -1              If ms is negative (errno EINVAL).
+*/
+int fs_iso9660_set_cdda_linger(int ms);
+
+/** \brief  fs_ioctl() command to reserve drive bandwidth for a handle.
+
+    Takes a pointer to a fs_iso9660_reserve_t, declaring that the handle is
+    read at rate bytes per second and must never run dry for longer than
+    deadline_ms. From then on read-ahead keeps that much data past the
+    handle's position in the data cache, starting straight away and after
+    every seek, and whenever there's less than that its refills go to the
+    drive ahead of any other read, which waits until the margin is back.
+    Other handles' reads are cut into
+    commands short enough not to hold the drive past the deadline, and get
+    whatever bandwidth is left. A rate of 0 drops the reservation; so does
+    closing the handle.
+
+    The margin is limited like any read-ahead window: half the data cache,
+    or A1in under 2Q. Make the data cache big enough to hold it, see
+    fs_iso9660_set_cache_size().
+
+    \code
+    fs_iso9660_reserve_t rsv = { 176400, 500 };    // CD audio, half a second
+    file_t f = fs_open("/cd/music.raw", O_RDONLY);
+
+    fs_ioctl(f, FS_CD_IOCTL_RESERVE, &rsv);
+    \endcode
+*/
+#define FS_CD_IOCTL_RESERVE     0x43440003
+
+/** \brief  A bandwidth reservation for FS_CD_IOCTL_RESERVE. */
+typedef struct fs_iso9660_reserve {
+    uint32  rate;               /**< \brief Bytes per second read */
+    uint32  deadline_ms;        /**< \brief Data to keep buffered, in ms */
+} fs_iso9660_reserve_t;
+
+/** \brief  fs_ioctl() command to read a handle's reservation counters.
+
+    Takes a pointer to a fs_iso9660_reserve_stats_t. The counters start at
+    0 when the handle is opened.
+*/
+#define FS_CD_IOCTL_RESERVE_STATS   0x43440004
+
+/** \brief  Counters for a handle with a reservation. */
+typedef struct fs_iso9660_reserve_stats {
+    uint32  underruns;          /**< \brief Reads that had to wait for the
+                                     drive */
+    uint32  refills;            /**< \brief Read-ahead fills sent ahead of
+                                     other reads */
+    uint32  level_ms;           /**< \brief Data past the position that's
+                                     cached or on its way, in ms */
+} fs_iso9660_reserve_stats_t;
+
+/** \brief  fs_ioctl() command to read from a file at a given offset.
+
+    Takes a pointer to a fs_iso9660_pread_t and reads into it like
+    FS_CD_IOCTL_PREADV does with a vector of one.
+*/
+#define FS_CD_IOCTL_PREAD       0x43440005
+
+/** \brief  fs_ioctl() command to read several ranges of a file at once.
+
+    Takes a pointer to an array of fs_iso9660_pread_t and the number of
+    them, and reads each range into its buffer, setting its bytes to how
+    much was read (short at the end of the file). Neither the handle's
+    position nor its read-ahead is touched, so any number of threads can
+    do this on one handle at the same time as each other and fs_read().
+
+    Ranges already in the data cache are copied out of it. The rest go to
+    the drive in one sweep, sorted by offset and read like a batch load
+    (see fs_iso9660_load_batch()): ranges in neighbouring sectors share a
+    command, whatever order they're given in.
+
+    \code
+    fs_iso9660_pread_t toc[3] = {
+        { 0, &header, sizeof(header) },
+        { dir_off, dir, dir_len },
+        { names_off, names, names_len },
+    };
+
+    fs_ioctl(f, FS_CD_IOCTL_PREADV, toc, 3);
+    \endcode
+
+    \retval 0               On success.
+    \retval -1              If any range couldn't be read (errno EIO), or
+                            has a negative offset (errno EINVAL).
+*/
+#define FS_CD_IOCTL_PREADV      0x43440006
+
+/** \brief  A range to read for FS_CD_IOCTL_PREAD or FS_CD_IOCTL_PREADV. */
+typedef struct fs_iso9660_pread {
+    off_t       offset;         /**< \brief Offset in the file */
+    void        *buf;           /**< \brief Where to read to */
+    size_t      bytes;          /**< \brief Bytes wanted; bytes read on
+                                     return */
+} fs_iso9660_pread_t;
+
+/** \brief  fs_ioctl() command to release a file's fs_mmap() copy.
+
+    fs_mmap() on a /cd file loads all of it into a 32-byte aligned buffer
+    the first time, and returns the same buffer until this is done or the
+    file is closed, either of which frees it. Takes no argument.
+*/
+#define FS_CD_IOCTL_MUNMAP      0x43440007
+
+/** \brief  fs_ioctl() command to read and demultiplex an XA file.
+
+    Takes a pointer to a fs_iso9660_xa_read_t. Interleaved Mode 2 files,
+    such as FMV with its audio, hold sectors of several channels, each
+    carrying 2048 bytes of data (Form 1) or 2324 (Form 2, with no error
+    correction), which fs_read() can't get at. This reads up to sectors of
+    them from the handle's position, FS_CD_XA_SECTORS to a drive command,
+    with the drive switched to whole sectors for them and back afterwards,
+    and appends each sector's data to the buffer of the first channel in
+    chan it matches by subheader. Sectors that match none are skipped.
+
+    The position is a sector number times 2048, as fs_seek() and fs_tell()
+    see it. The read stops after a sector marked as the end of the file
+    (FS_CD_XA_EOF) if it is of the file asked for or matches a channel, as
+    the ends of other files interleaved with it don't count, and before one
+    whose channel has no room left, so a player can empty that buffer and
+    carry on from there.
+
+    \code
+    fs_iso9660_xa_chan_t ch[2] = {
+        { 1, FS_CD_XA_VIDEO, video, sizeof(video), 0 },
+        { 1, FS_CD_XA_AUDIO, audio, sizeof(audio), 0 },
+    };
+    fs_iso9660_xa_read_t xa = { 32, -1, ch, 2, 0, 0 };
+
+    fs_ioctl(f, FS_CD_IOCTL_XA_READ, &xa);
+    \endcode
+
+    \retval 0               On success.
+    \retval -1              On error (errno EIO if the drive failed,
+                            ENOMEM, or EINVAL for an audio track).
+*/
+#define FS_CD_IOCTL_XA_READ     0x43440008
+
+/** \brief  XA subheader submode bit: end of a record. */
+#define FS_CD_XA_EOR            0x01
+
+/** \brief  XA subheader submode bit: video sector. */
+#define FS_CD_XA_VIDEO          0x02
+
+/** \brief  XA subheader submode bit: ADPCM audio sector. */
+#define FS_CD_XA_AUDIO          0x04
+
+/** \brief  XA subheader submode bit: data sector. */
+#define FS_CD_XA_DATA           0x08
+
+/** \brief  XA subheader submode bit: Form 2, 2324 bytes of data. */
+#define FS_CD_XA_FORM2          0x20
+
+/** \brief  XA subheader submode bit: last sector of the file. */
+#define FS_CD_XA_EOF            0x80
+
+/** \brief  Where FS_CD_IOCTL_XA_READ puts one channel's data. */
+typedef struct fs_iso9660_xa_chan {
+    uint8       channel;        /**< \brief Channel number from the
+                                     subheader */
+    uint8       submode;        /**< \brief Submode bits, any of which a
+                                     sector needs to go here; 0 for all */
+    void        *buf;           /**< \brief Where its data goes */
+    size_t      size;           /**< \brief Room in buf */
+    size_t      len;            /**< \brief Bytes in buf; data is added
+                                     after them */
+} fs_iso9660_xa_chan_t;
+
+/** \brief  A read for FS_CD_IOCTL_XA_READ. */
+typedef struct fs_iso9660_xa_read {
+    uint32      sectors;        /**< \brief Sectors to read; sectors gone
+                                     through on return */
+    int         file;           /**< \brief File number from the subheader
+                                     to take, or -1 for any */
+    fs_iso9660_xa_chan_t *chan; /**< \brief The channels */
+    int         nchan;          /**< \brief How many */
+    uint32      skipped;        /**< \brief Sectors no channel took */
+    int         eof;            /**< \brief The end of the file was read */
+} fs_iso9660_xa_read_t;
+
+/** \brief  Pick the /cd cache sizes used from startup.
+
+    Use this once in your program, next to KOS_INIT_FLAGS(), to have
+    fs_iso9660_init() size its caches for you instead of starting with the
+    FS_CD_ICACHE_SIZE and FS_CD_DCACHE_SIZE defaults:
+
+    \code
+    KOS_INIT_ISO9660_CACHE(8 * 2048, 1024 * 1024);
+    \endcode
+
+    \param  icache_bytes    Inode (directory) cache size in bytes.
+    \param  dcache_bytes    Data cache size in bytes.
+*/
+#define KOS_INIT_ISO9660_CACHE(icache_bytes, dcache_bytes) \
+    const size_t __kos_iso9660_cache[2] = { (icache_bytes), (dcache_bytes) }
+
+/** \brief  Reset the internal ISO9660 cache.
+
+    This function resets the cache of the ISO9660 driver, breaking all open
+    file descriptors and forcing the disc to be looked at again the next
+    time anything is opened.
+
+    \return                 0 on success.
+*/
+int iso_reset(void);
+
+/** \brief  Resize the ISO9660 block caches.
+
+    The inode cache holds directory sectors, the data cache holds file
+    data. Each size is rounded down to whole cache lines (see
+    fs_iso9660_set_cache_cluster()), with a floor of two lines. Both caches
+    live in a single 32-byte aligned allocation, which is replaced by this
+    call; anything cached before is dropped. Don't call this while other
+    threads are reading from /cd.
+
+    \param  icache_bytes    New inode cache size in bytes.
+    \param  dcache_bytes    New data cache size in bytes.
+    \retval 0               On success.
+    \retval -1              On failure (errno ENOMEM, or EBUSY while any
+                            data is pinned); the old caches are left in
+                            place.
+*/
+int fs_iso9660_set_cache_size(size_t icache_bytes, size_t dcache_bytes);
+
+/** \brief  Change the ISO9660 cache line sizes.
+
+    Larger lines turn runs of small reads into fewer, longer drive commands,
+    at the cost of fewer lines fitting in the same number of bytes. The
+    cache sizes in bytes are kept; everything cached before is dropped.
+    Don't call this while other threads are reading from /cd.
+
+    A data cache line holds half as many audio track sectors (see
+    trackNN.pcm above), so those can't be read with lines of 1 sector.
+
+    \param  icache_sectors  Inode cache line size in sectors.
+    \param  dcache_sectors  Data cache line size in sectors.
+    \retval 0               On success.
+    \retval -1              On failure (errno EINVAL if a size is not a
+                            power of two from 1 to 64, ENOMEM if the caches
+                            could not be reallocated, EBUSY while any data
+                            is pinned).
+*/
+int fs_iso9660_set_cache_cluster(int icache_sectors, int dcache_sectors);
+
+/** \brief  Choose how the ISO9660 caches are filled.
+
+    Cache misses are read by DMA by default, which leaves the CPU free for
+    other threads while the sectors come in. PIO has the CPU copy every
+    byte off the G1 bus instead, which may be wanted when something else
+    is using G1 DMA.
+
+    \param  mode            CDROM_READ_DMA or CDROM_READ_PIO.
+    \retval 0               On success.
+    \retval -1              On an unknown mode (errno EINVAL).
+*/
+int fs_iso9660_set_fill_mode(int mode);
+
+/** \brief  Set the ISO9660 read-ahead limit.
+
+    A file handle whose reads each pick up where the last one stopped is
+    treated as a stream: a background thread fetches a window of sectors
+    past its position into the data cache, so its next reads don't wait on
+    the drive. The window starts at one cache line and doubles with every
+    sequential read up to this limit (and half the data cache); a seek
+    drops it again. Streaming code will usually want a data cache several
+    times larger than its reads, see fs_iso9660_set_cache_size().
+
+    \param  max_sectors     Largest window in sectors, or 0 to turn
+                            read-ahead off.
+    \retval 0               On success.
+    \retval -1              If max_sectors is negative (errno EINVAL).
+*/
+int fs_iso9660_set_readahead(int max_sectors);
+
+/** \brief  Choose the ISO9660 data cache replacement policy.
+
+    Everything in the data cache is dropped. The inode cache always uses
+    LRU. Don't call this while other threads are reading from /cd.
+
+    \param  policy          FS_CD_POLICY_LRU or FS_CD_POLICY_2Q.
+    \retval 0               On success.
+    \retval -1              On an unknown policy (errno EINVAL).
+*/
+int fs_iso9660_set_cache_policy(int policy);
+
+/** \brief  Choose how queued drive reads are ordered.
+
+    \param  sched           FS_CD_SCHED_FIFO or FS_CD_SCHED_ELEVATOR.
+    \retval 0               On success.
+    \retval -1              On an unknown mode (errno EINVAL).
+*/
+int fs_iso9660_set_sched(int sched);
+
+/** \brief  ISO9660 cache counters, since fs_iso9660_init().
+
+    Lookups count per sector: reading 4KB through the cache is two lookups.
+    Reads that skip the cache entirely aren't counted.
+*/
+typedef struct fs_iso9660_cache_stats {
+    uint32  ihits, imisses;     /**< \brief Inode cache lookups */
+    uint32  dhits, dmisses;     /**< \brief Data cache lookups */
+    uint32  dprefetched;        /**< \brief Data cache lines read ahead */
+} fs_iso9660_cache_stats_t;
+
+/** \brief  Retrieve the ISO9660 cache counters.
+
+    \param  stats           Where to store the counters.
+*/
+void fs_iso9660_get_cache_stats(fs_iso9660_cache_stats_t *stats);
+
+/** \brief  Retrieve the current ISO9660 cache sizes.
+
+    \param  icache_bytes    Inode cache size in bytes (may be NULL).
+    \param  dcache_bytes    Data cache size in bytes (may be NULL).
+*/
+void fs_iso9660_get_cache_size(size_t *icache_bytes, size_t *dcache_bytes);
+
+/* \cond */
+int fs_iso9660_init(void);
+int fs_iso9660_shutdown(void);
+/* \endcond */
+
+__END_DECLS
+
+#endif  /* __DC_FS_ISO9660_H */
@@ -0,0 +1,1681 @@
+/* KallistiOS host shim
+
+   bench_iso.c
+
+   Benchmarks for the /cd VFS handler. Each workload drives the driver
+   through its vfs_handler_t, starting from cold caches, and reports:
+
+     MB/s       payload bytes over simulated drive time
+     p50/p99    per-call latency on the simulated clock
+     cmds       GD commands issued
+     sectors    sectors transferred by the drive
+     seeks      reads that had to move the head
+     seek ksec  how far it moved in all, in thousands of sectors
+     hit%       data cache lookups that hit
+     cpu        SH4 time spent issuing reads and moving their data (PIO
+                copies or DMA cache invalidation), per the drive model
+     wall       host time, for the cost of the driver's own code
+
+   Workloads:
+
+     stream     read the largest file front to back in -b sized chunks
+     playback   read the largest file front to back in 16KB chunks,
+                spending -T microseconds on each one as a player would;
+                run it with a realtime model (-m gdrom,realtime=0.05) so
+                read-ahead can overlap the think time
+     random     -n random 4KB reads from the largest file
+     small      -n small asset loads (open, read up to 32KB, close) cycling
+                through every file on the disc
+     deep       -n opens of the most deeply nested file
+     readdir    -n walks of the whole directory tree
+     threads    -t threads doing -n random 4KB reads each, on their own
+                handles to the largest file
+     loaders    -t threads each streaming through their own slice of the
+                largest file in 16KB reads, so the drive has one stream
+                per thread to serve at different places on the disc. Run
+                it with a realtime model so their reads queue up
+     hitmiss    one thread doing random 4KB reads of the largest file,
+                which mostly miss, while -t - 1 threads do -n opens each
+                of the most deeply nested file a millisecond apart, which
+                hit in the inode cache; only the opens are reported. Run
+                it with a realtime model so the misses take time the
+                opens could wait on
+     contend    one thread streaming through the largest file in -b sized
+                reads while -t - 1 threads do -n 4KB reads each of the
+                first 16KB of the second largest file a millisecond
+                apart, which stay cached;
+                only the cached reads are reported. Also wants a realtime
+                model
+     parse      -n passes over the largest file, reading it 512 bytes at
+                a time and summing each record, as a parser would
+     pin        the same, parsing the data in place in the cache through
+                FS_CD_IOCTL_PIN instead of copying it out
+     frames     -n frames of a game loop that each spend a millisecond on
+                their own work and load a random 4KB chunk of the
+                largest file with fs_read; reports frame times. Wants a
+                realtime model
+     aio        the same, but each load is queued with
+                FS_CD_IOCTL_AIO_READ and the loop only checks for it
+                every frame, queueing the next once it's done
+     ring       the same playback out of a fs_iso9660_stream_open() ring of
+                128KB, refilled from half empty; also reports the chunks
+                that took longer than one plays for (late) and the
+                stream's underruns and refills
+     bulkplay   playback of the largest file, with -T microseconds per
+                16KB chunk, while another thread loads the second largest
+                in -b sized reads over and over; also reports the reads
+                that took longer than a chunk plays for (late) and the
+                loader's throughput. Wants a realtime model
+     reserve    the same, with the player holding a FS_CD_IOCTL_RESERVE
+                reservation for its rate and two chunks of deadline; also
+                reports its underrun and urgent refill counters
+     gather     -n rounds of 16 reads of 256 bytes at random offsets in the
+                largest file, each with a seek and a read
+     preadv     the same, each round in one FS_CD_IOCTL_PREADV
+     level      every file on the disc loaded whole, one after the other
+                with open, read and close, in the order they were found,
+                into buffers -u bytes off alignment
+     mmap       the same, each file loaded whole through the handler's
+                mmap
+     batch      the same files in one fs_iso9660_load_batch() call; one
+                sample per drive command
+     cdda       playback with the disc's first audio track playing through
+                fs_iso9660_cdda_play(), and a linger of 0 so every read
+                breaks into the music; also reports the gaps in it, per MB
+                read, and the silence they added up to. Wants a realtime
+                model
+     cddabatch  the same with the default FS_CD_CDDA_LINGER, so reads that
+                follow on share a gap
+     mixed      -n steps of a random 4KB read from a working set of -H
+                regions of the second largest file, each in its own 16KB
+                cluster, and an 8KB read streaming on through the largest
+                file; all through an unaligned buffer, as fread would, so
+                every byte goes through the data cache
+     xa         the largest file demultiplexed with FS_CD_IOCTL_XA_READ,
+                taking XA file 1's video and audio on channel 1 until that
+                file ends; also reports the sectors gone through and
+                skipped, whether its end was seen, and the bytes of each
+                channel. The image "xa:" is a small disc built for it
+                whose /MOVIE.XA interleaves a second file that ends first
+
+   -c sets the inode and data cache sizes (bytes, k and m suffixes work),
+   -k their line sizes in sectors, -p whether misses are filled by dma (the
+   default) or pio, -a the read-ahead limit in sectors (0 turns it off),
+   -P the data cache replacement policy (lru or 2q), -S the order queued
+   drive reads are served in (fifo or elevator), -u an offset to put the
+   stream buffer off its 32-byte alignment by, as malloc would. -f picks
+   the file the streaming workloads use instead of the largest; audio
+   tracks (/trackNN.pcm) are left out of the survey unless it names one.
+
+   usage: bench_iso [-m MODEL] [-c ICACHE,DCACHE] [-k ILINE,DLINE]
+                    [-p dma|pio] [-a SECTORS] [-P lru|2q]
+                    [-S fifo|elevator] [-u BYTES] [-w a,b,...]
+                    [-n N] [-t T] [-b BYTES] [-T US] [-H N] [-s SEED]
+                    [-f FILE] IMAGE
+
+*/
+
+#include "harness.h"
+#include "drive_model.h"
+
+#include <dc/fs_iso9660.h>
+#include <dc/cdrom.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_FILES   4096
+#define SMALL_MAX   32768
+#define PLAY_CHUNK  16384
+
+static vfs_handler_t *vh;
+
+static struct {
+    char    path[256];
+    int     size;
+    int     depth;
+} files[MAX_FILES];
+static int nfiles, largest, deepest;
+
+static int opt_n = 1000, opt_threads = 4, opt_chunk = 65536;
+static int opt_think = 40000, opt_hot = 12, opt_unalign;
+static unsigned opt_seed = 1;
+static const char *opt_file;
+
+/********************************************************************************/
+/* Measurement */
+
+typedef struct {
+    uint64  *lat;           /* Per-call simulated latency (ns) */
+    int     ncalls, max;
+    uint64  bytes;
+} sample_t;
+
+static void sample_init(sample_t *s, int max) {
+    s->lat = malloc(sizeof(uint64) * max);
+    s->ncalls = 0;
+    s->max = max;
+    s->bytes = 0;
+}
+
+static void sample_add(sample_t *s, uint64 ns, size_t bytes) {
+    if(s->ncalls < s->max)
+        s->lat[s->ncalls++] = ns;
+
+    s->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64 x = *(const uint64 *)a, y = *(const uint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64 wall_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64 t_sim, t_wall;
+static fs_iso9660_cache_stats_t cs0;
+
+static void bench_begin(void) {
+    /* Every workload starts on a freshly mounted disc with cold caches */
+    iso_reset();
+    drive_model_reset_stats();
+    fs_iso9660_get_cache_stats(&cs0);
+    t_sim = drive_model_now();
+    t_wall = wall_ns();
+}
+
+static void bench_end(const char *name, sample_t *s) {
+    uint64 sim = drive_model_now() - t_sim, wall = wall_ns() - t_wall;
+    uint64 p50 = 0, p99 = 0;
+    fs_iso9660_cache_stats_t cs;
+    uint32 hits, lookups;
+    drive_stats_t ds;
+
+    drive_model_stats(&ds);
+    fs_iso9660_get_cache_stats(&cs);
+    hits = cs.dhits - cs0.dhits;
+    lookups = hits + cs.dmisses - cs0.dmisses;
+
+    if(s->ncalls) {
+        qsort(s->lat, s->ncalls, sizeof(uint64), cmp_u64);
+        p50 = s->lat[s->ncalls / 2];
+        p99 = s->lat[(s->ncalls * 99) / 100];
+    }
+
+    printf("%-8s %7d %10llu %10.2f %8.3f %9.1f %9.1f %7llu %8llu %6llu "
+           "%9.1f %6.1f %8.2f %8.2f\n", name, s->ncalls,
+           (unsigned long long)s->bytes,
+           sim / 1e6, sim ? (s->bytes / 1048576.0) / (sim / 1e9) : 0.0,
+           p50 / 1e3, p99 / 1e3, (unsigned long long)ds.reads,
+           (unsigned long long)ds.sectors, (unsigned long long)ds.seeks,
+           ds.seek_distance / 1e3, lookups ? 100.0 * hits / lookups : 0.0,
+           ds.cpu_ns / 1e6, wall / 1e6);
+
+    free(s->lat);
+}
+
+/********************************************************************************/
+/* Disc survey */
+
+static void survey(const char *dir, int depth) {
+    char path[256];
+    dirent_t *de;
+    void *h;
+
+    if(!(h = vh->open(vh, dir, O_RDONLY | O_DIR)))
+        return;
+
+    while((de = vh->readdir(h))) {
+        snprintf(path, sizeof(path), "%s%s%s", dir,
+                 dir[strlen(dir) - 1] == '/' ? "" : "/", de->name);
+
+        /* Audio tracks only take part when -f picks one */
+        if(!depth && strlen(de->name) > 4 &&
+           !strcasecmp(de->name + strlen(de->name) - 4, ".pcm") &&
+           (!opt_file || strcasecmp(path, opt_file)))
+            continue;
+
+        if(de->attr & O_DIR) {
+            survey(path, depth + 1);
+        }
+        else if(nfiles < MAX_FILES) {
+            snprintf(files[nfiles].path, sizeof(files[nfiles].path), "%s",
+                     path);
+            files[nfiles].size = de->size;
+            files[nfiles].depth = depth;
+
+            if(de->size > files[largest].size)
+                largest = nfiles;
+
+            if(depth > files[deepest].depth)
+                deepest = nfiles;
+
+            nfiles++;
+        }
+    }
+
+    vh->close(h);
+}
+
+/* The file the streaming and random workloads use */
+static int target(void) {
+    int i;
+
+    if(opt_file) {
+        for(i = 0; i < nfiles; i++)
+            if(!strcasecmp(files[i].path, opt_file))
+                return i;
+
+        fprintf(stderr, "bench_iso: %s not found, using %s\n", opt_file,
+                files[largest].path);
+    }
+
+    return largest;
+}
+
+/********************************************************************************/
+/* Workloads */
+
+static void *bench_buf(size_t size) {
+    /* Aligned like a typical game's DMA-friendly buffer */
+    return memalign(32, size);
+}
+
+static void w_stream(void) {
+    int f = target(), n = files[f].size / opt_chunk + 2;
+    uint8 *mem = bench_buf(opt_chunk + opt_unalign), *buf = mem + opt_unalign;
+    size_t left = files[f].size, want;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, n);
+    bench_begin();
+
+    if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    while(left > 0) {
+        want = left < (size_t)opt_chunk ? left : (size_t)opt_chunk;
+        t = drive_model_now();
+        got = vh->read(h, buf, want);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+
+        if(got <= 0)
+            break;
+
+        left -= got;
+    }
+
+    vh->close(h);
+out:
+    bench_end("stream", &s);
+    free(mem);
+}
+
+static void w_playback(void) {
+    int f = target(), n = files[f].size / PLAY_CHUNK + 2;
+    uint8 *buf = bench_buf(PLAY_CHUNK);
+    size_t left = files[f].size, want;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, n);
+    bench_begin();
+
+    if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    /* Stop at the file size, as w_stream does */
+    while(left > 0) {
+        want = left < PLAY_CHUNK ? left : PLAY_CHUNK;
+        t = drive_model_now();
+        got = vh->read(h, buf, want);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+
+        if(got <= 0)
+            break;
+
+        left -= got;
+
+        /* Decode and present it */
+        drive_model_advance(opt_think * 1000ULL);
+    }
+
+    vh->close(h);
+out:
+    bench_end("playback", &s);
+    free(buf);
+}
+
+static void random_reads(void *h, int size, int n, unsigned *seed,
+                         sample_t *s) {
+    static const int rd = 4096;
+    uint8 *buf = bench_buf(rd);
+    off_t off;
+    ssize_t got;
+    uint64 t;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        off = size > rd ? rand_r(seed) % (size - rd) : 0;
+        t = drive_model_now();
+        vh->seek(h, off, SEEK_SET);
+        got = vh->read(h, buf, rd);
+        sample_add(s, drive_model_now() - t, got > 0 ? got : 0);
+    }
+
+    free(buf);
+}
+
+static void w_random(void) {
+    unsigned seed = opt_seed;
+    int f = target();
+    sample_t s;
+    void *h;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    if((h = vh->open(vh, files[f].path, O_RDONLY))) {
+        random_reads(h, files[f].size, opt_n, &seed, &s);
+        vh->close(h);
+    }
+
+    bench_end("random", &s);
+}
+
+static void w_small(void) {
+    uint8 *buf = bench_buf(SMALL_MAX);
+    int i, f, want;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    for(i = 0; i < opt_n; i++) {
+        f = i % nfiles;
+        want = files[f].size < SMALL_MAX ? files[f].size : SMALL_MAX;
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+            break;
+
+        got = vh->read(h, buf, want);
+        vh->close(h);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+    }
+
+    bench_end("small", &s);
+    free(buf);
+}
+
+static void w_deep(void) {
+    sample_t s;
+    uint64 t;
+    void *h;
+    int i;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[deepest].path, O_RDONLY)))
+            break;
+
+        vh->close(h);
+        sample_add(&s, drive_model_now() - t, 0);
+    }
+
+    bench_end("deep", &s);
+}
+
+static int walk(const char *dir) {
+    char path[256];
+    dirent_t *de;
+    int n = 0;
+    void *h;
+
+    if(!(h = vh->open(vh, dir, O_RDONLY | O_DIR)))
+        return 0;
+
+    while((de = vh->readdir(h))) {
+        n++;
+
+        if(de->attr & O_DIR) {
+            snprintf(path, sizeof(path), "%s%s%s", dir,
+                     dir[strlen(dir) - 1] == '/' ? "" : "/", de->name);
+            n += walk(path);
+        }
+    }
+
+    vh->close(h);
+    return n;
+}
+
+static void w_readdir(void) {
+    sample_t s;
+    uint64 t;
+    int i;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+        walk("/");
+        sample_add(&s, drive_model_now() - t, 0);
+    }
+
+    bench_end("readdir", &s);
+}
+
+typedef struct {
+    pthread_t   thd;
+    unsigned    seed;
+    sample_t    s;
+} worker_t;
+
+static void *thread_main(void *p) {
+    worker_t *w = (worker_t *)p;
+    int f = target();
+    void *h;
+
+    if((h = vh->open(vh, files[f].path, O_RDONLY))) {
+        random_reads(h, files[f].size, opt_n, &w->seed, &w->s);
+        vh->close(h);
+    }
+
+    return NULL;
+}
+
+static void w_threads(void) {
+    worker_t *w = calloc(opt_threads, sizeof(worker_t));
+    sample_t s;
+    int i, j;
+
+    sample_init(&s, opt_n * opt_threads);
+    bench_begin();
+
+    for(i = 0; i < opt_threads; i++) {
+        w[i].seed = opt_seed + i;
+        sample_init(&w[i].s, opt_n);
+        pthread_create(&w[i].thd, NULL, thread_main, w + i);
+    }
+
+    for(i = 0; i < opt_threads; i++) {
+        pthread_join(w[i].thd, NULL);
+
+        for(j = 0; j < w[i].s.ncalls; j++)
+            sample_add(&s, w[i].s.lat[j], 0);
+
+        s.bytes += w[i].s.bytes;
+        free(w[i].s.lat);
+    }
+
+    bench_end("threads", &s);
+    free(w);
+}
+
+typedef struct {
+    worker_t    w;
+    off_t       start, end;
+} slice_t;
+
+static void *slice_main(void *p) {
+    slice_t *sl = (slice_t *)p;
+    uint8 *buf = bench_buf(PLAY_CHUNK);
+    off_t off;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    if((h = vh->open(vh, files[target()].path, O_RDONLY))) {
+        vh->seek(h, sl->start, SEEK_SET);
+
+        for(off = sl->start; off < sl->end; off += got) {
+            t = drive_model_now();
+            got = vh->read(h, buf, sl->end - off < PLAY_CHUNK ?
+                                   sl->end - off : PLAY_CHUNK);
+            sample_add(&sl->w.s, drive_model_now() - t, got > 0 ? got : 0);
+
+            if(got <= 0)
+                break;
+        }
+
+        vh->close(h);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void w_loaders(void) {
+    slice_t *sl = calloc(opt_threads, sizeof(slice_t));
+    int f = target(), n = files[f].size / PLAY_CHUNK + opt_threads + 1;
+    sample_t s;
+    int i, j;
+
+    sample_init(&s, n);
+    bench_begin();
+
+    for(i = 0; i < opt_threads; i++) {
+        sl[i].start = (off_t)files[f].size * i / opt_threads;
+        sl[i].end = (off_t)files[f].size * (i + 1) / opt_threads;
+        sample_init(&sl[i].w.s, n);
+        pthread_create(&sl[i].w.thd, NULL, slice_main, sl + i);
+    }
+
+    for(i = 0; i < opt_threads; i++) {
+        pthread_join(sl[i].w.thd, NULL);
+
+        for(j = 0; j < sl[i].w.s.ncalls; j++)
+            sample_add(&s, sl[i].w.s.lat[j], 0);
+
+        s.bytes += sl[i].w.s.bytes;
+        free(sl[i].w.s.lat);
+    }
+
+    bench_end("loaders", &s);
+    free(sl);
+}
+
+static volatile int hm_done;
+
+static void *hit_main(void *p) {
+    worker_t *w = (worker_t *)p;
+    uint64 t;
+    void *h;
+    int i;
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[deepest].path, O_RDONLY)))
+            break;
+
+        vh->close(h);
+        sample_add(&w->s, drive_model_now() - t, 0);
+
+        /* Some other work between opens */
+        drive_model_advance(1000000);
+    }
+
+    return NULL;
+}
+
+static void *miss_main(void *p) {
+    uint8 *buf = bench_buf(4096);
+    worker_t *w = (worker_t *)p;
+    int f = target(), size = files[f].size;
+    void *h;
+
+    if((h = vh->open(vh, files[f].path, O_RDONLY))) {
+        while(!hm_done) {
+            vh->seek(h, size > 4096 ? rand_r(&w->seed) % (size - 4096) : 0,
+                     SEEK_SET);
+            vh->read(h, buf, 4096);
+        }
+
+        vh->close(h);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void w_hitmiss(void) {
+    int i, j, nhit = opt_threads > 1 ? opt_threads - 1 : 1;
+    worker_t *w = calloc(nhit + 1, sizeof(worker_t));
+    sample_t s;
+    void *h;
+
+    sample_init(&s, opt_n * nhit);
+    bench_begin();
+
+    /* Get the directories into the inode cache first */
+    if((h = vh->open(vh, files[deepest].path, O_RDONLY)))
+        vh->close(h);
+
+    hm_done = 0;
+    w[nhit].seed = opt_seed;
+    pthread_create(&w[nhit].thd, NULL, miss_main, w + nhit);
+
+    for(i = 0; i < nhit; i++) {
+        sample_init(&w[i].s, opt_n);
+        pthread_create(&w[i].thd, NULL, hit_main, w + i);
+    }
+
+    for(i = 0; i < nhit; i++) {
+        pthread_join(w[i].thd, NULL);
+
+        for(j = 0; j < w[i].s.ncalls; j++)
+            sample_add(&s, w[i].s.lat[j], 0);
+
+        free(w[i].s.lat);
+    }
+
+    hm_done = 1;
+    pthread_join(w[nhit].thd, NULL);
+
+    bench_end("hitmiss", &s);
+    free(w);
+}
+
+#define RECORD 512
+
+static uint32 checksum(const uint8 *p, size_t len) {
+    uint32 sum = 0;
+
+    while(len--)
+        sum += *p++;
+
+    return sum;
+}
+
+static int bench_ioctl(void *h, int cmd, ...) {
+    va_list ap;
+    int rv;
+
+    va_start(ap, cmd);
+    rv = vh->ioctl(h, cmd, ap);
+    va_end(ap);
+
+    return rv;
+}
+
+static volatile uint32 parse_sum;
+
+static void parse(int zero) {
+    uint8 *buf = bench_buf(RECORD);
+    int i, f = target();
+    fs_iso9660_pin_t pin;
+    size_t off, len;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+            break;
+
+        for(;;) {
+            if(!zero) {
+                if((got = vh->read(h, buf, RECORD)) <= 0)
+                    break;
+
+                parse_sum += checksum(buf, got);
+                continue;
+            }
+
+            pin.len = 0;
+
+            if(bench_ioctl(h, FS_CD_IOCTL_PIN, &pin) || !pin.len)
+                break;
+
+            for(off = 0; off < pin.len; off += len) {
+                len = pin.len - off < RECORD ? pin.len - off : RECORD;
+                parse_sum += checksum((const uint8 *)pin.data + off, len);
+            }
+
+            fs_iso9660_unpin(pin.data);
+        }
+
+        vh->close(h);
+        sample_add(&s, drive_model_now() - t, files[f].size);
+    }
+
+    bench_end(zero ? "pin" : "parse", &s);
+    free(buf);
+}
+
+static void w_parse(void) {
+    parse(0);
+}
+
+static void w_pin(void) {
+    parse(1);
+}
+
+/* The largest file other than target(), or target() if there's no other */
+static int second(void) {
+    int big = target(), hot = -1, i;
+
+    for(i = 0; i < nfiles; i++)
+        if(i != big && (hot < 0 || files[i].size > files[hot].size))
+            hot = i;
+
+    return hot < 0 ? big : hot;
+}
+
+#define HOT_BYTES   16384
+
+static void *cached_main(void *p) {
+    uint8 *mem = bench_buf(4096 + 1), *buf = mem + 1;
+    worker_t *w = (worker_t *)p;
+    int f = second(), span, i;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    span = files[f].size < HOT_BYTES ? files[f].size : HOT_BYTES;
+
+    if((h = vh->open(vh, files[f].path, O_RDONLY))) {
+        for(i = 0; i < opt_n; i++) {
+            t = drive_model_now();
+            vh->seek(h, span > 4096 ? rand_r(&w->seed) % (span - 4096) : 0,
+                     SEEK_SET);
+            got = vh->read(h, buf, 4096);
+            sample_add(&w->s, drive_model_now() - t, got > 0 ? got : 0);
+            drive_model_advance(1000000);
+        }
+
+        vh->close(h);
+    }
+
+    free(mem);
+    return NULL;
+}
+
+static void *loader_main(void *p) {
+    uint8 *buf = bench_buf(opt_chunk);
+    int f = target();
+    void *h;
+
+    (void)p;
+
+    if((h = vh->open(vh, files[f].path, O_RDONLY))) {
+        while(!hm_done) {
+            if(vh->read(h, buf, opt_chunk) <= 0)
+                vh->seek(h, 0, SEEK_SET);
+        }
+
+        vh->close(h);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void w_contend(void) {
+    int i, j, nhit = opt_threads > 1 ? opt_threads - 1 : 1;
+    worker_t *w = calloc(nhit + 1, sizeof(worker_t));
+    uint8 *buf = bench_buf(HOT_BYTES);
+    sample_t s;
+    void *h;
+
+    sample_init(&s, opt_n * nhit);
+    bench_begin();
+
+    /* Get the hot data into the cache first */
+    if((h = vh->open(vh, files[second()].path, O_RDONLY))) {
+        vh->read(h, buf + 1, HOT_BYTES - 1);
+        vh->close(h);
+    }
+
+    hm_done = 0;
+    pthread_create(&w[nhit].thd, NULL, loader_main, w + nhit);
+
+    for(i = 0; i < nhit; i++) {
+        w[i].seed = opt_seed + i;
+        sample_init(&w[i].s, opt_n);
+        pthread_create(&w[i].thd, NULL, cached_main, w + i);
+    }
+
+    for(i = 0; i < nhit; i++) {
+        pthread_join(w[i].thd, NULL);
+
+        for(j = 0; j < w[i].s.ncalls; j++)
+            sample_add(&s, w[i].s.lat[j], 0);
+
+        s.bytes += w[i].s.bytes;
+        free(w[i].s.lat);
+    }
+
+    hm_done = 1;
+    pthread_join(w[nhit].thd, NULL);
+
+    bench_end("contend", &s);
+    free(buf);
+    free(w);
+}
+
+static void frames(int async) {
+    uint8 *buf = bench_buf(4096);
+    unsigned seed = opt_seed;
+    int i, f = target(), size = files[f].size, busy = 0;
+    fs_iso9660_aio_t req;
+    sample_t s;
+    uint64 t, bytes = 0;
+    ssize_t got;
+    void *h;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    memset(&req, 0, sizeof(req));
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+
+        if(!async) {
+            vh->seek(h, rand_r(&seed) % (size - 4096), SEEK_SET);
+
+            if((got = vh->read(h, buf, 4096)) > 0)
+                bytes += got;
+        }
+        else if(!busy) {
+            req.offset = rand_r(&seed) % (size - 4096);
+            req.buf = buf;
+            req.bytes = 4096;
+            busy = !bench_ioctl(h, FS_CD_IOCTL_AIO_READ, &req);
+        }
+
+        /* The rest of the frame */
+        drive_model_advance(1000000);
+
+        if(busy && fs_iso9660_aio_poll(&req)) {
+            if(req.rv > 0)
+                bytes += req.rv;
+
+            busy = 0;
+        }
+
+        sample_add(&s, drive_model_now() - t, 0);
+    }
+
+    if(busy)
+        fs_iso9660_aio_wait(&req);
+
+    vh->close(h);
+out:
+    s.bytes = bytes;
+    bench_end(async ? "aio" : "frames", &s);
+    free(buf);
+}
+
+static void w_frames(void) {
+    frames(0);
+}
+
+static void w_aio(void) {
+    frames(1);
+}
+
+static volatile int bulk_done;
+static uint64 bulk_bytes;
+
+static void *bulk_main(void *p) {
+    uint8 *buf = bench_buf(opt_chunk);
+    ssize_t got;
+    void *h;
+
+    (void)p;
+
+    if((h = vh->open(vh, files[second()].path, O_RDONLY))) {
+        while(!bulk_done) {
+            if((got = vh->read(h, buf, opt_chunk)) <= 0) {
+                vh->seek(h, 0, SEEK_SET);
+                continue;
+            }
+
+            bulk_bytes += got;
+        }
+
+        vh->close(h);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Playback of the largest file, as in w_playback, against a loader reading
+   the second largest in -b sized chunks; with reserve, the player declares
+   its rate and two chunks' worth of deadline with FS_CD_IOCTL_RESERVE. */
+static void bulkplay(int reserve) {
+    int f = target(), n = files[f].size / PLAY_CHUNK + 2, late = 0;
+    uint8 *buf = bench_buf(PLAY_CHUNK);
+    size_t left = files[f].size, want;
+    fs_iso9660_reserve_t rsv;
+    fs_iso9660_reserve_stats_t st;
+    pthread_t thd;
+    uint64 t = 0, lat, t0;
+    sample_t s;
+    ssize_t got;
+    void *h;
+
+    sample_init(&s, n);
+    memset(&st, 0, sizeof(st));
+    bench_begin();
+
+    if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    if(reserve) {
+        rsv.rate = (uint32)(PLAY_CHUNK * 1000000ULL / opt_think);
+        rsv.deadline_ms = 2 * opt_think / 1000;
+        bench_ioctl(h, FS_CD_IOCTL_RESERVE, &rsv);
+    }
+
+    bulk_done = 0;
+    bulk_bytes = 0;
+    t0 = drive_model_now();
+    pthread_create(&thd, NULL, bulk_main, NULL);
+
+    while(left > 0) {
+        want = left < PLAY_CHUNK ? left : PLAY_CHUNK;
+        t = drive_model_now();
+        got = vh->read(h, buf, want);
+        lat = drive_model_now() - t;
+        sample_add(&s, lat, got > 0 ? got : 0);
+
+        if(got <= 0)
+            break;
+
+        /* Took longer than showing the last chunk did: a dropped frame */
+        if(lat > opt_think * 1000ULL)
+            late++;
+
+        left -= got;
+        drive_model_advance(opt_think * 1000ULL);
+    }
+
+    bulk_done = 1;
+    pthread_join(thd, NULL);
+    t = drive_model_now() - t0;
+
+    if(reserve)
+        bench_ioctl(h, FS_CD_IOCTL_RESERVE_STATS, &st);
+
+    vh->close(h);
+out:
+    bench_end(reserve ? "reserve" : "bulkplay", &s);
+    printf("         late %d, underruns %u, refills %u, bulk %.3f MB/s\n",
+           late, (unsigned)st.underruns, (unsigned)st.refills,
+           t ? (bulk_bytes / 1048576.0) / (t / 1e9) : 0.0);
+    free(buf);
+}
+
+/* Playback as in w_playback, but out of a fs_iso9660_stream_open() ring of
+   8 chunks, refilled from half empty, copying each chunk out as a decoder
+   would take it */
+static void w_ring(void) {
+    int f = target(), n = files[f].size / PLAY_CHUNK + 2, late = 0;
+    uint8 *ring = bench_buf(8 * PLAY_CHUNK), *buf = bench_buf(PLAY_CHUNK);
+    fs_iso9660_stream_stats_t st;
+    fs_iso9660_stream_t *strm;
+    size_t got, avail;
+    const void *data;
+    uint64 t, lat;
+    sample_t s;
+
+    sample_init(&s, n);
+    memset(&st, 0, sizeof(st));
+    bench_begin();
+
+    if(!(strm = fs_iso9660_stream_open(files[f].path, ring, 8 * PLAY_CHUNK,
+                                       4 * PLAY_CHUNK)))
+        goto out;
+
+    for(;;) {
+        t = drive_model_now();
+
+        if(!fs_iso9660_stream_wait(strm, PLAY_CHUNK))
+            break;
+
+        for(got = 0; got < PLAY_CHUNK; got += avail) {
+            if(!(avail = fs_iso9660_stream_peek(strm, &data)))
+                break;
+
+            if(avail > PLAY_CHUNK - got)
+                avail = PLAY_CHUNK - got;
+
+            memcpy(buf + got, data, avail);
+            fs_iso9660_stream_consume(strm, avail);
+        }
+
+        lat = drive_model_now() - t;
+        sample_add(&s, lat, got);
+
+        if(lat > opt_think * 1000ULL)
+            late++;
+
+        drive_model_advance(opt_think * 1000ULL);
+    }
+
+    fs_iso9660_stream_get_stats(strm, &st);
+    fs_iso9660_stream_close(strm);
+out:
+    bench_end("ring", &s);
+    printf("         late %d, underruns %u, refills %u\n", late,
+           (unsigned)st.underruns, (unsigned)st.refills);
+    free(buf);
+    free(ring);
+}
+
+/* FADs of the first audio track in the low density area */
+static int audio_track(uint32 *start, uint32 *end) {
+    CDROM_TOC toc;
+    int i, last;
+
+    if(cdrom_read_toc(&toc, 0) != ERR_OK)
+        return -1;
+
+    last = TOC_TRACK(toc.last);
+
+    for(i = TOC_TRACK(toc.first); i <= last; i++) {
+        if(TOC_CTRL(toc.entry[i - 1]) == 0) {
+            *start = TOC_LBA(toc.entry[i - 1]);
+            *end = TOC_LBA(i < last ? toc.entry[i] : toc.leadout_sector);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void cdda(const char *name, int linger) {
+    int f = target(), n = files[f].size / PLAY_CHUNK + 2;
+    uint8 *buf = bench_buf(PLAY_CHUNK);
+    size_t left = files[f].size, want;
+    uint32 start, end;
+    drive_stats_t ds;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, n);
+    bench_begin();
+    fs_iso9660_set_cdda_linger(linger);
+
+    if(audio_track(&start, &end) ||
+       fs_iso9660_cdda_play(start, end, 15) ||
+       !(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    while(left > 0) {
+        want = left < PLAY_CHUNK ? left : PLAY_CHUNK;
+        t = drive_model_now();
+        got = vh->read(h, buf, want);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+
+        if(got <= 0)
+            break;
+
+        left -= got;
+        drive_model_advance(opt_think * 1000ULL);
+    }
+
+    vh->close(h);
+out:
+    bench_end(name, &s);
+    drive_model_stats(&ds);
+    printf("         gaps %llu, %.1f per MB, silence %.1f ms\n",
+           (unsigned long long)ds.cdda_gaps, s.bytes ?
+           ds.cdda_gaps / (s.bytes / 1048576.0) : 0.0, ds.cdda_gap_ns / 1e6);
+    fs_iso9660_cdda_stop();
+    fs_iso9660_set_cdda_linger(FS_CD_CDDA_LINGER);
+    free(buf);
+}
+
+static void w_cdda(void) {
+    cdda("cdda", 0);
+}
+
+static void w_cddabatch(void) {
+    cdda("cddabatch", FS_CD_CDDA_LINGER);
+}
+
+static void w_bulkplay(void) {
+    bulkplay(0);
+}
+
+static void w_reserve(void) {
+    bulkplay(1);
+}
+
+static void w_mixed(void) {
+    static const int rd = 4096, chunk = 8192, stride = 16384;
+    int big = target(), hot = second(), i, regions;
+    uint8 *mem = bench_buf(chunk + 1), *buf = mem + 1;
+    unsigned seed = opt_seed;
+    void *hh = NULL, *hs = NULL;
+    sample_t s;
+    ssize_t got;
+    uint64 t;
+
+    regions = files[hot].size / stride;
+
+    if(regions > opt_hot)
+        regions = opt_hot;
+
+    sample_init(&s, opt_n * 2);
+    bench_begin();
+
+    if(!regions || !(hh = vh->open(vh, files[hot].path, O_RDONLY)) ||
+       !(hs = vh->open(vh, files[big].path, O_RDONLY)))
+        goto out;
+
+    for(i = 0; i < opt_n; i++) {
+        t = drive_model_now();
+        vh->seek(hh, (rand_r(&seed) % regions) * stride, SEEK_SET);
+        got = vh->read(hh, buf, rd);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+
+        t = drive_model_now();
+
+        if((got = vh->read(hs, buf, chunk)) < chunk)
+            vh->seek(hs, 0, SEEK_SET);
+
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+    }
+
+out:
+    if(hs)
+        vh->close(hs);
+
+    if(hh)
+        vh->close(hh);
+
+    bench_end("mixed", &s);
+    free(mem);
+}
+
+#define GATHER_N    16
+#define GATHER_SIZE 256
+
+/* -n rounds of GATHER_N reads of GATHER_SIZE bytes at random offsets in
+   the largest file, as for an archive's table of contents: one seek and
+   read for each, or all of them in one FS_CD_IOCTL_PREADV */
+static void gather(int vector) {
+    int f = target(), i, j;
+    uint8 *buf = bench_buf(GATHER_N * GATHER_SIZE);
+    fs_iso9660_pread_t vec[GATHER_N];
+    unsigned seed = opt_seed;
+    size_t got;
+    sample_t s;
+    uint64 t;
+    void *h;
+
+    sample_init(&s, opt_n);
+    bench_begin();
+
+    if(files[f].size <= GATHER_SIZE ||
+       !(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    for(i = 0; i < opt_n; i++) {
+        for(j = 0; j < GATHER_N; j++) {
+            vec[j].offset = rand_r(&seed) % (files[f].size - GATHER_SIZE);
+            vec[j].buf = buf + j * GATHER_SIZE;
+            vec[j].bytes = GATHER_SIZE;
+        }
+
+        t = drive_model_now();
+        got = 0;
+
+        if(vector) {
+            if(!bench_ioctl(h, FS_CD_IOCTL_PREADV, vec, GATHER_N))
+                for(j = 0; j < GATHER_N; j++)
+                    got += vec[j].bytes;
+        }
+        else {
+            for(j = 0; j < GATHER_N; j++) {
+                vh->seek(h, vec[j].offset, SEEK_SET);
+
+                if(vh->read(h, vec[j].buf, vec[j].bytes) > 0)
+                    got += vec[j].bytes;
+            }
+        }
+
+        sample_add(&s, drive_model_now() - t, got);
+    }
+
+    vh->close(h);
+out:
+    bench_end(vector ? "preadv" : "gather", &s);
+    free(buf);
+}
+
+static void w_gather(void) {
+    gather(0);
+}
+
+static void w_preadv(void) {
+    gather(1);
+}
+
+/* Every file on the disc, loaded whole one after the other in the order
+   the survey found them, as level loading code would; into buffers -u
+   bytes off alignment */
+static void w_level(void) {
+    uint32 sum = 0;
+    sample_t s;
+    ssize_t got;
+    uint8 *mem, *buf;
+    uint64 t;
+    void *h;
+    int i;
+
+    sample_init(&s, nfiles);
+    bench_begin();
+
+    for(i = 0; i < nfiles; i++) {
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[i].path, O_RDONLY)))
+            continue;
+
+        mem = bench_buf(files[i].size + opt_unalign + 1);
+        buf = mem + opt_unalign;
+        got = vh->read(h, buf, files[i].size);
+        vh->close(h);
+        sample_add(&s, drive_model_now() - t, got > 0 ? got : 0);
+
+        if(got > 0)
+            sum += checksum(buf, got);
+
+        free(mem);
+    }
+
+    bench_end("level", &s);
+    printf("         sum %08x\n", (unsigned)sum);
+}
+
+/* The same, through the handler's mmap, unmapped with FS_CD_IOCTL_MUNMAP */
+static void w_mmap(void) {
+    uint32 sum = 0;
+    sample_t s;
+    uint8 *map;
+    uint64 t;
+    void *h;
+    int i;
+
+    sample_init(&s, nfiles);
+    bench_begin();
+
+    for(i = 0; i < nfiles; i++) {
+        t = drive_model_now();
+
+        if(!(h = vh->open(vh, files[i].path, O_RDONLY)))
+            continue;
+
+        map = vh->mmap(h);
+        sample_add(&s, drive_model_now() - t, map ? files[i].size : 0);
+
+        if(map)
+            sum += checksum(map, files[i].size);
+
+        bench_ioctl(h, FS_CD_IOCTL_MUNMAP);
+        vh->close(h);
+    }
+
+    bench_end("mmap", &s);
+    printf("         sum %08x\n", (unsigned)sum);
+}
+
+static sample_t *batch_s;
+static uint64 batch_t;
+static size_t batch_done;
+
+static void batch_progress(size_t done, size_t total, void *data) {
+    uint64 now = drive_model_now();
+
+    (void)total;
+    (void)data;
+
+    sample_add(batch_s, now - batch_t, done - batch_done);
+    batch_t = now;
+    batch_done = done;
+}
+
+/* The same files through fs_iso9660_load_batch(); one sample per drive
+   command, from its progress callback */
+static void w_batch(void) {
+    fs_iso9660_batch_t *b = calloc(nfiles, sizeof(fs_iso9660_batch_t));
+    uint32 sum = 0;
+    sample_t s;
+    int i;
+
+    sample_init(&s, nfiles + files[largest].size / 2048 + 64);
+    bench_begin();
+
+    for(i = 0; i < nfiles; i++)
+        b[i].path = files[i].path;
+
+    batch_s = &s;
+    batch_t = drive_model_now();
+    batch_done = 0;
+    fs_iso9660_load_batch(b, nfiles, batch_progress, NULL);
+
+    bench_end("batch", &s);
+
+    for(i = 0; i < nfiles; i++) {
+        if(b[i].buf)
+            sum += checksum(b[i].buf, b[i].bytes);
+
+        free(b[i].buf);
+    }
+
+    printf("         sum %08x\n", (unsigned)sum);
+    free(b);
+}
+
+/* The target file demultiplexed with FS_CD_IOCTL_XA_READ, FS_CD_XA_SECTORS
+   at a time: XA file 1's video and audio on channel 1, as a player of the
+   host's DISC_XA_PATH image would, until the end of that file */
+static void w_xa(void) {
+    int f = target(), n = files[f].size / 2048 + 2;
+    size_t size = FS_CD_XA_SECTORS * 2324;
+    uint8 *video = bench_buf(size), *audio = bench_buf(size);
+    fs_iso9660_xa_chan_t ch[2] = {
+        { 1, FS_CD_XA_VIDEO, video, size, 0 },
+        { 1, FS_CD_XA_AUDIO, audio, size, 0 },
+    };
+    fs_iso9660_xa_read_t xa = { 0, 1, ch, 2, 0, 0 };
+    uint32 sectors = 0, skipped = 0, vlen = 0, alen = 0, sum = 0;
+    sample_t s;
+    uint64 t;
+    void *h;
+    int rv;
+
+    sample_init(&s, n);
+    bench_begin();
+
+    if(!(h = vh->open(vh, files[f].path, O_RDONLY)))
+        goto out;
+
+    do {
+        ch[0].len = ch[1].len = 0;
+        xa.sectors = FS_CD_XA_SECTORS;
+        t = drive_model_now();
+        rv = bench_ioctl(h, FS_CD_IOCTL_XA_READ, &xa);
+        sample_add(&s, drive_model_now() - t, ch[0].len + ch[1].len);
+
+        sectors += xa.sectors;
+        skipped += xa.skipped;
+        vlen += ch[0].len;
+        alen += ch[1].len;
+        sum += checksum(video, ch[0].len) + checksum(audio, ch[1].len);
+    } while(!rv && xa.sectors && !xa.eof);
+
+    vh->close(h);
+out:
+    bench_end("xa", &s);
+    printf("         sectors %u skipped %u eof %d video %u audio %u "
+           "sum %08x\n", (unsigned)sectors, (unsigned)skipped, xa.eof,
+           (unsigned)vlen, (unsigned)alen, (unsigned)sum);
+    free(video);
+    free(audio);
+}
+
+static const struct {
+    const char  *name;
+    void (*run)(void);
+} workloads[] = {
+    { "stream", w_stream },
+    { "playback", w_playback },
+    { "random", w_random },
+    { "small", w_small },
+    { "deep", w_deep },
+    { "readdir", w_readdir },
+    { "threads", w_threads },
+    { "loaders", w_loaders },
+    { "hitmiss", w_hitmiss },
+    { "contend", w_contend },
+    { "mixed", w_mixed },
+    { "parse", w_parse },
+    { "pin", w_pin },
+    { "frames", w_frames },
+    { "aio", w_aio },
+    { "ring", w_ring },
+    { "bulkplay", w_bulkplay },
+    { "reserve", w_reserve },
+    { "gather", w_gather },
+    { "preadv", w_preadv },
+    { "level", w_level },
+    { "mmap", w_mmap },
+    { "batch", w_batch },
+    { "cdda", w_cdda },
+    { "cddabatch", w_cddabatch },
+    { "xa", w_xa },
+};
+
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+/********************************************************************************/
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-m MODEL] [-c ICACHE,DCACHE] "
+            "[-k ILINE,DLINE] [-p dma|pio] [-a SECTORS] [-P lru|2q] "
+            "[-S fifo|elevator] [-u BYTES] [-w a,b,...] [-n N] [-t T] "
+            "[-b BYTES] [-T US] [-H N] [-s SEED] [-f FILE] IMAGE\n", prog);
+    exit(2);
+}
+
+static size_t parse_size(const char *str, char **end) {
+    size_t v = strtoul(str, end, 0);
+
+    if(**end == 'k' || **end == 'K') {
+        v <<= 10;
+        (*end)++;
+    }
+    else if(**end == 'm' || **end == 'M') {
+        v <<= 20;
+        (*end)++;
+    }
+
+    return v;
+}
+
+int main(int argc, char *argv[]) {
+    const char *which = NULL;
+    drive_params_t dp;
+    char list[256], *tok, *save, *end;
+    size_t isize = 0, dsize = 0;
+    int iline = 0, dline = 0, fill = CDROM_READ_DMA, ra = -1;
+    int policy = FS_CD_DCACHE_POLICY, sched = FS_CD_SCHED;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "m:c:k:p:a:P:S:u:w:n:t:b:T:H:s:f:")) != -1) {
+        switch(opt) {
+            case 'S':
+                if(!strcmp(optarg, "fifo"))
+                    sched = FS_CD_SCHED_FIFO;
+                else if(!strcmp(optarg, "elevator"))
+                    sched = FS_CD_SCHED_ELEVATOR;
+                else
+                    usage(argv[0]);
+
+                break;
+
+            case 'P':
+                if(!strcmp(optarg, "lru"))
+                    policy = FS_CD_POLICY_LRU;
+                else if(!strcmp(optarg, "2q"))
+                    policy = FS_CD_POLICY_2Q;
+                else
+                    usage(argv[0]);
+
+                break;
+
+            case 'H':
+                opt_hot = atoi(optarg);
+                break;
+
+            case 'u':
+                opt_unalign = atoi(optarg);
+                break;
+
+            case 'a':
+                ra = atoi(optarg);
+                break;
+
+            case 'p':
+                if(!strcmp(optarg, "dma"))
+                    fill = CDROM_READ_DMA;
+                else if(!strcmp(optarg, "pio"))
+                    fill = CDROM_READ_PIO;
+                else
+                    usage(argv[0]);
+
+                break;
+
+            case 'k':
+                iline = strtol(optarg, &end, 0);
+
+                if(*end++ != ',')
+                    usage(argv[0]);
+
+                dline = strtol(end, &end, 0);
+
+                if(*end)
+                    usage(argv[0]);
+
+                break;
+
+            case 'c':
+                isize = parse_size(optarg, &end);
+
+                if(*end++ != ',')
+                    usage(argv[0]);
+
+                dsize = parse_size(end, &end);
+
+                if(*end)
+                    usage(argv[0]);
+
+                break;
+
+            case 'm':
+                if(drive_model_parse(optarg, &dp)) {
+                    fprintf(stderr, "bench_iso: bad model \"%s\"\n", optarg);
+                    return 2;
+                }
+
+                drive_model_configure(&dp);
+                break;
+
+            case 'w':
+                which = optarg;
+                break;
+
+            case 'n':
+                opt_n = atoi(optarg);
+                break;
+
+            case 't':
+                opt_threads = atoi(optarg);
+                break;
+
+            case 'b':
+                opt_chunk = atoi(optarg);
+                break;
+
+            case 'T':
+                opt_think = atoi(optarg);
+                break;
+
+            case 's':
+                opt_seed = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'f':
+                opt_file = optarg;
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if(optind >= argc || opt_n < 1 || opt_threads < 1 || opt_chunk < 1)
+        usage(argv[0]);
+
+    if(!(vh = harness_mount(argv[optind])))
+        return 1;
+
+    fs_iso9660_set_fill_mode(fill);
+    fs_iso9660_set_cache_policy(policy);
+    fs_iso9660_set_sched(sched);
+
+    if(ra >= 0)
+        fs_iso9660_set_readahead(ra);
+
+    if(iline && fs_iso9660_set_cache_cluster(iline, dline)) {
+        fprintf(stderr, "bench_iso: can't set cache line sizes\n");
+        return 1;
+    }
+
+    if(isize && fs_iso9660_set_cache_size(isize, dsize)) {
+        fprintf(stderr, "bench_iso: can't set cache sizes\n");
+        return 1;
+    }
+
+    fs_iso9660_get_cache_size(&isize, &dsize);
+    printf("icache %zu KB, dcache %zu KB, %s, %s fills, %s\n", isize >> 10,
+           dsize >> 10, policy == FS_CD_POLICY_2Q ? "2q" : "lru",
+           fill == CDROM_READ_DMA ? "dma" : "pio",
+           sched == FS_CD_SCHED_FIFO ? "fifo" : "elevator");
+
+    survey("/", 0);
+
+    if(!nfiles) {
+        fprintf(stderr, "bench_iso: no files on %s\n", argv[optind]);
+        return 1;
+    }
+
+    printf("%-8s %7s %10s %10s %8s %9s %9s %7s %8s %6s %9s %6s %8s %8s\n",
+           "workload", "calls", "bytes", "sim ms", "MB/s", "p50 us",
+           "p99 us", "cmds", "sectors", "seeks", "seek ksec", "hit%",
+           "cpu ms", "wall ms");
+
+    for(i = 0; i < NUM_WORKLOADS; i++) {
+        if(which) {
+            snprintf(list, sizeof(list), "%s", which);
+
+            for(tok = strtok_r(list, ",", &save); tok;
+                tok = strtok_r(NULL, ",", &save))
+                if(!strcmp(tok, workloads[i].name))
+                    break;
+
+            if(!tok)
+                continue;
+        }
+
+        workloads[i].run();
+    }
+
+    harness_unmount();
+    return 0;
+}
@@ -0,0 +1,122 @@
+/* KallistiOS host shim
+
+   cdls.c
+
+   Smoke test for the host build: walks the /cd tree of a disc image through
+   the driver's VFS handler, or copies one file out of it.
+
+     cdls IMAGE [DIR]        list DIR (default /) recursively
+     cdls -x FILE IMAGE      write FILE to stdout
+
+   With -v the drive model's totals are printed to stderr at the end.
+
+*/
+
+#include "harness.h"
+#include "drive_model.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static vfs_handler_t *vh;
+
+static int list(const char *dir, int depth) {
+    char path[1024];
+    dirent_t *de;
+    void *h;
+
+    if(!(h = vh->open(vh, dir, O_RDONLY | O_DIR))) {
+        fprintf(stderr, "cdls: can't open directory %s\n", dir);
+        return -1;
+    }
+
+    while((de = vh->readdir(h))) {
+        printf("%*s%-32s %10d\n", depth * 2, "", de->name,
+               de->attr & O_DIR ? -1 : de->size);
+
+        if(de->attr & O_DIR) {
+            snprintf(path, sizeof(path), "%s%s%s", dir,
+                     dir[strlen(dir) - 1] == '/' ? "" : "/", de->name);
+            list(path, depth + 1);
+        }
+    }
+
+    vh->close(h);
+    return 0;
+}
+
+static int extract(const char *fn) {
+    static char buf[65536];
+    size_t left;
+    ssize_t n;
+    void *h;
+
+    if(!(h = vh->open(vh, fn, O_RDONLY))) {
+        fprintf(stderr, "cdls: can't open %s\n", fn);
+        return -1;
+    }
+
+    /* Stop at the file size rather than waiting for a short read; the
+       driver's DMA path doesn't clamp to it. */
+    left = vh->total(h);
+
+    while(left > 0) {
+        n = vh->read(h, buf, left < sizeof(buf) ? left : sizeof(buf));
+
+        if(n <= 0 || fwrite(buf, 1, n, stdout) != (size_t)n)
+            break;
+
+        left -= n;
+    }
+
+    vh->close(h);
+    return left ? -1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *xfile = NULL;
+    int opt, rv, verbose = 0;
+    drive_stats_t ds;
+
+    while((opt = getopt(argc, argv, "vx:")) != -1) {
+        switch(opt) {
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'x':
+                xfile = optarg;
+                break;
+
+            default:
+                fprintf(stderr, "usage: %s [-v] [-x FILE] IMAGE [DIR]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if(optind >= argc) {
+        fprintf(stderr, "usage: %s [-v] [-x FILE] IMAGE [DIR]\n", argv[0]);
+        return 2;
+    }
+
+    if(!(vh = harness_mount(argv[optind])))
+        return 1;
+
+    if(xfile)
+        rv = extract(xfile);
+    else
+        rv = list(optind + 1 < argc ? argv[optind + 1] : "/", 0);
+
+    if(verbose) {
+        drive_model_stats(&ds);
+        fprintf(stderr, "%llu commands, %llu sectors, %llu seeks, "
+                "%.3f ms simulated\n", (unsigned long long)ds.commands,
+                (unsigned long long)ds.sectors, (unsigned long long)ds.seeks,
+                drive_model_now() / 1e6);
+    }
+
+    harness_unmount();
+    return rv ? 1 : 0;
+}
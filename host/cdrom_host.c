@@ -0,0 +1,326 @@
+/* KallistiOS host shim
+
+   cdrom_host.c
+
+   Stand-in for the GD-ROM BIOS layer (kernel/arch/dreamcast/hardware/cdrom.c)
+   that serves sectors out of a disc image on the host (see disc_image.c).
+   A .iso is presented as a data CD whose only track starts at FAD 150; a
+   .gdi as a GD-ROM with its low and high density sessions.
+
+   Sector numbers coming in are FADs, exactly as on the real drive, so the
+   driver's "+ 150" arithmetic is exercised unchanged. Every command is
+   charged to the drive model (drive_model.c), so callers can read off how
+   long the same work would have kept a real GD-ROM busy.
+
+*/
+
+#include "disc_image.h"
+#include "drive_model.h"
+
+#include <dc/cdrom.h>
+#include <kos/mutex.h>
+#include <kos/dbglog.h>
+
+#include <string.h>
+
+static disc_image_t *disc;
+
+/* What cdrom_change_dataype last selected */
+static int read_part = CDROM_READ_DATA_AREA;
+
+static mutex_t cd_mutex = RECURSIVE_MUTEX_INITIALIZER;
+
+int cdrom_host_insert(const char *path) {
+    int rv = 0;
+
+    mutex_lock(&cd_mutex);
+    disc_image_close(disc);
+    disc = NULL;
+
+    if(path && !(disc = disc_image_open(path)))
+        rv = -1;
+
+    mutex_unlock(&cd_mutex);
+    return rv;
+}
+
+int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
+    int rv;
+
+    mutex_lock(&cd_mutex);
+
+    if(!disc) {
+        mutex_unlock(&cd_mutex);
+        return ERR_NO_DISC;
+    }
+
+    if(sector < 150) {
+        drive_model_command();
+        rv = -1;
+    }
+    else {
+        drive_model_read(sector - 150, cnt, mode == CDROM_READ_DMA);
+
+        if(read_part == CDROM_READ_WHOLE_SECTOR)
+            rv = disc_image_read_raw(disc, sector - 150, cnt, buffer);
+        else
+            rv = disc_image_read_data(disc, sector - 150, cnt, buffer);
+    }
+
+    mutex_unlock(&cd_mutex);
+    return rv < 0 ? ERR_SYS : ERR_OK;
+}
+
+int cdrom_read_sectors(void *buffer, int sector, int cnt) {
+    return cdrom_read_sectors_ex(buffer, sector, cnt, CDROM_READ_PIO);
+}
+
+int cdrom_read_toc(CDROM_TOC *toc_buffer, int session) {
+    int i, first = 0, last = 0;
+    uint32 end = 0;
+    const disc_track_t *t;
+
+    mutex_lock(&cd_mutex);
+
+    if(!disc) {
+        mutex_unlock(&cd_mutex);
+        return ERR_NO_DISC;
+    }
+
+    drive_model_command();
+    memset(toc_buffer, 0xff, sizeof(CDROM_TOC));
+
+    /* Session 0 is the low density area, session 1 the high density area
+       (which only exists on a GD-ROM). */
+    for(i = 0; i < disc->ntracks; i++) {
+        t = disc->track + i;
+
+        if((t->lba >= DISC_HD_LBA) != (session != 0))
+            continue;
+
+        toc_buffer->entry[t->num - 1] = (t->ctrl << 28) | (1 << 24) |
+                                        (t->lba + 150);
+
+        if(!first)
+            first = t->num;
+
+        last = t->num;
+        end = t->lba + 150 + t->count;
+    }
+
+    if(!first) {
+        mutex_unlock(&cd_mutex);
+        return ERR_SYS;
+    }
+
+    toc_buffer->first = (1 << 24) | (first << 16);
+    toc_buffer->last = (1 << 24) | (last << 16);
+    toc_buffer->leadout_sector = (1 << 24) | end;
+
+    mutex_unlock(&cd_mutex);
+    return ERR_OK;
+}
+
+uint32 cdrom_locate_data_track(CDROM_TOC *toc) {
+    int i, first, last;
+
+    first = TOC_TRACK(toc->first);
+    last = TOC_TRACK(toc->last);
+
+    if(first < 1 || last > 99 || first > last)
+        return 0;
+
+    /* Find the last track which as a CTRL of 4 */
+    for(i = last; i >= first; i--) {
+        if(TOC_CTRL(toc->entry[i - 1]) == 4)
+            return TOC_LBA(toc->entry[i - 1]);
+    }
+
+    return 0;
+}
+
+int cdrom_get_status(int *status, int *disc_type) {
+    if(mutex_trylock(&cd_mutex))
+        return -1;
+
+    if(status)
+        *status = !disc ? CD_STATUS_NO_DISC : drive_model_cdda_playing(NULL) ?
+                  CD_STATUS_PLAYING : CD_STATUS_PAUSED;
+
+    if(disc_type)
+        *disc_type = !disc ? CD_FAIL : disc->gdrom ? CD_GDROM : CD_CDROM_XA;
+
+    mutex_unlock(&cd_mutex);
+    return ERR_OK;
+}
+
+int cdrom_exec_cmd(int cmd, void *param) {
+    (void)cmd;
+    (void)param;
+
+    return disc ? ERR_OK : ERR_NO_DISC;
+}
+
+/* The stand-in has no command queue: a submitted command is over by the
+   time its id comes back, and the id just holds on to the result. */
+#define HOST_MAX_REQS   16
+
+static struct {
+    int id, rv;
+} host_req[HOST_MAX_REQS];
+static int host_seq;
+
+int cdrom_submit_cmd(int cmd, void *param) {
+    int i, id = 0;
+
+    mutex_lock(&cd_mutex);
+
+    for(i = 0; i < HOST_MAX_REQS; i++) {
+        if(!host_req[i].id)
+            break;
+    }
+
+    if(i < HOST_MAX_REQS) {
+        if(++host_seq > 0x7fffffff / HOST_MAX_REQS - 1)
+            host_seq = 1;
+
+        id = host_req[i].id = host_seq * HOST_MAX_REQS + i;
+        host_req[i].rv = cdrom_exec_cmd(cmd, param);
+    }
+
+    mutex_unlock(&cd_mutex);
+    return id;
+}
+
+int cdrom_poll_cmd(int id, int *rv) {
+    int stat = NO_ACTIVE, r = ERR_NO_ACTIVE;
+
+    mutex_lock(&cd_mutex);
+
+    if(id > 0 && host_req[id % HOST_MAX_REQS].id == id) {
+        r = host_req[id % HOST_MAX_REQS].rv;
+        host_req[id % HOST_MAX_REQS].id = 0;
+        stat = COMPLETED;
+    }
+
+    mutex_unlock(&cd_mutex);
+
+    if(rv)
+        *rv = r;
+
+    return stat;
+}
+
+int cdrom_wait_cmd(int id) {
+    int rv;
+
+    cdrom_poll_cmd(id, &rv);
+    return rv;
+}
+
+int cdrom_set_sector_size(int size) {
+    return cdrom_reinit_ex(-1, -1, size);
+}
+
+/* Only the sector part matters to the image; the defaults follow the
+   kernel's: whole frames at 2352 bytes, user data otherwise. */
+int cdrom_change_dataype(int sector_part, int cdxa, int sector_size) {
+    (void)cdxa;
+
+    if(sector_part == -1)
+        sector_part = sector_size == 2352 ? CDROM_READ_WHOLE_SECTOR :
+                      CDROM_READ_DATA_AREA;
+
+    mutex_lock(&cd_mutex);
+    read_part = sector_part;
+    mutex_unlock(&cd_mutex);
+
+    return ERR_OK;
+}
+
+int cdrom_reinit(void) {
+    return cdrom_reinit_ex(-1, -1, -1);
+}
+
+int cdrom_reinit_ex(int sector_part, int cdxa, int sector_size) {
+    if(!disc)
+        return ERR_NO_DISC;
+
+    drive_model_command();
+    return cdrom_change_dataype(sector_part, cdxa, sector_size);
+}
+
+/* Only the Q channel's absolute FAD (bytes 11 to 13) is filled in: where
+   CDDA is playing, or where the head stopped */
+int cdrom_get_subcode(void *buffer, int buflen, int which) {
+    uint8 *q = (uint8 *)buffer;
+    uint32 fad;
+
+    memset(buffer, 0, buflen);
+
+    if(which == CD_SUB_Q_CHANNEL && buflen >= 14) {
+        q[1] = drive_model_cdda_playing(&fad) ? 0x11 : 0x15;
+        fad += 150;
+        q[11] = fad >> 16;
+        q[12] = fad >> 8;
+        q[13] = fad;
+    }
+
+    return disc ? ERR_OK : ERR_NO_DISC;
+}
+
+/* Start of track num, or of the lead-out past the last, as an LBA */
+static uint32 track_lba(int num, int end) {
+    int i;
+
+    for(i = 0; i < disc->ntracks; i++) {
+        if(disc->track[i].num == num)
+            return disc->track[i].lba + (end ? disc->track[i].count : 0);
+    }
+
+    return 0;
+}
+
+int cdrom_cdda_play(uint32 start, uint32 end, uint32 repeat, int mode) {
+    mutex_lock(&cd_mutex);
+
+    if(!disc) {
+        mutex_unlock(&cd_mutex);
+        return ERR_NO_DISC;
+    }
+
+    if(mode == CDDA_TRACKS) {
+        start = track_lba(start, 0);
+        end = track_lba(end, 1);
+    }
+    else {
+        start -= 150;
+        end -= 150;
+    }
+
+    drive_model_cdda_play(start, end, repeat > 15 ? 15 : repeat);
+    mutex_unlock(&cd_mutex);
+
+    return ERR_OK;
+}
+
+int cdrom_cdda_pause(void) {
+    drive_model_cdda_stop();
+    return ERR_OK;
+}
+
+int cdrom_cdda_resume(void) {
+    return ERR_OK;
+}
+
+int cdrom_spin_down(void) {
+    return ERR_OK;
+}
+
+int cdrom_init(void) {
+    return 0;
+}
+
+void cdrom_shutdown(void) {
+    cdrom_host_insert(NULL);
+}
@@ -0,0 +1,397 @@
+/* KallistiOS host shim
+
+   disc_image.c
+
+*/
+
+#include "disc_image.h"
+
+#include <kos/dbglog.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const uint8 sync_pattern[12] = {
+    0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+static int track_map(disc_track_t *t, const char *fn) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if((fd = open(fn, O_RDONLY)) < 0) {
+        dbglog(DBG_ERROR, "disc_image: can't open %s\n", fn);
+        return -1;
+    }
+
+    if(fstat(fd, &st) < 0 || st.st_size < t->sector_size) {
+        dbglog(DBG_ERROR, "disc_image: %s is empty\n", fn);
+        close(fd);
+        return -1;
+    }
+
+    /* Fault the whole file in up front so page faults don't show up in
+       the driver's numbers. */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        dbglog(DBG_ERROR, "disc_image: can't map %s\n", fn);
+        return -1;
+    }
+
+    t->map = map;
+    t->map_len = st.st_size;
+    t->count = st.st_size / t->sector_size;
+    return 0;
+}
+
+static int load_iso(disc_image_t *img, const char *path) {
+    disc_track_t *t = &img->track[0];
+
+    t->num = 1;
+    t->lba = 0;
+    t->ctrl = 4;
+    t->sector_size = DISC_DATA_SIZE;
+
+    if(track_map(t, path) < 0)
+        return -1;
+
+    img->ntracks = 1;
+    return 0;
+}
+
+/* A .gdi is a track count followed by one line per track:
+     <num> <lba> <ctrl> <sector size> <file> <offset>
+   Track files are named relative to the .gdi itself. File names with
+   spaces come quoted. */
+static int load_gdi(disc_image_t *img, const char *path) {
+    FILE *fp;
+    char line[1024], fn[512], full[4096];
+    const char *slash;
+    int dirlen, n, i, num, lba, ctrl, size;
+    disc_track_t *t;
+
+    if(!(fp = fopen(path, "r")))
+        return -1;
+
+    slash = strrchr(path, '/');
+    dirlen = slash ? (int)(slash - path) + 1 : 0;
+
+    if(!fgets(line, sizeof(line), fp) || sscanf(line, "%d", &n) != 1 ||
+       n < 1 || n > DISC_MAX_TRACKS) {
+        fclose(fp);
+        return -1;
+    }
+
+    for(i = 0; i < n; i++) {
+        if(!fgets(line, sizeof(line), fp) ||
+           (sscanf(line, "%d %d %d %d \"%511[^\"]\"", &num, &lba, &ctrl,
+                   &size, fn) != 5 &&
+            sscanf(line, "%d %d %d %d %511s", &num, &lba, &ctrl, &size,
+                   fn) != 5)) {
+            dbglog(DBG_ERROR, "disc_image: bad track line %d in %s\n", i + 1,
+                   path);
+            fclose(fp);
+            return -1;
+        }
+
+        if(num < 1 || num > DISC_MAX_TRACKS ||
+           (size != DISC_DATA_SIZE && size != DISC_RAW_SIZE) ||
+           (i && (uint32)lba < img->track[i - 1].lba)) {
+            dbglog(DBG_ERROR, "disc_image: unsupported track %d in %s\n", num,
+                   path);
+            fclose(fp);
+            return -1;
+        }
+
+        t = img->track + i;
+        t->num = num;
+        t->lba = lba;
+        t->ctrl = ctrl;
+        t->sector_size = size;
+
+        snprintf(full, sizeof(full), "%.*s%s", dirlen, path, fn);
+
+        if(track_map(t, full) < 0) {
+            fclose(fp);
+            return -1;
+        }
+
+        img->ntracks = i + 1;
+    }
+
+    fclose(fp);
+    img->gdrom = 1;
+    return 0;
+}
+
+static uint8 bcd(int n) {
+    return ((n / 10) << 4) | (n % 10);
+}
+
+static void put733(uint8 *p, uint32 v) {
+    p[0] = p[7] = v & 0xff;
+    p[1] = p[6] = (v >> 8) & 0xff;
+    p[2] = p[5] = (v >> 16) & 0xff;
+    p[3] = p[4] = v >> 24;
+}
+
+/* An ISO 9660 directory record at p, returning its length */
+static int put_dirent(uint8 *p, const char *name, int len, uint32 extent,
+                      uint32 size, int dir) {
+    int rl = (33 + len + 1) & ~1;
+
+    memset(p, 0, rl);
+    p[0] = rl;
+    put733(p + 2, extent);
+    put733(p + 10, size);
+    p[25] = dir ? 2 : 0;
+    p[28] = p[31] = 1;
+    p[32] = len;
+    memcpy(p + 33, name, len);
+    return rl;
+}
+
+/* Sectors of DISC_XA_PATH: system area, volume descriptors, root
+   directory, then /MOVIE.XA */
+#define XA_PVD      16
+#define XA_ROOT     18
+#define XA_MOVIE    19
+
+static int build_xa(disc_image_t *img) {
+    disc_track_t *t = &img->track[0];
+    uint32 i, fad, count = XA_MOVIE + DISC_XA_SECTORS, f2 = 0;
+    uint8 *map, *s, *d;
+    int off;
+
+    if(!(map = calloc(count, DISC_RAW_SIZE)))
+        return -1;
+
+    for(i = 0, s = map; i < count; i++, s += DISC_RAW_SIZE) {
+        fad = i + 150;
+        memcpy(s, sync_pattern, sizeof(sync_pattern));
+        s[12] = bcd(fad / (75 * 60));
+        s[13] = bcd((fad / 75) % 60);
+        s[14] = bcd(fad % 75);
+        s[15] = 2;
+
+        /* Form 1 data for the file system, subheader twice */
+        s[18] = s[22] = 0x08;
+    }
+
+    d = map + XA_PVD * DISC_RAW_SIZE + 24;
+    d[0] = 1;
+    memcpy(d + 1, "CD001", 5);
+    d[6] = 1;
+    put733(d + 80, count);
+    put_dirent(d + 156, "\0", 1, XA_ROOT, DISC_DATA_SIZE, 1);
+
+    d = map + (XA_PVD + 1) * DISC_RAW_SIZE + 24;
+    d[0] = 255;
+    memcpy(d + 1, "CD001", 5);
+    d[6] = 1;
+
+    d = map + XA_ROOT * DISC_RAW_SIZE + 24;
+    off = put_dirent(d, "\0", 1, XA_ROOT, DISC_DATA_SIZE, 1);
+    off += put_dirent(d + off, "\1", 1, XA_ROOT, DISC_DATA_SIZE, 1);
+    put_dirent(d + off, "MOVIE.XA;1", 10, XA_MOVIE,
+               DISC_XA_SECTORS * DISC_DATA_SIZE, 0);
+
+    /* Every fourth sector of the first 4 * DISC_XA_FILE2 is file 2's
+       audio; of file 1's, every third is audio, the rest video. */
+    for(i = 0; i < DISC_XA_SECTORS; i++) {
+        s = map + (XA_MOVIE + i) * DISC_RAW_SIZE;
+
+        if(i % 4 == 3 && f2 < DISC_XA_FILE2) {
+            s[16] = 2;
+            s[18] = 0x24;
+            memset(s + 24, 2 + f2, 2324);
+
+            if(++f2 == DISC_XA_FILE2)
+                s[18] |= 0x81;
+        }
+        else {
+            s[16] = 1;
+            s[18] = (i - f2) % 3 == 2 ? 0x24 : 0x02;
+            memset(s + 24, 1 + i - f2, 2324);
+
+            if(i == DISC_XA_SECTORS - 1)
+                s[18] |= 0x81;
+        }
+
+        s[17] = 1;
+        memcpy(s + 20, s + 16, 4);
+    }
+
+    t->num = 1;
+    t->lba = 0;
+    t->ctrl = 4;
+    t->sector_size = DISC_RAW_SIZE;
+    t->map = map;
+    t->map_len = (size_t)count * DISC_RAW_SIZE;
+    t->count = count;
+    t->built = 1;
+    img->ntracks = 1;
+    return 0;
+}
+
+disc_image_t *disc_image_open(const char *path) {
+    disc_image_t *img;
+    const char *ext;
+    int rv;
+
+    if(!(img = calloc(1, sizeof(disc_image_t))))
+        return NULL;
+
+    ext = strrchr(path, '.');
+
+    if(!strcmp(path, DISC_XA_PATH))
+        rv = build_xa(img);
+    else if(ext && !strcasecmp(ext, ".gdi"))
+        rv = load_gdi(img, path);
+    else
+        rv = load_iso(img, path);
+
+    if(rv < 0) {
+        disc_image_close(img);
+        return NULL;
+    }
+
+    return img;
+}
+
+void disc_image_close(disc_image_t *img) {
+    int i;
+
+    if(!img)
+        return;
+
+    for(i = 0; i < img->ntracks; i++) {
+        if(img->track[i].built)
+            free((void *)img->track[i].map);
+        else
+            munmap((void *)img->track[i].map, img->track[i].map_len);
+    }
+
+    free(img);
+}
+
+const disc_track_t *disc_image_track(const disc_image_t *img, uint32 lba) {
+    int lo = 0, hi = img->ntracks - 1, mid;
+    const disc_track_t *t;
+
+    /* Tracks are sorted by LBA; find the last one starting at or before
+       the sector and check it actually extends that far. */
+    while(lo < hi) {
+        mid = (lo + hi + 1) / 2;
+
+        if(img->track[mid].lba <= lba)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    t = img->track + lo;
+
+    if(lba < t->lba || lba >= t->lba + t->count)
+        return NULL;
+
+    return t;
+}
+
+const uint8 *disc_image_sector(const disc_image_t *img, uint32 lba,
+                               const disc_track_t **track) {
+    const disc_track_t *t;
+
+    if(!(t = disc_image_track(img, lba)))
+        return NULL;
+
+    if(track)
+        *track = t;
+
+    return t->map + (size_t)(lba - t->lba) * t->sector_size;
+}
+
+/* Where the user data of a stored data sector starts, or NULL if it holds
+   no 2048-byte user data. */
+static const uint8 *sector_data(const disc_track_t *t, const uint8 *s) {
+    if(t->ctrl != 4)
+        return NULL;
+
+    if(t->sector_size == DISC_DATA_SIZE)
+        return s;
+
+    switch(s[15]) {
+        case 1:
+            return s + 16;
+
+        case 2:
+            /* Mode 2: Form 1 only, per the submode byte */
+            if(s[18] & 0x20)
+                return NULL;
+
+            return s + 24;
+
+        default:
+            return NULL;
+    }
+}
+
+int disc_image_read_data(const disc_image_t *img, uint32 lba, int cnt,
+                         void *buf) {
+    uint8 *out = (uint8 *)buf;
+    const disc_track_t *t;
+    const uint8 *s, *d;
+
+    for(; cnt > 0; cnt--, lba++, out += DISC_DATA_SIZE) {
+        if(!(s = disc_image_sector(img, lba, &t)) || !(d = sector_data(t, s)))
+            return -1;
+
+        memcpy(out, d, DISC_DATA_SIZE);
+    }
+
+    return 0;
+}
+
+int disc_image_read_raw(const disc_image_t *img, uint32 lba, int cnt,
+                        void *buf) {
+    uint8 *out = (uint8 *)buf;
+    const disc_track_t *t;
+    const uint8 *s;
+    uint32 fad;
+
+    for(; cnt > 0; cnt--, lba++, out += DISC_RAW_SIZE) {
+        if(!(s = disc_image_sector(img, lba, &t)))
+            return -1;
+
+        if(t->sector_size == DISC_RAW_SIZE) {
+            memcpy(out, s, DISC_RAW_SIZE);
+            continue;
+        }
+
+        fad = lba + 150;
+        memset(out, 0, DISC_RAW_SIZE);
+        memcpy(out, sync_pattern, sizeof(sync_pattern));
+        out[12] = bcd(fad / (75 * 60));
+        out[13] = bcd((fad / 75) % 60);
+        out[14] = bcd(fad % 75);
+        out[15] = 1;
+        memcpy(out + 16, s, DISC_DATA_SIZE);
+    }
+
+    return 0;
+}
+
+uint32 disc_image_end(const disc_image_t *img) {
+    const disc_track_t *t = img->track + img->ntracks - 1;
+
+    return t->lba + t->count;
+}
@@ -0,0 +1,85 @@
+/* KallistiOS host shim
+
+   disc_image.h
+
+   Read-only disc image backend for the host GD-ROM stand-in. Understands
+   plain .iso files and .gdi track lists whose tracks are either 2048-byte
+   user data or 2352-byte raw frames (data or CDDA). Track files are mapped
+   into memory so serving a sector costs a memcpy and nothing else.
+
+   All sector numbers here are LBAs, i.e. FAD - 150, which is how .gdi files
+   count. The GD-ROM stand-in does the FAD conversion.
+
+*/
+
+#ifndef __HOST_DISC_IMAGE_H
+#define __HOST_DISC_IMAGE_H
+
+#include <arch/types.h>
+
+#define DISC_MAX_TRACKS     99
+
+/* Size of a raw CD frame and of Mode 1 / Mode 2 Form 1 user data */
+#define DISC_RAW_SIZE       2352
+#define DISC_DATA_SIZE      2048
+
+/* First LBA of the high density area of a GD-ROM */
+#define DISC_HD_LBA         45000
+
+typedef struct disc_track {
+    int         num;            /* Track number (1-99) */
+    uint32      lba;            /* First sector */
+    uint32      count;          /* Length in sectors */
+    int         ctrl;           /* TOC control nibble: 4 = data, 0 = audio */
+    int         sector_size;    /* Bytes per sector in the file: 2048/2352 */
+    const uint8 *map;           /* The mapped track file */
+    size_t      map_len;
+    int         built;          /* map is malloc'd, not a mapped file */
+} disc_track_t;
+
+typedef struct disc_image {
+    int             gdrom;      /* Nonzero for a .gdi */
+    int             ntracks;
+    disc_track_t    track[DISC_MAX_TRACKS];
+} disc_image_t;
+
+/* The path of a small XA disc built in memory rather than read from a
+   file: one Mode 2 track holding /MOVIE.XA, which interleaves two XA
+   files. File 1 carries video (Form 1) and audio (Form 2) on channel 1;
+   file 2 carries audio on channel 1 and ends halfway through, its last
+   sector marked end of file. Each sector's data is filled with its XA file
+   number plus its index within that file. */
+#define DISC_XA_PATH        "xa:"
+#define DISC_XA_SECTORS     64  /* Sectors of /MOVIE.XA */
+#define DISC_XA_FILE2       8   /* Of which belong to file 2 */
+
+/* Open a .iso or .gdi, picked by extension, or DISC_XA_PATH. Returns NULL
+   on failure. */
+disc_image_t *disc_image_open(const char *path);
+void disc_image_close(disc_image_t *img);
+
+/* Find the track holding a sector, or NULL if it isn't on the disc */
+const disc_track_t *disc_image_track(const disc_image_t *img, uint32 lba);
+
+/* Locate a sector's bytes in its track file. Returns a pointer to the
+   start of the stored sector (a raw frame for 2352-byte tracks) and sets
+   *track, or returns NULL if the sector isn't on the disc. */
+const uint8 *disc_image_sector(const disc_image_t *img, uint32 lba,
+                               const disc_track_t **track);
+
+/* Copy out user data from cnt data sectors starting at lba, 2048 bytes per
+   sector. Framing is stripped from raw tracks according to the mode byte
+   in each sector header (Mode 1 or Mode 2 Form 1). Fails on audio. */
+int disc_image_read_data(const disc_image_t *img, uint32 lba, int cnt,
+                         void *buf);
+
+/* Copy out cnt whole 2352-byte frames. Audio tracks come back as stored
+   (CDDA samples); 2048-byte data tracks get a Mode 1 sync and header
+   synthesized in front of the data, with EDC/ECC left zeroed. */
+int disc_image_read_raw(const disc_image_t *img, uint32 lba, int cnt,
+                        void *buf);
+
+/* One past the last sector of the disc */
+uint32 disc_image_end(const disc_image_t *img);
+
+#endif  /* __HOST_DISC_IMAGE_H */
@@ -0,0 +1,400 @@
+/* KallistiOS host shim
+
+   drive_model.c
+
+*/
+
+#include "drive_model.h"
+
+#include <kos/mutex.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#define GDROM_PARAMS { \
+    .cmd_overhead_us = 2000.0, \
+    .seek_settle_us = 3000.0, \
+    .seek_full_us = 150000.0, \
+    .rpm = 5000.0, \
+    .rate_outer = 900.0,            /* 12x, ~1.8MB/s of user data */ \
+    .r_inner = 25.0, \
+    .r_outer = 58.0, \
+    .lba_outer = 549000, \
+    .cpu_cmd_us = 40.0, \
+    .pio_rate = 12.0e6,             /* 16-bit reads off the G1 bus */ \
+    .inval_ns = 10.0 \
+}
+
+const drive_params_t drive_model_gdrom = GDROM_PARAMS;
+
+const drive_params_t drive_model_instant = {
+    .cmd_overhead_us = 0.0,
+    .seek_settle_us = 0.0,
+    .seek_full_us = 0.0,
+    .rpm = 0.0,
+    .rate_outer = 0.0,
+    .r_inner = 25.0,
+    .r_outer = 58.0,
+    .lba_outer = 549000,
+    .cpu_cmd_us = 0.0,
+    .pio_rate = 0.0,
+    .inval_ns = 0.0
+};
+
+static mutex_t model_mutex = MUTEX_INITIALIZER;
+static drive_params_t params = GDROM_PARAMS;
+static uint64 now_ns, epoch_ns;
+static uint32 head;
+static drive_stats_t stats;
+
+/* CDDA: [cdda_start, cdda_end) from cdda_t0 on, while cdda_on */
+static int cdda_on, cdda_repeat, gap_open;
+static uint32 cdda_start, cdda_end;
+static uint64 cdda_t0, gap_t0;
+
+static uint64 host_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* In realtime mode, spend the scaled cost of ns on the host clock */
+static void rt_sleep(uint64 ns) {
+    struct timespec ts;
+    uint64 host;
+
+    if(params.realtime <= 0.0 || !ns)
+        return;
+
+    host = (uint64)(ns * params.realtime);
+    ts.tv_sec = host / 1000000000ULL;
+    ts.tv_nsec = host % 1000000000ULL;
+
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+void drive_model_configure(const drive_params_t *p) {
+    mutex_lock(&model_mutex);
+    params = *p;
+    now_ns = 0;
+    epoch_ns = host_ns();
+    head = 0;
+    cdda_on = gap_open = 0;
+    memset(&stats, 0, sizeof(stats));
+    mutex_unlock(&model_mutex);
+}
+
+static const struct {
+    const char  *name;
+    size_t      offset;
+} fields[] = {
+    { "cmd_overhead_us", offsetof(drive_params_t, cmd_overhead_us) },
+    { "seek_settle_us", offsetof(drive_params_t, seek_settle_us) },
+    { "seek_full_us", offsetof(drive_params_t, seek_full_us) },
+    { "rpm", offsetof(drive_params_t, rpm) },
+    { "rate_outer", offsetof(drive_params_t, rate_outer) },
+    { "r_inner", offsetof(drive_params_t, r_inner) },
+    { "r_outer", offsetof(drive_params_t, r_outer) },
+    { "cpu_cmd_us", offsetof(drive_params_t, cpu_cmd_us) },
+    { "pio_rate", offsetof(drive_params_t, pio_rate) },
+    { "inval_ns", offsetof(drive_params_t, inval_ns) },
+    { "realtime", offsetof(drive_params_t, realtime) },
+};
+
+int drive_model_parse(const char *spec, drive_params_t *out) {
+    char buf[256], *tok, *save, *eq, *end;
+    size_t i;
+    double v;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    tok = strtok_r(buf, ",", &save);
+
+    if(!tok)
+        return -1;
+
+    if(!strcmp(tok, "gdrom"))
+        *out = drive_model_gdrom;
+    else if(!strcmp(tok, "instant"))
+        *out = drive_model_instant;
+    else
+        return -1;
+
+    while((tok = strtok_r(NULL, ",", &save))) {
+        if(!(eq = strchr(tok, '=')))
+            return -1;
+
+        *eq++ = '\0';
+        v = strtod(eq, &end);
+
+        if(*end)
+            return -1;
+
+        if(!strcmp(tok, "lba_outer")) {
+            out->lba_outer = (uint32)v;
+            continue;
+        }
+
+        for(i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            if(!strcmp(tok, fields[i].name)) {
+                *(double *)((char *)out + fields[i].offset) = v;
+                break;
+            }
+        }
+
+        if(i == sizeof(fields) / sizeof(fields[0]))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Radius of a sector on a constant linear density spiral */
+static double radius(uint32 lba) {
+    double k = (params.r_outer * params.r_outer -
+                params.r_inner * params.r_inner) / params.lba_outer;
+
+    if(lba > params.lba_outer)
+        lba = params.lba_outer;
+
+    return sqrt(params.r_inner * params.r_inner + k * lba);
+}
+
+/* CAV: the transfer rate scales with the radius */
+static double rate(uint32 lba) {
+    return params.rate_outer * radius(lba) / params.r_outer;
+}
+
+static uint64 us_to_ns(double us) {
+    return (uint64)(us * 1000.0 + 0.5);
+}
+
+/* The clock, with model_mutex held */
+static uint64 clock_ns(void) {
+    if(params.realtime > 0.0)
+        return (uint64)((host_ns() - epoch_ns) / params.realtime);
+
+    return now_ns;
+}
+
+/* Where CDDA has got to at time t. Returns 0 if it isn't playing, or has
+   played to its end. */
+static int cdda_at(uint64 t, uint32 *lba) {
+    uint64 e, len = cdda_end - cdda_start;
+
+    if(!cdda_on)
+        return 0;
+
+    e = t > cdda_t0 ? (t - cdda_t0) * 75 / 1000000000ULL : 0;
+
+    if(e >= len && cdda_repeat != 15 && e / len > (uint64)cdda_repeat) {
+        cdda_on = 0;
+        head = cdda_end;
+        return 0;
+    }
+
+    *lba = cdda_start + e % len;
+    return 1;
+}
+
+/* Time to get from the head to lba, ready to read it */
+static double position_us(uint32 lba, double r) {
+    double per_rev, dr, us = 0.0;
+    uint32 gap;
+
+    per_rev = params.rpm > 0.0 ? r * 60.0 / params.rpm : 0.0;
+    gap = lba - head;
+
+    if(lba == head) {
+        /* Picking up exactly where the last read stopped */
+    }
+    else if(lba > head && gap <= per_rev) {
+        /* Close enough ahead to just let the disc spin past */
+        us += gap * 1e6 / r;
+    }
+    else {
+        dr = fabs(radius(lba) - radius(head));
+        us += params.seek_settle_us + (params.seek_full_us -
+              params.seek_settle_us) * sqrt(dr / (params.r_outer -
+                                                  params.r_inner));
+
+        if(params.rpm > 0.0)
+            us += 30.0 * 1e6 / params.rpm;
+
+        stats.seeks++;
+        stats.seek_distance += lba > head ? lba - head : head - lba;
+    }
+
+    return us;
+}
+
+void drive_model_command(void) {
+    uint64 cost;
+
+    mutex_lock(&model_mutex);
+    cost = us_to_ns(params.cmd_overhead_us);
+    now_ns += cost;
+    stats.busy_ns += cost;
+    stats.cpu_ns += us_to_ns(params.cpu_cmd_us);
+    stats.commands++;
+    mutex_unlock(&model_mutex);
+
+    rt_sleep(cost);
+}
+
+void drive_model_read(uint32 lba, int cnt, int dma) {
+    double us, r, cpu;
+    uint32 at;
+    uint64 cost, t;
+
+    mutex_lock(&model_mutex);
+    us = params.cmd_overhead_us;
+
+    /* The read stops the music where it is */
+    t = clock_ns();
+
+    if(cdda_at(t, &at)) {
+        cdda_on = 0;
+        head = at;
+        stats.cdda_gaps++;
+        gap_open = 1;
+        gap_t0 = t;
+    }
+
+    if(params.rate_outer > 0.0) {
+        r = rate(lba);
+        us += position_us(lba, r);
+        us += cnt * 1e6 / r;
+    }
+
+    cpu = params.cpu_cmd_us;
+
+    if(!dma && params.pio_rate > 0.0)
+        cpu += cnt * 2048 * 1e6 / params.pio_rate;
+
+    cost = us_to_ns(us);
+    now_ns += cost;
+    head = lba + cnt;
+
+    stats.cpu_ns += us_to_ns(cpu);
+
+    stats.busy_ns += cost;
+    stats.commands++;
+    stats.reads++;
+    stats.sectors += cnt;
+
+    mutex_unlock(&model_mutex);
+
+    rt_sleep(cost);
+}
+
+void drive_model_cdda_play(uint32 lba, uint32 end, int repeat) {
+    uint64 cost, t;
+    double us;
+    uint32 at;
+
+    mutex_lock(&model_mutex);
+    t = clock_ns();
+
+    if(cdda_at(t, &at))
+        head = at;
+
+    us = params.cmd_overhead_us;
+
+    if(params.rate_outer > 0.0)
+        us += position_us(lba, rate(lba));
+
+    cost = us_to_ns(us);
+    now_ns += cost;
+    stats.busy_ns += cost;
+    stats.cpu_ns += us_to_ns(params.cpu_cmd_us);
+    stats.commands++;
+
+    cdda_on = end > lba;
+    cdda_start = lba;
+    cdda_end = end;
+    cdda_repeat = repeat;
+    cdda_t0 = t + cost;
+    head = lba;
+
+    if(gap_open) {
+        stats.cdda_gap_ns += cdda_t0 - gap_t0;
+        gap_open = 0;
+    }
+
+    mutex_unlock(&model_mutex);
+
+    rt_sleep(cost);
+}
+
+void drive_model_cdda_stop(void) {
+    uint32 at;
+
+    mutex_lock(&model_mutex);
+
+    if(cdda_at(clock_ns(), &at))
+        head = at;
+
+    cdda_on = gap_open = 0;
+    mutex_unlock(&model_mutex);
+
+    drive_model_command();
+}
+
+int drive_model_cdda_playing(uint32 *lba) {
+    uint32 at = 0;
+    int rv;
+
+    mutex_lock(&model_mutex);
+
+    if(!(rv = cdda_at(clock_ns(), &at)))
+        at = head;
+
+    mutex_unlock(&model_mutex);
+
+    if(lba)
+        *lba = at;
+
+    return rv;
+}
+
+void drive_model_inval(uint32 count) {
+    mutex_lock(&model_mutex);
+    stats.cpu_ns += us_to_ns(((count + 31) / 32) * params.inval_ns / 1000.0);
+    mutex_unlock(&model_mutex);
+}
+
+void drive_model_advance(uint64 ns) {
+    mutex_lock(&model_mutex);
+    now_ns += ns;
+    mutex_unlock(&model_mutex);
+
+    rt_sleep(ns);
+}
+
+uint64 drive_model_now(void) {
+    uint64 rv;
+
+    mutex_lock(&model_mutex);
+    rv = clock_ns();
+    mutex_unlock(&model_mutex);
+
+    return rv;
+}
+
+void drive_model_stats(drive_stats_t *out) {
+    mutex_lock(&model_mutex);
+    *out = stats;
+    mutex_unlock(&model_mutex);
+}
+
+void drive_model_reset_stats(void) {
+    mutex_lock(&model_mutex);
+    memset(&stats, 0, sizeof(stats));
+    mutex_unlock(&model_mutex);
+}
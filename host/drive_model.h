@@ -0,0 +1,117 @@
+/* KallistiOS host shim
+
+   drive_model.h
+
+   A simple, deterministic timing model of the GD-ROM drive. Every command
+   the stand-in executes is charged against a virtual clock:
+
+     command overhead   gdc_req_cmd + gdc_exec_server polling and the drive
+                        firmware's own turnaround, per command
+     seek               a fixed settle time plus a term growing with the
+                        square root of the radial distance travelled
+     rotation           half a revolution on average after a seek; nothing
+                        when a read continues where the last one stopped,
+                        and the time to spin past the gap for a short skip
+                        forward
+     transfer           the CAV rate at the sector's radius, so the outer
+                        edge of the disc reads faster than the inner
+
+   Separately from the drive's clock, the model keeps a tally of SH4 time
+   the commands cost the caller: a fixed amount to issue and poll each one,
+   the copy of every byte off the G1 bus for a PIO read, and the operand
+   cache invalidation that goes with a DMA read. The drive runs while the
+   CPU does this, so none of it moves the clock.
+
+   The radius of a sector follows from a constant linear density spiral
+   between r_inner and r_outer. Nothing in the model is random; the same
+   sequence of commands always produces the same clock.
+
+   That clock is shared by every thread and simply adds up, which can't
+   show one thread's reads overlapping another's work. With realtime set
+   to a scale factor (0.05 runs the drive 20 times faster than life) each
+   command instead sleeps for its scaled cost while holding the drive, and
+   the clock is the host's elapsed time divided by the scale. Results then
+   depend on the host's scheduler, but background I/O overlaps the way it
+   would on the console.
+
+   CDDA plays at 75 sectors a second from wherever the play command put
+   the head. A read while it plays stops it: that's a gap in the music,
+   lasting until the next play command has got the head back and started
+   again, and the model counts them.
+
+*/
+
+#ifndef __HOST_DRIVE_MODEL_H
+#define __HOST_DRIVE_MODEL_H
+
+#include <arch/types.h>
+
+typedef struct drive_params {
+    double  cmd_overhead_us;    /* Per-command cost */
+    double  seek_settle_us;     /* Fixed cost of any seek */
+    double  seek_full_us;       /* Inner to outer edge seek */
+    double  rpm;                /* Spindle speed (CAV) */
+    double  rate_outer;         /* Sectors per second at r_outer */
+    double  r_inner, r_outer;   /* Program area radii in mm */
+    uint32  lba_outer;          /* LBA sitting at r_outer */
+    double  cpu_cmd_us;         /* CPU time to issue and poll a command */
+    double  pio_rate;           /* Bytes per second the CPU copies in PIO */
+    double  inval_ns;           /* CPU time per 32-byte line invalidated */
+    double  realtime;           /* Host seconds per simulated second, or 0
+                                   for a purely virtual clock */
+} drive_params_t;
+
+/* Approximates the Dreamcast's 12x CAV GD-ROM */
+extern const drive_params_t drive_model_gdrom;
+
+/* Zero cost everywhere: the clock only counts commands */
+extern const drive_params_t drive_model_instant;
+
+typedef struct drive_stats {
+    uint64  commands;       /* Commands executed */
+    uint64  reads;          /* ...of which were sector reads */
+    uint64  sectors;        /* Sectors transferred */
+    uint64  seeks;          /* Reads that had to move the head */
+    uint64  seek_distance;  /* Sum of |target - head| in sectors */
+    uint64  busy_ns;        /* Time the drive spent on commands */
+    uint64  cpu_ns;         /* CPU time the commands cost the caller */
+    uint64  cdda_gaps;      /* Times a read stopped CDDA playing */
+    uint64  cdda_gap_ns;    /* Silence from those until CDDA played again */
+} drive_stats_t;
+
+/* Replace the parameters. Also resets the clock, head and statistics. */
+void drive_model_configure(const drive_params_t *params);
+
+/* Parse "preset[,key=value...]" where preset is gdrom or instant and keys
+   are the drive_params_t field names. Returns 0 on success. */
+int drive_model_parse(const char *spec, drive_params_t *out);
+
+/* Charge a non-read command (TOC, init, ...) */
+void drive_model_command(void);
+
+/* Charge a read of cnt sectors starting at lba, by DMA or PIO */
+void drive_model_read(uint32 lba, int cnt, int dma);
+
+/* Start CDDA at lba, up to end, repeat more times (15 for ever) */
+void drive_model_cdda_play(uint32 lba, uint32 end, int repeat);
+
+/* Stop CDDA, not counting a gap */
+void drive_model_cdda_stop(void);
+
+/* Whether CDDA is playing, and the LBA it's at (or the head, if not) */
+int drive_model_cdda_playing(uint32 *lba);
+
+/* Charge CPU time spent invalidating count bytes of operand cache */
+void drive_model_inval(uint32 count);
+
+/* Advance the clock without using the drive (application think time). In
+   realtime mode this sleeps the calling thread for the scaled time. */
+void drive_model_advance(uint64 ns);
+
+/* Current virtual time in nanoseconds */
+uint64 drive_model_now(void);
+
+void drive_model_stats(drive_stats_t *out);
+void drive_model_reset_stats(void);
+
+#endif  /* __HOST_DRIVE_MODEL_H */
@@ -0,0 +1,60 @@
+/* KallistiOS host shim
+
+   harness.c
+
+*/
+
+#include "harness.h"
+#include "drive_model.h"
+
+#include <dc/cdrom.h>
+#include <dc/vblank.h>
+#include <dc/fs_iso9660.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+vfs_handler_t *harness_mount(const char *image) {
+    nmmgr_handler_t *nm;
+    drive_params_t dp;
+    const char *model;
+
+    /* GDROM_MODEL picks the drive timing, e.g. "gdrom,rpm=4000" */
+    if((model = getenv("GDROM_MODEL"))) {
+        if(drive_model_parse(model, &dp)) {
+            fprintf(stderr, "harness: bad GDROM_MODEL \"%s\"\n", model);
+            return NULL;
+        }
+
+        drive_model_configure(&dp);
+    }
+
+    if(cdrom_host_insert(image)) {
+        fprintf(stderr, "harness: can't load disc image %s\n", image);
+        return NULL;
+    }
+
+    cdrom_init();
+
+    if(fs_iso9660_init()) {
+        fprintf(stderr, "harness: fs_iso9660_init failed\n");
+        return NULL;
+    }
+
+    /* Let the driver's vblank handler see the disc (and its type) once,
+       the way it would shortly after boot. */
+    vblank_host_tick();
+
+    if(!(nm = nmmgr_lookup("/cd"))) {
+        fprintf(stderr, "harness: /cd is not registered\n");
+        return NULL;
+    }
+
+    return (vfs_handler_t *)((char *)nm - offsetof(vfs_handler_t, nmmgr));
+}
+
+void harness_unmount(void) {
+    fs_iso9660_shutdown();
+    cdrom_shutdown();
+}
@@ -0,0 +1,22 @@
+/* KallistiOS host shim
+
+   harness.h
+
+   Shared setup for the host programs: insert an image, bring up the /cd
+   driver and hand back its VFS handler.
+
+*/
+
+#ifndef __HOST_HARNESS_H
+#define __HOST_HARNESS_H
+
+#include <kos/fs.h>
+
+/* Insert the image, start cdrom and fs_iso9660, and return the /cd
+   handler. Returns NULL (after printing why) on failure. */
+vfs_handler_t *harness_mount(const char *image);
+
+/* Shut fs_iso9660 down and eject the image */
+void harness_unmount(void);
+
+#endif  /* __HOST_HARNESS_H */
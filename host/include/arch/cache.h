@@ -0,0 +1,19 @@
+/* KallistiOS host shim
+
+   arch/cache.h
+
+   Host memory is coherent, so there is nothing to flush or invalidate;
+   the calls only charge the drive model for the CPU time they would take
+   on the SH4.
+
+*/
+
+#ifndef __ARCH_CACHE_H
+#define __ARCH_CACHE_H
+
+#include <arch/types.h>
+
+void dcache_inval_range(uint32 start, uint32 count);
+void dcache_flush_range(uint32 start, uint32 count);
+
+#endif  /* __ARCH_CACHE_H */
@@ -0,0 +1,35 @@
+/* KallistiOS host shim
+
+   arch/types.h
+
+   Just enough of the KOS basic types to build the /cd driver on a Linux
+   host. The driver assumes a 32-bit address space in a few places; see
+   kos_shim.c for how the host keeps the heap low enough for that to hold.
+
+*/
+
+#ifndef __ARCH_TYPES_H
+#define __ARCH_TYPES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef uint64_t uint64;
+typedef uint32_t uint32;
+typedef uint16_t uint16;
+typedef uint8_t uint8;
+
+typedef int64_t int64;
+typedef int32_t int32;
+typedef int16_t int16;
+typedef int8_t int8;
+
+typedef volatile uint64 vuint64;
+typedef volatile uint32 vuint32;
+typedef volatile uint16 vuint16;
+typedef volatile uint8 vuint8;
+
+typedef uintptr_t ptr_t;
+
+#endif  /* __ARCH_TYPES_H */
@@ -0,0 +1,125 @@
+/* KallistiOS host shim
+
+   dc/cdrom.h
+
+   Same constants and entry points as the kernel header. On the host these
+   are implemented by cdrom_host.c, which serves sectors out of a disc image
+   instead of the GD-ROM BIOS.
+
+*/
+
+#ifndef __DC_CDROM_H
+#define __DC_CDROM_H
+
+#include <arch/types.h>
+
+/* Command codes */
+#define CMD_PIOREAD     16
+#define CMD_DMAREAD     17
+#define CMD_GETTOC      18
+#define CMD_GETTOC2     19
+#define CMD_PLAY        20
+#define CMD_PLAY2       21
+#define CMD_PAUSE       22
+#define CMD_RELEASE     23
+#define CMD_INIT        24
+#define CMD_SEEK        27
+#define CMD_READ        28
+#define CMD_STOP        33
+#define CMD_GETSCD      34
+#define CMD_GETSES      35
+
+/* Command responses */
+#define ERR_OK          0
+#define ERR_NO_DISC     1
+#define ERR_DISC_CHG    2
+#define ERR_SYS         3
+#define ERR_ABORTED     4
+#define ERR_NO_ACTIVE   5
+
+/* Command Status responses */
+#define FAILED          -1
+#define NO_ACTIVE       0
+#define PROCESSING      1
+#define COMPLETED       2
+#define ABORTED         3
+
+/* CDDA Read Modes */
+#define CDDA_TRACKS     1
+#define CDDA_SECTORS    2
+
+/* cdrom_get_subcode() formats */
+#define CD_SUB_Q_ALL        0
+#define CD_SUB_Q_CHANNEL    1
+#define CD_SUB_MEDIA_CATALOG 2
+#define CD_SUB_TRACK_ISRC   3
+#define CD_SUB_RESERVED     4
+
+/* Status values */
+#define CD_STATUS_READ_FAIL -1
+#define CD_STATUS_BUSY      0
+#define CD_STATUS_PAUSED    1
+#define CD_STATUS_STANDBY   2
+#define CD_STATUS_PLAYING   3
+#define CD_STATUS_SEEKING   4
+#define CD_STATUS_SCANNING  5
+#define CD_STATUS_OPEN      6
+#define CD_STATUS_NO_DISC   7
+#define CD_STATUS_RETRY     8
+#define CD_STATUS_ERROR     9
+#define CD_STATUS_FATAL     12
+
+/* Disc types */
+#define CD_CDDA     0x00
+#define CD_CDROM    0x10
+#define CD_CDROM_XA 0x20
+#define CD_CDI      0x30
+#define CD_GDROM    0x80
+#define CD_FAIL     0xf0
+
+/* Sector parts */
+#define CDROM_READ_WHOLE_SECTOR 0x1000
+#define CDROM_READ_DATA_AREA    0x2000
+
+/* Read modes */
+#define CDROM_READ_PIO  0
+#define CDROM_READ_DMA  1
+
+/* TOC structure returned by the BIOS */
+typedef struct {
+    uint32  entry[99];
+    uint32  first, last;
+    uint32  leadout_sector;
+} CDROM_TOC;
+
+#define TOC_LBA(n) ((n) & 0x00ffffff)
+#define TOC_ADR(n) ( ((n) & 0x0f000000) >> 24 )
+#define TOC_CTRL(n) ( ((n) & 0xf0000000) >> 28 )
+#define TOC_TRACK(n) ( ((n) & 0x00ff0000) >> 16 )
+
+int cdrom_set_sector_size(int size);
+int cdrom_exec_cmd(int cmd, void *param);
+int cdrom_submit_cmd(int cmd, void *param);
+int cdrom_poll_cmd(int id, int *rv);
+int cdrom_wait_cmd(int id);
+int cdrom_get_status(int *status, int *disc_type);
+int cdrom_change_dataype(int sector_part, int cdxa, int sector_size);
+int cdrom_reinit(void);
+int cdrom_reinit_ex(int sector_part, int cdxa, int sector_size);
+int cdrom_read_toc(CDROM_TOC *toc_buffer, int session);
+int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode);
+int cdrom_read_sectors(void *buffer, int sector, int cnt);
+int cdrom_get_subcode(void *buffer, int buflen, int which);
+uint32 cdrom_locate_data_track(CDROM_TOC *toc);
+int cdrom_cdda_play(uint32 start, uint32 end, uint32 repeat, int mode);
+int cdrom_cdda_pause(void);
+int cdrom_cdda_resume(void);
+int cdrom_spin_down(void);
+int cdrom_init(void);
+void cdrom_shutdown(void);
+
+/* Host only: insert a disc image (.iso or .gdi). Passing NULL ejects the
+   current one. Returns 0 on success. */
+int cdrom_host_insert(const char *path);
+
+#endif  /* __DC_CDROM_H */
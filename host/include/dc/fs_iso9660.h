@@ -0,0 +1,10 @@
+/* KallistiOS host shim
+
+   dc/fs_iso9660.h
+
+   The driver's public header ships at the top of the tree, ready to drop
+   into kernel/arch/dreamcast/include/dc/.
+
+*/
+
+#include "../../../fs_iso9660.h"
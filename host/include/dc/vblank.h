@@ -0,0 +1,23 @@
+/* KallistiOS host shim
+
+   dc/vblank.h
+
+   There is no vertical blank on the host; registered handlers only run
+   when the harness calls vblank_host_tick().
+
+*/
+
+#ifndef __DC_VBLANK_H
+#define __DC_VBLANK_H
+
+#include <arch/types.h>
+
+typedef void (*asic_evt_handler)(uint32 code);
+
+int vblank_handler_add(asic_evt_handler hnd);
+int vblank_handler_remove(int handle);
+
+/* Host only: run every registered handler once */
+void vblank_host_tick(void);
+
+#endif  /* __DC_VBLANK_H */
@@ -0,0 +1,27 @@
+/* KallistiOS host shim
+
+   kos/cond.h
+
+   KOS condition variables on top of pthreads.
+
+*/
+
+#ifndef __KOS_COND_H
+#define __KOS_COND_H
+
+#include <kos/mutex.h>
+
+typedef struct kos_condvar {
+    pthread_cond_t  c;
+} condvar_t;
+
+#define COND_INITIALIZER { PTHREAD_COND_INITIALIZER }
+
+int cond_init(condvar_t *cv);
+int cond_destroy(condvar_t *cv);
+int cond_wait(condvar_t *cv, mutex_t *m);
+int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout);
+int cond_signal(condvar_t *cv);
+int cond_broadcast(condvar_t *cv);
+
+#endif  /* __KOS_COND_H */
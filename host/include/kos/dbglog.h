@@ -0,0 +1,25 @@
+/* KallistiOS host shim
+
+   kos/dbglog.h
+
+*/
+
+#ifndef __KOS_DBGLOG_H
+#define __KOS_DBGLOG_H
+
+#define DBG_DEAD        0
+#define DBG_CRITICAL    1
+#define DBG_ERROR       2
+#define DBG_WARNING     3
+#define DBG_NOTICE      4
+#define DBG_INFO        5
+#define DBG_DEBUG       6
+#define DBG_KDEBUG      7
+
+/* Messages above the current level are dropped. The host default is
+   DBG_WARNING so benchmarks aren't drowned in disc change notices. */
+void dbglog(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void dbglog_set_level(int level);
+
+#endif  /* __KOS_DBGLOG_H */
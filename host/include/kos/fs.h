@@ -0,0 +1,78 @@
+/* KallistiOS host shim
+
+   kos/fs.h
+
+   The VFS handler layout matches the kernel's so the driver's `vh`
+   initializer compiles as-is.
+
+*/
+
+#ifndef __KOS_FS_H
+#define __KOS_FS_H
+
+#include <arch/types.h>
+#include <kos/nmmgr.h>
+#include <kos/dbglog.h>
+
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+typedef int file_t;
+
+#define FILEHND_INVALID ((file_t)-1)
+
+typedef struct kos_dirent {
+    int     size;
+    char    name[NAME_MAX];
+    time_t  time;
+    uint32  attr;
+} dirent_t;
+
+/* KOS open mode bits; O_DIR is placed well clear of the host's flags */
+#define O_MODE_MASK     0x0f
+#define O_DIR           0x10000000
+#define O_META          0x20000000
+
+typedef int64 _off64_t;
+
+typedef struct vfs_handler {
+    nmmgr_handler_t nmmgr;
+
+    int     cache;
+    void    *privdata;
+
+    void *(*open)(struct vfs_handler *vfs, const char *fn, int mode);
+    int (*close)(void *hnd);
+    ssize_t (*read)(void *hnd, void *buffer, size_t cnt);
+    ssize_t (*write)(void *hnd, const void *buffer, size_t cnt);
+    off_t (*seek)(void *hnd, off_t offset, int whence);
+    off_t (*tell)(void *hnd);
+    size_t (*total)(void *hnd);
+    dirent_t *(*readdir)(void *hnd);
+    int (*ioctl)(void *hnd, int cmd, va_list ap);
+    int (*rename)(struct vfs_handler *vfs, const char *fn1, const char *fn2);
+    int (*unlink)(struct vfs_handler *vfs, const char *fn);
+    void *(*mmap)(void *hnd);
+    int (*complete)(void *hnd, ssize_t *rv);
+    int (*stat)(struct vfs_handler *vfs, const char *path, struct stat *buf,
+                int flag);
+    int (*mkdir)(struct vfs_handler *vfs, const char *fn);
+    int (*rmdir)(struct vfs_handler *vfs, const char *fn);
+    int (*fcntl)(void *hnd, int cmd, va_list ap);
+    short (*poll)(void *hnd, short events);
+    int (*link)(struct vfs_handler *vfs, const char *path1, const char *path2);
+    int (*symlink)(struct vfs_handler *vfs, const char *path1,
+                   const char *path2);
+    _off64_t (*seek64)(void *hnd, _off64_t offset, int whence);
+    _off64_t (*tell64)(void *hnd);
+    _off64_t (*total64)(void *hnd);
+    ssize_t (*readlink)(struct vfs_handler *vfs, const char *path, char *buf,
+                        size_t bufsize);
+    int (*rewinddir)(void *hnd);
+    int (*fstat)(void *hnd, struct stat *st);
+} vfs_handler_t;
+
+#endif  /* __KOS_FS_H */
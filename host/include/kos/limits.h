@@ -0,0 +1,14 @@
+/* KallistiOS host shim
+
+   kos/limits.h
+
+*/
+
+#ifndef __KOS_LIMITS_H
+#define __KOS_LIMITS_H
+
+#include <limits.h>
+
+#define MAX_FN_LEN  NAME_MAX
+
+#endif  /* __KOS_LIMITS_H */
@@ -0,0 +1,40 @@
+/* KallistiOS host shim
+
+   kos/mutex.h
+
+   KOS mutexes on top of pthreads. The lock count is tracked alongside the
+   pthread mutex so mutex_is_locked() behaves like the kernel version.
+
+*/
+
+#ifndef __KOS_MUTEX_H
+#define __KOS_MUTEX_H
+
+#include <pthread.h>
+
+typedef struct kos_mutex {
+    pthread_mutex_t m;
+    int             type;
+    volatile int    count;
+} mutex_t;
+
+#define MUTEX_TYPE_NORMAL       1
+#define MUTEX_TYPE_ERRORCHECK   2
+#define MUTEX_TYPE_RECURSIVE    3
+#define MUTEX_TYPE_DEFAULT      MUTEX_TYPE_NORMAL
+
+#define MUTEX_INITIALIZER \
+    { PTHREAD_MUTEX_INITIALIZER, MUTEX_TYPE_NORMAL, 0 }
+#define ERRORCHECK_MUTEX_INITIALIZER \
+    { PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP, MUTEX_TYPE_ERRORCHECK, 0 }
+#define RECURSIVE_MUTEX_INITIALIZER \
+    { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP, MUTEX_TYPE_RECURSIVE, 0 }
+
+int mutex_init(mutex_t *m, int mtype);
+int mutex_destroy(mutex_t *m);
+int mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+int mutex_unlock(mutex_t *m);
+int mutex_is_locked(mutex_t *m);
+
+#endif  /* __KOS_MUTEX_H */
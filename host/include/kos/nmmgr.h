@@ -0,0 +1,38 @@
+/* KallistiOS host shim
+
+   kos/nmmgr.h
+
+*/
+
+#ifndef __KOS_NMMGR_H
+#define __KOS_NMMGR_H
+
+#include <arch/types.h>
+#include <limits.h>
+
+struct nmmgr_handler;
+
+#define NMMGR_LIST_INIT { NULL, NULL }
+
+typedef struct nmmgr_handler {
+    char    pathname[NAME_MAX];     /* Path name */
+    int     pid;                    /* Process table ID for handler */
+    uint32  version;                /* Version code */
+    uint32  flags;                  /* Bitmask of flags */
+    uint32  type;                   /* Type of handler */
+    struct {
+        struct nmmgr_handler *le_next;
+        struct nmmgr_handler **le_prev;
+    } list_ent;
+} nmmgr_handler_t;
+
+#define NMMGR_TYPE_UNKNOWN  0x0000
+#define NMMGR_TYPE_VFS      0x0010
+
+/* Look up a handler by name; the longest matching prefix wins. */
+nmmgr_handler_t *nmmgr_lookup(const char *name);
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd);
+int nmmgr_handler_remove(nmmgr_handler_t *hnd);
+
+#endif  /* __KOS_NMMGR_H */
@@ -0,0 +1,16 @@
+/* KallistiOS host shim
+
+   kos/opts.h
+
+*/
+
+#ifndef __KOS_OPTS_H
+#define __KOS_OPTS_H
+
+/* The maximum number of files that can be open at once on the /cd
+   filesystem. */
+#ifndef FS_CD_MAX_FILES
+#define FS_CD_MAX_FILES 8
+#endif
+
+#endif  /* __KOS_OPTS_H */
@@ -0,0 +1,38 @@
+/* KallistiOS host shim
+
+   kos/sem.h
+
+   KOS counting semaphores on top of a shim mutex and condvar. The names
+   are remapped so they can't collide with the host's POSIX sem_* calls.
+
+*/
+
+#ifndef __KOS_SEM_H
+#define __KOS_SEM_H
+
+#include <kos/cond.h>
+
+typedef struct kos_semaphore {
+    mutex_t     m;
+    condvar_t   c;
+    int         count;
+} semaphore_t;
+
+#define SEM_INITIALIZER(value) \
+    { MUTEX_INITIALIZER, COND_INITIALIZER, (value) }
+
+#define sem_init        kos_sem_init
+#define sem_destroy     kos_sem_destroy
+#define sem_wait        kos_sem_wait
+#define sem_trywait     kos_sem_trywait
+#define sem_signal      kos_sem_signal
+#define sem_count       kos_sem_count
+
+int sem_init(semaphore_t *sm, int count);
+int sem_destroy(semaphore_t *sm);
+int sem_wait(semaphore_t *sm);
+int sem_trywait(semaphore_t *sm);
+int sem_signal(semaphore_t *sm);
+int sem_count(semaphore_t *sm);
+
+#endif  /* __KOS_SEM_H */
@@ -0,0 +1,30 @@
+/* KallistiOS host shim
+
+   kos/thread.h
+
+*/
+
+#ifndef __KOS_THREAD_H
+#define __KOS_THREAD_H
+
+#include <arch/types.h>
+#include <kos/dbglog.h>
+
+/* Only the handle is needed; the host thread lives in the shim */
+typedef struct kthread kthread_t;
+
+/* Start a thread running routine(param); detached threads can't be
+   joined */
+kthread_t *thd_create(int detach, void *(*routine)(void *param),
+                      void *param);
+
+/* Wait for a thread to finish and collect its return value */
+int thd_join(kthread_t *thd, void **value_ptr);
+
+/* Yield the rest of this timeslice */
+void thd_pass(void);
+
+/* Sleep for the given number of milliseconds */
+void thd_sleep(int ms);
+
+#endif  /* __KOS_THREAD_H */
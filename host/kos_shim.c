@@ -0,0 +1,418 @@
+/* KallistiOS host shim
+
+   kos_shim.c
+
+   The handful of kernel services fs_iso9660.c uses, implemented on top of
+   pthreads and libc so the driver can be built and exercised on a Linux
+   host.
+
+   The driver was written for the SH4's 32-bit address space and masks
+   buffer addresses with 0x0FFFFFFF before handing them to the DMA read
+   path. To keep that valid here the harness links non-PIE, forces malloc
+   to stay on the brk heap and turns off heap randomization, so every
+   buffer lives in the low 256MB just like main RAM does on the Dreamcast.
+
+*/
+
+#include "drive_model.h"
+
+#include <kos/thread.h>
+#include <kos/mutex.h>
+#include <kos/cond.h>
+#include <kos/sem.h>
+#include <kos/fs.h>
+#include <dc/vblank.h>
+#include <arch/cache.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/personality.h>
+
+/********************************************************************************/
+/* Address space setup */
+
+__attribute__((constructor))
+static void host_heap_init(int argc, char *argv[], char *envp[]) {
+    int pers;
+
+    (void)argc;
+
+    /* One arena on the brk heap, never mmap: keeps every allocation, from
+       every thread, next to the (non-PIE) program image. */
+    mallopt(M_ARENA_MAX, 1);
+    mallopt(M_MMAP_MAX, 0);
+
+    if((uintptr_t)sbrk(0) < 0x08000000)
+        return;
+
+    /* The kernel put the heap somewhere random and high. Run ourselves
+       again without address space randomization, which puts it right
+       after the program's bss. */
+    pers = personality(0xffffffff);
+
+    if(pers != -1 && !(pers & ADDR_NO_RANDOMIZE) &&
+       personality(pers | ADDR_NO_RANDOMIZE) != -1)
+        execve("/proc/self/exe", argv, envp);
+
+    fprintf(stderr, "kos_shim: heap starts at %p, which is too high for "
+            "the driver's 32-bit buffer handling\n", sbrk(0));
+    abort();
+}
+
+/********************************************************************************/
+/* Debug log */
+
+static int dbglog_level = DBG_WARNING;
+
+void dbglog_set_level(int level) {
+    dbglog_level = level;
+}
+
+void dbglog(int level, const char *fmt, ...) {
+    va_list args;
+
+    if(level > dbglog_level)
+        return;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+/********************************************************************************/
+/* Threads and mutexes */
+
+void thd_pass(void) {
+    sched_yield();
+}
+
+void thd_sleep(int ms) {
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+
+    while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+struct kthread {
+    pthread_t   thd;
+};
+
+kthread_t *thd_create(int detach, void *(*routine)(void *param),
+                      void *param) {
+    kthread_t *t = malloc(sizeof(kthread_t));
+
+    if(!t)
+        return NULL;
+
+    if(pthread_create(&t->thd, NULL, routine, param)) {
+        free(t);
+        return NULL;
+    }
+
+    if(detach) {
+        pthread_detach(t->thd);
+        free(t);
+    }
+
+    return t;
+}
+
+int thd_join(kthread_t *thd, void **value_ptr) {
+    if(!thd || pthread_join(thd->thd, value_ptr))
+        return -1;
+
+    free(thd);
+    return 0;
+}
+
+int mutex_init(mutex_t *m, int mtype) {
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+
+    switch(mtype) {
+        case MUTEX_TYPE_NORMAL:
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+            break;
+
+        case MUTEX_TYPE_ERRORCHECK:
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+            break;
+
+        case MUTEX_TYPE_RECURSIVE:
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+            break;
+
+        default:
+            pthread_mutexattr_destroy(&attr);
+            errno = EINVAL;
+            return -1;
+    }
+
+    pthread_mutex_init(&m->m, &attr);
+    pthread_mutexattr_destroy(&attr);
+    m->type = mtype;
+    m->count = 0;
+
+    return 0;
+}
+
+int mutex_destroy(mutex_t *m) {
+    if(pthread_mutex_destroy(&m->m)) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mutex_lock(mutex_t *m) {
+    int rv;
+
+    if((rv = pthread_mutex_lock(&m->m))) {
+        errno = rv;
+        return -1;
+    }
+
+    ++m->count;
+    return 0;
+}
+
+int mutex_trylock(mutex_t *m) {
+    if(pthread_mutex_trylock(&m->m)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ++m->count;
+    return 0;
+}
+
+int mutex_unlock(mutex_t *m) {
+    --m->count;
+    return pthread_mutex_unlock(&m->m) ? -1 : 0;
+}
+
+int mutex_is_locked(mutex_t *m) {
+    return m->count > 0;
+}
+
+int cond_init(condvar_t *cv) {
+    return pthread_cond_init(&cv->c, NULL) ? -1 : 0;
+}
+
+int cond_destroy(condvar_t *cv) {
+    return pthread_cond_destroy(&cv->c) ? -1 : 0;
+}
+
+int cond_wait(condvar_t *cv, mutex_t *m) {
+    int rv;
+
+    --m->count;
+    rv = pthread_cond_wait(&cv->c, &m->m);
+    ++m->count;
+
+    return rv ? -1 : 0;
+}
+
+int cond_wait_timed(condvar_t *cv, mutex_t *m, int timeout) {
+    struct timespec ts;
+    int rv;
+
+    if(!timeout)
+        return cond_wait(cv, m);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout / 1000;
+    ts.tv_nsec += (timeout % 1000) * 1000000L;
+
+    if(ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    --m->count;
+    rv = pthread_cond_timedwait(&cv->c, &m->m, &ts);
+    ++m->count;
+
+    if(rv == ETIMEDOUT) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return rv ? -1 : 0;
+}
+
+int cond_signal(condvar_t *cv) {
+    return pthread_cond_signal(&cv->c) ? -1 : 0;
+}
+
+int cond_broadcast(condvar_t *cv) {
+    return pthread_cond_broadcast(&cv->c) ? -1 : 0;
+}
+
+int sem_init(semaphore_t *sm, int count) {
+    if(count < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mutex_init(&sm->m, MUTEX_TYPE_NORMAL);
+    cond_init(&sm->c);
+    sm->count = count;
+    return 0;
+}
+
+int sem_destroy(semaphore_t *sm) {
+    cond_destroy(&sm->c);
+    return mutex_destroy(&sm->m);
+}
+
+int sem_wait(semaphore_t *sm) {
+    mutex_lock(&sm->m);
+
+    while(sm->count <= 0)
+        cond_wait(&sm->c, &sm->m);
+
+    sm->count--;
+    mutex_unlock(&sm->m);
+    return 0;
+}
+
+int sem_trywait(semaphore_t *sm) {
+    int rv = 0;
+
+    mutex_lock(&sm->m);
+
+    if(sm->count > 0) {
+        sm->count--;
+    }
+    else {
+        errno = EWOULDBLOCK;
+        rv = -1;
+    }
+
+    mutex_unlock(&sm->m);
+    return rv;
+}
+
+int sem_signal(semaphore_t *sm) {
+    mutex_lock(&sm->m);
+    sm->count++;
+    cond_signal(&sm->c);
+    mutex_unlock(&sm->m);
+    return 0;
+}
+
+int sem_count(semaphore_t *sm) {
+    return sm->count;
+}
+
+/********************************************************************************/
+/* Cache maintenance */
+
+void dcache_inval_range(uint32 start, uint32 count) {
+    drive_model_inval(count + (start & 31));
+}
+
+void dcache_flush_range(uint32 start, uint32 count) {
+    drive_model_inval(count + (start & 31));
+}
+
+/********************************************************************************/
+/* Vertical blank */
+
+#define VBL_MAX_HANDLERS 8
+static asic_evt_handler vbl_handlers[VBL_MAX_HANDLERS];
+
+int vblank_handler_add(asic_evt_handler hnd) {
+    int i;
+
+    for(i = 0; i < VBL_MAX_HANDLERS; i++) {
+        if(!vbl_handlers[i]) {
+            vbl_handlers[i] = hnd;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+int vblank_handler_remove(int handle) {
+    if(handle < 0 || handle >= VBL_MAX_HANDLERS || !vbl_handlers[handle])
+        return -1;
+
+    vbl_handlers[handle] = NULL;
+    return 0;
+}
+
+void vblank_host_tick(void) {
+    int i;
+
+    for(i = 0; i < VBL_MAX_HANDLERS; i++) {
+        if(vbl_handlers[i])
+            vbl_handlers[i](0);
+    }
+}
+
+/********************************************************************************/
+/* Name manager */
+
+#define NMMGR_MAX_HANDLERS 8
+static nmmgr_handler_t *nmmgr_handlers[NMMGR_MAX_HANDLERS];
+
+nmmgr_handler_t *nmmgr_lookup(const char *name) {
+    nmmgr_handler_t *best = NULL;
+    size_t bestlen = 0, len;
+    int i;
+
+    for(i = 0; i < NMMGR_MAX_HANDLERS; i++) {
+        if(!nmmgr_handlers[i])
+            continue;
+
+        len = strlen(nmmgr_handlers[i]->pathname);
+
+        if(len > bestlen && !strncmp(name, nmmgr_handlers[i]->pathname, len)
+           && (name[len] == '/' || name[len] == '\0')) {
+            best = nmmgr_handlers[i];
+            bestlen = len;
+        }
+    }
+
+    return best;
+}
+
+int nmmgr_handler_add(nmmgr_handler_t *hnd) {
+    int i;
+
+    for(i = 0; i < NMMGR_MAX_HANDLERS; i++) {
+        if(!nmmgr_handlers[i]) {
+            nmmgr_handlers[i] = hnd;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int nmmgr_handler_remove(nmmgr_handler_t *hnd) {
+    int i;
+
+    for(i = 0; i < NMMGR_MAX_HANDLERS; i++) {
+        if(nmmgr_handlers[i] == hnd) {
+            nmmgr_handlers[i] = NULL;
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -13,6 +13,7 @@
 
 #include <kos/thread.h>
 #include <kos/mutex.h>
+#include <kos/cond.h>
 
 /*
 
@@ -33,12 +34,15 @@ they require their parameters to be in certain registers, which is
 normally the case with the default options. If in doubt, decompile the
 output and look to make sure.
 
-XXX: This could all be done in a non-blocking way by taking advantage of
-command queuing. Every call to gdc_req_cmd returns a 'request id' which
-just needs to eventually be checked by cmd_stat. A non-blocking version
-of all functions would simply require manual calls to check the status.
-Doing this would probably allow data reading while cdda is playing without
-hiccups (by severely reducing the number of gd commands being sent).
+Commands are queued by cdrom_submit_cmd, which hands back a request id
+straight away. One service thread then hands them to the BIOS, runs the
+BIOS command server and checks on everything outstanding, sleeping
+between rounds, so a thread waiting on a long DMA read sleeps too instead
+of spinning on thd_pass. The service thread keeps the G1 lock from the
+first command it hands over until the last one is over, so a second G1
+ATA device can't select itself under a DMA in flight. cdrom_poll_cmd and
+cdrom_wait_cmd collect the result; cdrom_exec_cmd is just the two back to
+back.
 */
 
 
@@ -101,31 +105,36 @@ int cdrom_set_sector_size(int size) {
     return cdrom_reinit_ex(-1, -1, size);
 }
 
-/* Command execution sequence */
-/* XXX: It might make sense to have a version of this that takes a timeout. */
-int cdrom_exec_cmd(int cmd, void *param) {
-    int status[4] = {0};
-    int f, n;
-    
-    mutex_lock(&_g1_ata_mutex);
-
-    /* Make sure to select the GD-ROM drive. */
-    g1_ata_select_device(G1_ATA_MASTER);
-
-    /* Submit the command and wait for it to finish */
-    f = gdc_req_cmd(cmd, param);
-
-    do {
-        gdc_exec_server();
-        n = gdc_get_cmd_stat(f, status);
-
-        if(n == PROCESSING)
-            thd_pass();
-    }
-    while(n == PROCESSING);
-    
-    mutex_unlock(&_g1_ata_mutex);
-
+/* How many commands can be outstanding at once, and how long the service
+   thread sleeps between checks on them */
+#define GDC_MAX_REQS    16
+#define GDC_POLL_MS     1
+
+/* A command for the BIOS. id is 0 while the slot is free. */
+typedef struct {
+    int     id;         /* Our request id */
+    int     cmd;        /* The command and its parameters */
+    void    *param;
+    int     sent;       /* Handed to the BIOS yet */
+    int     f;          /* The BIOS's request id, once it has been */
+    int     stat;       /* PROCESSING until the BIOS says otherwise */
+    int     rv;         /* ERR_* result once it has */
+} gdc_req_t;
+
+static gdc_req_t gdc_req[GDC_MAX_REQS];
+static int gdc_seq;
+static int gdc_pending;
+static int gdc_bus;     /* The service thread is holding _g1_ata_mutex */
+
+static mutex_t gdc_mutex = MUTEX_INITIALIZER;
+static condvar_t gdc_cond = COND_INITIALIZER;       /* Work for the thread */
+static condvar_t gdc_done_cond = COND_INITIALIZER;  /* A request finished */
+
+static kthread_t *gdc_thd;
+static int gdc_quit;
+
+/* Turn what gdc_get_cmd_stat said into an ERR_* code */
+static int gdc_result(int n, int *status) {
     if(n == COMPLETED)
         return ERR_OK;
     else if(n == ABORTED)
@@ -144,6 +153,232 @@ int cdrom_exec_cmd(int cmd, void *param) {
     }
 }
 
+/* Hand queued requests to the BIOS, run its command server once and note
+   any requests it finished. Called with gdc_mutex held; returns how many
+   are still going. With hold set (the service thread) the G1 lock stays
+   held until none are; otherwise it's let go of on the way out. */
+static int gdc_pump(int hold) {
+    int status[4];
+    int i, n, done = 0;
+
+    if(!gdc_bus)
+        mutex_lock(&_g1_ata_mutex);
+
+    gdc_bus = hold;
+
+    /* Make sure to select the GD-ROM drive. */
+    g1_ata_select_device(G1_ATA_MASTER);
+
+    for(i = 0; i < GDC_MAX_REQS; i++) {
+        if(gdc_req[i].id && !gdc_req[i].sent) {
+            gdc_req[i].f = gdc_req_cmd(gdc_req[i].cmd, gdc_req[i].param);
+            gdc_req[i].sent = 1;
+        }
+    }
+
+    gdc_exec_server();
+
+    for(i = 0; i < GDC_MAX_REQS; i++) {
+        if(!gdc_req[i].id || gdc_req[i].stat != PROCESSING)
+            continue;
+
+        status[0] = 0;
+        n = gdc_get_cmd_stat(gdc_req[i].f, status);
+
+        if(n != PROCESSING) {
+            gdc_req[i].stat = n;
+            gdc_req[i].rv = gdc_result(n, status);
+            gdc_pending--;
+            done++;
+        }
+    }
+
+    if(!gdc_pending || !hold) {
+        gdc_bus = 0;
+        mutex_unlock(&_g1_ata_mutex);
+    }
+
+    if(done)
+        cond_broadcast(&gdc_done_cond);
+
+    return gdc_pending;
+}
+
+/* The service thread: keep the BIOS server running while anything is
+   outstanding, and sleep otherwise. */
+static void *gdc_thread(void *param) {
+    (void)param;
+
+    mutex_lock(&gdc_mutex);
+
+    while(!gdc_quit) {
+        if(!gdc_pending)
+            cond_wait(&gdc_cond, &gdc_mutex);
+        else if(gdc_pump(1))
+            cond_wait_timed(&gdc_cond, &gdc_mutex, GDC_POLL_MS);
+    }
+
+    if(gdc_bus) {
+        gdc_bus = 0;
+        mutex_unlock(&_g1_ata_mutex);
+    }
+
+    mutex_unlock(&gdc_mutex);
+    return NULL;
+}
+
+/* Find the slot of a request id. Called with gdc_mutex held. */
+static gdc_req_t *gdc_find(int id) {
+    if(id <= 0 || gdc_req[id % GDC_MAX_REQS].id != id)
+        return NULL;
+
+    return gdc_req + (id % GDC_MAX_REQS);
+}
+
+/* Queue a command with the BIOS. With wait set, block for a free slot
+   instead of failing. */
+static int gdc_submit(int cmd, void *param, int wait) {
+    gdc_req_t *r;
+    int i;
+
+    mutex_lock(&gdc_mutex);
+
+    for(;;) {
+        for(i = 0; i < GDC_MAX_REQS; i++) {
+            if(!gdc_req[i].id)
+                break;
+        }
+
+        if(i < GDC_MAX_REQS)
+            break;
+
+        if(!wait) {
+            mutex_unlock(&gdc_mutex);
+            return 0;
+        }
+
+        cond_wait(&gdc_done_cond, &gdc_mutex);
+    }
+
+    /* The low bits of an id are its slot, the rest count up so a stale id
+       doesn't match the slot's next user */
+    if(++gdc_seq > 0x7fffffff / GDC_MAX_REQS - 1)
+        gdc_seq = 1;
+
+    /* Whoever runs the server next hands it to the BIOS */
+    r = gdc_req + i;
+    r->id = gdc_seq * GDC_MAX_REQS + i;
+    r->cmd = cmd;
+    r->param = param;
+    r->sent = 0;
+    r->stat = PROCESSING;
+    r->rv = ERR_OK;
+    gdc_pending++;
+    cond_signal(&gdc_cond);
+
+    mutex_unlock(&gdc_mutex);
+    return r->id;
+}
+
+/* Queue a command; param has to stay put until the command is over. */
+int cdrom_submit_cmd(int cmd, void *param) {
+    return gdc_submit(cmd, param, 0);
+}
+
+/* Check on a command without blocking. Returns PROCESSING while it runs;
+   after that the BIOS's final status, with the ERR_* result in rv. */
+int cdrom_poll_cmd(int id, int *rv) {
+    gdc_req_t *r;
+    int stat;
+
+    mutex_lock(&gdc_mutex);
+
+    if(!(r = gdc_find(id))) {
+        mutex_unlock(&gdc_mutex);
+
+        if(rv)
+            *rv = ERR_NO_ACTIVE;
+
+        return NO_ACTIVE;
+    }
+
+    /* Without the service thread, whoever asks runs the server */
+    if(!gdc_thd && r->stat == PROCESSING)
+        gdc_pump(0);
+
+    if((stat = r->stat) != PROCESSING) {
+        if(rv)
+            *rv = r->rv;
+
+        r->id = 0;
+        cond_broadcast(&gdc_done_cond);
+    }
+
+    mutex_unlock(&gdc_mutex);
+    return stat;
+}
+
+/* Sleep until a command is over and return its result */
+int cdrom_wait_cmd(int id) {
+    gdc_req_t *r;
+    int rv;
+
+    mutex_lock(&gdc_mutex);
+
+    if(!(r = gdc_find(id))) {
+        mutex_unlock(&gdc_mutex);
+        return ERR_NO_ACTIVE;
+    }
+
+    while(r->stat == PROCESSING) {
+        if(gdc_thd) {
+            cond_wait(&gdc_done_cond, &gdc_mutex);
+        }
+        else if(gdc_pump(0)) {
+            /* No service thread yet (before cdrom_init): do it ourselves */
+            mutex_unlock(&gdc_mutex);
+            thd_pass();
+            mutex_lock(&gdc_mutex);
+        }
+    }
+
+    rv = r->rv;
+    r->id = 0;
+    cond_broadcast(&gdc_done_cond);
+    mutex_unlock(&gdc_mutex);
+
+    return rv;
+}
+
+/* Run a command start to finish from a thread holding _g1_ata_mutex,
+   which keeps the service thread off the BIOS meanwhile; it only lets go
+   of the lock with nothing outstanding, so this is all the BIOS has. */
+static int gdc_exec_held(int cmd, void *param) {
+    int status[4] = {0};
+    int f, n;
+
+    g1_ata_select_device(G1_ATA_MASTER);
+    f = gdc_req_cmd(cmd, param);
+
+    for(;;) {
+        gdc_exec_server();
+
+        if((n = gdc_get_cmd_stat(f, status)) != PROCESSING)
+            break;
+
+        thd_sleep(GDC_POLL_MS);
+    }
+
+    return gdc_result(n, status);
+}
+
+/* Command execution sequence. Mustn't be called with _g1_ata_mutex held:
+   the service thread needs it to run the command. */
+/* XXX: It might make sense to have a version of this that takes a timeout. */
+int cdrom_exec_cmd(int cmd, void *param) {
+    return cdrom_wait_cmd(gdc_submit(cmd, param, 1));
+}
+
 /* Return the status of the drive as two integers (see constants) */
 int cdrom_get_status(int *status, int *disc_type) {
     int     rv = ERR_OK;
@@ -236,17 +471,18 @@ int cdrom_reinit_ex(int sector_part, int cdxa, int sector_size) {
     int r = -1;
     int timeout;
 
+    /* CMD_INIT and the data type change go together, so no one else's
+       command can come between them: the commands are run from here
+       rather than queued for the service thread, which waits for the lock
+       meanwhile. */
     mutex_lock(&_g1_ata_mutex);
 
     /* Try a few times; it might be busy. If it's still busy
        after this loop then it's probably really dead. */
     timeout = 10 * 1000 / 20; /* 10 second timeout */
 
-    /* Make sure to select the GD-ROM drive. */
-    g1_ata_select_device(G1_ATA_MASTER);
-
     while(timeout > 0) {
-        r = cdrom_exec_cmd(CMD_INIT, NULL);
+        r = gdc_exec_held(CMD_INIT, NULL);
 
         if(r == 0) break;
 
@@ -288,10 +524,7 @@ int cdrom_read_toc(CDROM_TOC *toc_buffer, int session) {
     params.session = session;
     params.buffer = toc_buffer;
 
-    mutex_lock(&_g1_ata_mutex);
-
     rv = cdrom_exec_cmd(CMD_GETTOC2, &params);
-    mutex_unlock(&_g1_ata_mutex);
 
     return rv;
 }
@@ -310,19 +543,14 @@ int cdrom_read_sectors_ex(void *buffer, int sector, int cnt, int mode) {
     params.buffer = buffer; /* Output buffer */
     params.dunno = 0;       /* ? */
 
-    mutex_lock(&_g1_ata_mutex);
-
-    /* The DMA mode blocks the thread it is called in by the way we execute
-       gd syscalls. It does however allow for other threads to run. */
-    /* XXX: DMA Mode may conflict with using a second G1ATA device. More 
-       testing is needed from someone with such a device.
-    */
+    /* The calling thread sleeps until the service thread sees the command
+       finish. The service thread holds the G1 lock all the while, so a
+       second G1 ATA device can't take the bus in the middle of a DMA. */
     if(mode == CDROM_READ_DMA)
         rv = cdrom_exec_cmd(CMD_DMAREAD, &params);
     else if (mode == CDROM_READ_PIO)
         rv = cdrom_exec_cmd(CMD_PIOREAD, &params);
 
-    mutex_unlock(&_g1_ata_mutex);
     return rv;
 }
 
@@ -348,9 +576,7 @@ int cdrom_get_subcode(void *buffer, int buflen, int which) {
     params.which = which;
     params.buflen = buflen;
     params.buffer = buffer;
-    mutex_lock(&_g1_ata_mutex);
     rv = cdrom_exec_cmd(CMD_GETSCD, &params);
-    mutex_unlock(&_g1_ata_mutex);
     return rv;
 }
 
@@ -395,15 +621,11 @@ int cdrom_cdda_play(uint32 start, uint32 end, uint32 repeat, int mode) {
     params.end = end;
     params.repeat = repeat;
 
-    mutex_lock(&_g1_ata_mutex);
-
     if(mode == CDDA_TRACKS)
         rv = cdrom_exec_cmd(CMD_PLAY, &params);
     else if(mode == CDDA_SECTORS)
         rv = cdrom_exec_cmd(CMD_PLAY2, &params);
 
-    mutex_unlock(&_g1_ata_mutex);
-
     return rv;
 }
 
@@ -411,9 +633,7 @@ int cdrom_cdda_play(uint32 start, uint32 end, uint32 repeat, int mode) {
 int cdrom_cdda_pause() {
     int rv;
 
-    mutex_lock(&_g1_ata_mutex);
     rv = cdrom_exec_cmd(CMD_PAUSE, NULL);
-    mutex_unlock(&_g1_ata_mutex);
 
     return rv;
 }
@@ -422,9 +642,7 @@ int cdrom_cdda_pause() {
 int cdrom_cdda_resume() {
     int rv;
 
-    mutex_lock(&_g1_ata_mutex);
     rv = cdrom_exec_cmd(CMD_RELEASE, NULL);
-    mutex_unlock(&_g1_ata_mutex);
 
     return rv;
 }
@@ -433,9 +651,7 @@ int cdrom_cdda_resume() {
 int cdrom_spin_down() {
     int rv;
 
-    mutex_lock(&_g1_ata_mutex);
     rv = cdrom_exec_cmd(CMD_STOP, NULL);
-    mutex_unlock(&_g1_ata_mutex);
 
     return rv;
 }
@@ -475,6 +691,10 @@ int cdrom_init() {
     gdc_init_system();
     mutex_unlock(&_g1_ata_mutex);
 
+    /* Start the thread that runs the BIOS command server */
+    gdc_quit = 0;
+    gdc_thd = thd_create(0, gdc_thread, NULL);
+
     /* Do an initial initialization */
     cdrom_reinit();
 
@@ -482,6 +702,22 @@ int cdrom_init() {
 }
 
 void cdrom_shutdown() {
+    kthread_t *thd = gdc_thd;
+
+    if(!thd)
+        return;
+
+    /* Let anything still outstanding finish, then stop the service
+       thread. Stragglers fall back to running the server themselves. */
+    mutex_lock(&gdc_mutex);
+
+    while(gdc_pending)
+        cond_wait(&gdc_done_cond, &gdc_mutex);
+
+    gdc_quit = 1;
+    gdc_thd = NULL;
+    cond_signal(&gdc_cond);
+    mutex_unlock(&gdc_mutex);
 
-    /* What would you want done here? */
+    thd_join(thd, NULL);
 }